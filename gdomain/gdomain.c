@@ -22,7 +22,7 @@ static void *on_error_message(struct gale_message *msg,void *x) {
 
 static void *on_connected(struct gale_server *server,
 	struct gale_text host,
-	struct sockaddr_in addr,void *x)
+	const struct sockaddr *addr,void *x)
 {
 	struct gale_error_queue *queue = gale_make_queue(source);
 	gale_on_queue(queue,on_error_message,line);
@@ -67,6 +67,7 @@ int do_kill = 0;			/* Kill other gsub processes? */
 int do_exit = 0;			/* Just exit? */
 int do_chat = 0;			/* Report goings-on? */
 int do_verbose = 0;			/* Report everything? */
+int do_worker = 0;			/* Keep one gsubrc running? */
 int sequence = 0;
 
 /* Queue used to serialize message formatting. */
@@ -144,39 +145,61 @@ static void *on_disconnect(struct gale_server *server,void *data) {
 	return OOP_CONTINUE;
 }
 
-/* Transmit a message body to a gsubrc process. */
-static void send_message(char *body,char *end,int fd) {
-	char *tmp;
+/* Write all of a buffer, or report why not. */
+static int write_all(int fd,const byte *p,size_t len) {
+	while (len > 0) {
+		const ssize_t r = write(fd,p,len);
+		if (r < 0 && EINTR == errno) continue;
+		if (r <= 0) {
+			gale_alert(GALE_WARNING,G_("write"),errno);
+			return 0;
+		}
+		p += r;
+		len -= r;
+	}
+	return 1;
+}
 
+/* Append a message body to a buffer, translating CRLF to NL. */
+static void pack_body(struct gale_data *buf,const char *body,const char *end) {
 	while (body != end) {
-		/* Write data up to a newline. */
-		tmp = memchr(body,'\r',end - body);
-		if (!tmp) tmp = end;
-		while (body != tmp) {
-			int r;
-			do r = write(fd,body,tmp - body);
-			while (r <= 0 && errno == EINTR);
-			if (r <= 0) {
-				gale_alert(GALE_WARNING,G_("write"),errno);
-				return;
-			}
-			body += r;
+		if ('\r' != *body)
+			buf->p[buf->l++] = *body++;
+		else {
+			buf->p[buf->l++] = '\n';
+			if (++body != end && '\n' == *body) ++body;
 		}
+	}
+}
 
-		/* Translate CRLF to NL. */
-		if (tmp != end) {
-			int r;
-			do r = write(fd,"\n",1);
-			while (r <= 0 && errno == EINTR);
-			if (r != 1) {
-				gale_alert(GALE_WARNING,G_("write"),errno);
-				return;
-			}
-			++tmp;
-			if (tmp != end && *tmp == '\n') ++tmp;
-		}
-		body = tmp;
+/* Transmit a message body to a gsubrc process. */
+static void send_message(char *body,char *end,int fd) {
+	struct gale_data buf;
+	buf.p = gale_malloc_atomic(end - body);
+	buf.l = 0;
+	pack_body(&buf,body,end);
+	write_all(fd,buf.p,buf.l);
+	gale_free(buf.p);
+}
+
+/* Variables for the gsubrc: the environment, or a worker record. */
+static struct gale_map *fields = NULL;
+
+static void define(struct gale_text name,struct gale_text value) {
+	struct gale_text *copy;
+	if (NULL == fields) {
+		gale_set(name,value);
+		return;
 	}
+
+	gale_create(copy);
+	*copy = value;
+	gale_map_add(fields,gale_text_as_data(name),copy);
+}
+
+static int is_defined(struct gale_text name) {
+	if (NULL == fields) return gale_var(name).l > 0;
+	return NULL != gale_map_find(fields,gale_text_as_data(name));
 }
 
 /* Define a set of environment variables. */
@@ -187,7 +210,7 @@ static void set_list(struct gale_text base,struct gale_location **loc) {
 		if (i > 0) name = gale_text_concat(3,
 			base,G_("_"),
 			gale_text_from_number(1 + i,10,0));
-		gale_set(name,gale_location_name(loc[i]));
+		define(name,gale_location_name(loc[i]));
 	}
 }
 
@@ -249,6 +272,212 @@ static void *on_status(int status,void *x) {
 	return next_message();
 }
 
+/* Find the gsubrc to run (null_text for the built-in one). */
+static struct gale_text find_gsubrc(void) {
+	static int first = 1;
+	static struct gale_text notice;
+	struct gale_text rc;
+
+	if (0 != rcprog.l) 
+		rc = rcprog;
+	else 
+		rc = dir_search(G_("gsubrc"),1,
+			gale_global->dot_gale,
+			gale_global->sys_dir,
+			null_text);
+
+	if (do_verbose 
+	&& (first || gale_text_compare(notice,rc))) {
+		if (0 == rc.l)
+			gale_alert(GALE_NOTICE,
+				G_("using built-in gsubrc"),0);
+		else
+			gale_alert(GALE_NOTICE,gale_text_concat(
+				3,G_("running gsubrc \""),
+				rc,G_("\"")),0);
+		notice = rc;
+		first = 0;
+	}
+
+	return rc;
+}
+
+/* Worker mode (-w): rather than running the gsubrc once per message, run
+   it once, with GALE_WORKER set, and feed it every message in turn.  Each
+   message is a line "<headers> <body>\n" giving two lengths in bytes,
+   then that many bytes of "NAME=value" variables (the ones a gsubrc would
+   otherwise find in its environment), each followed by a NUL, then that
+   many bytes of message body.  The worker acknowledges each message with
+   a line on its standard output holding a number, zero for success, as it
+   would exit; it should write anything else somewhere else.  Up to
+   WORKER_WINDOW messages may be waiting for acknowledgement.  If the
+   worker exits it is started again, unless it never acknowledged
+   anything, in which case we go back to running a gsubrc per message. */
+
+#define WORKER_WINDOW 16
+
+int worker_in = -1,worker_out = -1;	/* Pipes to and from the worker. */
+int worker_pending = 0;			/* Messages not yet acknowledged. */
+int worker_acked = 0;			/* Has it ever acknowledged one? */
+int worker_blocked = 0;			/* Waiting for the window to open? */
+char worker_line[32];			/* Partial acknowledgement. */
+size_t worker_len = 0;
+
+static void report_status(int status) {
+	if (status != 0)
+		gale_alert(GALE_NOTICE,gale_text_concat(2,
+			G_("gsubrc returned error "),
+			gale_text_from_number(status,10,0)),0);
+}
+
+static void *resume(void) {
+	if (!worker_blocked) return OOP_CONTINUE;
+	worker_blocked = 0;
+	return next_message();
+}
+
+static void *stop_worker(void) {
+	if (worker_out >= 0) {
+		source->cancel_fd(source,worker_out,OOP_READ);
+		close(worker_out);
+		close(worker_in);
+	}
+
+	worker_in = worker_out = -1;
+	if (worker_pending > 0)
+		gale_alert(GALE_WARNING,gale_text_concat(3,
+			G_("gsubrc worker lost "),
+			gale_text_from_number(worker_pending,10,0),
+			G_(" messages")),0);
+	worker_pending = 0;
+	worker_len = 0;
+	if (!worker_acked) {
+		gale_alert(GALE_WARNING,
+			G_("gsubrc worker failed, running it per message"),0);
+		do_worker = 0;
+	}
+
+	return resume();
+}
+
+static void *on_worker_ack(oop_source *oop,int fd,oop_event ev,void *x) {
+	char buf[256];
+	ssize_t i,r = read(fd,buf,sizeof(buf));
+	if (r < 0 && (EINTR == errno || EAGAIN == errno)) return OOP_CONTINUE;
+	if (r <= 0) return stop_worker();
+
+	for (i = 0; i < r; ++i) {
+		if ('\n' != buf[i]) {
+			if (worker_len < sizeof(worker_line) - 1)
+				worker_line[worker_len++] = buf[i];
+			continue;
+		}
+
+		worker_line[worker_len] = '\0';
+		worker_len = 0;
+		worker_acked = 1;
+		report_status(atoi(worker_line));
+		if (worker_pending > 0) --worker_pending;
+	}
+
+	return (worker_pending < WORKER_WINDOW) ? resume() : OOP_CONTINUE;
+}
+
+static void *on_worker_exit(int status,void *x) {
+	if (WIFSIGNALED(status))
+		gale_alert(GALE_WARNING,gale_text_concat(2,
+			G_("gsubrc worker died with signal "),
+			gale_text_from_number(WTERMSIG(status),10,0)),0);
+	else if (WIFEXITED(status) && WEXITSTATUS(status) > 0)
+		gale_alert(GALE_NOTICE,gale_text_concat(2,
+			G_("gsubrc worker returned error "),
+			gale_text_from_number(WEXITSTATUS(status),10,0)),0);
+	return OOP_CONTINUE; /* on_worker_ack sees the pipe close */
+}
+
+/* Make sure the worker is running; return zero if we can't have one. */
+static int start_worker(void) {
+	struct gale_environ *save;
+	struct gale_text rc;
+
+	if (worker_in >= 0) return 1;
+	if (!do_worker || NULL != dl_gsubrc || NULL != dl_gsubrc2) return 0;
+
+	rc = find_gsubrc();
+	if (0 == rc.l) {
+		gale_alert(GALE_WARNING,
+			G_("no gsubrc to run as a worker, using built-in"),0);
+		do_worker = 0;
+		return 0;
+	}
+
+	save = gale_save_environ();
+	gale_set(G_("GALE_WORKER"),G_("1"));
+	gale_exec(source,rc,1,&rc,&worker_in,&worker_out,
+		NULL,on_worker_exit,NULL);
+	gale_restore_environ(save);
+	if (worker_in < 0 || worker_out < 0) {
+		if (worker_in >= 0) close(worker_in);
+		if (worker_out >= 0) close(worker_out);
+		worker_in = worker_out = -1;
+		do_worker = 0;
+		return 0;
+	}
+
+	fcntl(worker_in,F_SETFD,1);
+	fcntl(worker_out,F_SETFD,1);
+	worker_acked = 0;
+	source->on_fd(source,worker_out,OOP_READ,on_worker_ack,NULL);
+	return 1;
+}
+
+/* Send the worker a message, with the variables collected for it. */
+static void *feed_worker(struct gale_map *record,const char *body) {
+	struct gale_data key,msg,buf;
+	struct gale_text *value;
+	const char **vars;
+	size_t header_len = 0;
+	int i,count = 0,ok;
+	char *line;
+
+	key = null_data;
+	while (gale_map_walk(record,&key,&key,NULL)) ++count;
+	gale_create_array(vars,count);
+	key = null_data;
+	for (i = 0; gale_map_walk(record,&key,&key,(void **) &value); ++i) {
+		vars[i] = gale_text_to(gale_global->enc_environ,
+			gale_text_concat(3,gale_text_from_data(key),
+				G_("="),*value));
+		header_len += strlen(vars[i]) + 1;
+	}
+
+	msg.p = gale_malloc_atomic(strlen(body));
+	msg.l = 0;
+	pack_body(&msg,body,body + strlen(body));
+
+	line = gale_text_to(gale_global->enc_ascii,gale_text_concat(4,
+		gale_text_from_number(header_len,10,0),G_(" "),
+		gale_text_from_number(msg.l,10,0),G_("\n")));
+	buf.p = gale_malloc_atomic(strlen(line) + header_len + msg.l);
+	buf.l = 0;
+	gale_pack_copy(&buf,line,strlen(line));
+	for (i = 0; i < count; ++i)
+		gale_pack_copy(&buf,vars[i],strlen(vars[i]) + 1);
+	gale_pack_copy(&buf,msg.p,msg.l);
+
+	ok = write_all(worker_in,buf.p,buf.l);
+	gale_free(msg.p);
+	gale_free(buf.p);
+	if (!ok) {
+		stop_worker();
+		return next_message();
+	}
+
+	if (++worker_pending < WORKER_WINDOW) return next_message();
+	worker_blocked = 1;
+	return OOP_CONTINUE;
+}
+
 /* Take the message passed as an argument and show it to the user, running
    their gsubrc if present, using the default formatter otherwise. */
 static void *show_message(struct gale_message *msg) {
@@ -302,7 +531,8 @@ static void *show_message(struct gale_message *msg) {
 			G_("\"")),0);
 	}
 
-	/* Set some variables for gsubrc. */
+	/* Set some variables for gsubrc, or collect them for the worker. */
+	fields = start_worker() ? gale_make_map(0) : NULL;
 	set_list(G_("GALE_FROM"),msg->from);
 	set_list(G_("GALE_SENDER"),msg->from);
 	set_list(G_("GALE_TO"),msg->to);
@@ -387,19 +617,26 @@ static void *show_message(struct gale_message *msg) {
 
 		i = 1;
 		name = base;
-		while (gale_var(name).l > 0)
+		while (is_defined(name))
 			name = gale_text_concat(3,base,G_("_"),
 				gale_text_from_number(++i,10,0));
 
-		gale_set(name,value);
+		define(name,value);
 	}
 
 	/* Set GALE_VERBOSE to the desired verbosity level */
-	gale_set(G_("GALE_VERBOSE"),gale_text_from_number(do_verbose,10,0));
+	define(G_("GALE_VERBOSE"),gale_text_from_number(do_verbose,10,0));
 
 	/* Convert the message body to local format. */
 	szbody = gale_text_to(gale_global->enc_console,body);
 
+	if (NULL != fields) {
+		struct gale_map * const record = fields;
+		fields = NULL;
+		gale_restore_environ(save);
+		return feed_worker(record,szbody);
+	}
+
 	/* Use the extended loaded gsubrc, if present. */
 	if (dl_gsubrc2) {
 		status = dl_gsubrc2(environ,szbody,strlen(szbody));
@@ -410,31 +647,7 @@ static void *show_message(struct gale_message *msg) {
 		int pfd;
 
 		/* Create the gsubrc process. */
-		if (NULL == dl_gsubrc) {
-			static int first = 1;
-			static struct gale_text notice;
-
-			if (0 != rcprog.l) 
-				rc = rcprog;
-			else 
-				rc = dir_search(G_("gsubrc"),1,
-					gale_global->dot_gale,
-					gale_global->sys_dir,
-					null_text);
-
-			if (do_verbose 
-			&& (first || gale_text_compare(notice,rc))) {
-				if (0 == rc.l)
-					gale_alert(GALE_NOTICE,
-						G_("using built-in gsubrc"),0);
-				else
-					gale_alert(GALE_NOTICE,gale_text_concat(
-						3,G_("running gsubrc \""),
-						rc,G_("\"")),0);
-				notice = rc;
-				first = 0;
-			}
-		}
+		if (NULL == dl_gsubrc) rc = find_gsubrc();
 
 		gale_exec(source,rc,1,&rc,&pfd,NULL,on_gsubrc,on_status,NULL);
 
@@ -485,7 +698,7 @@ static void *on_packet(
 static void usage(void) {
 	fprintf(stderr,
 	"%s\n"
-	"usage: gsub [-haAekKnqrv] [-N name] [-f rcprog] "
+	"usage: gsub [-haAekKnqrvw] [-N name] [-f rcprog] "
 #ifdef HAVE_DLOPEN
 	"[-l rclib] "
 #endif
@@ -502,6 +715,7 @@ static void usage(void) {
 	"       -v          Extra verbose mode\n"
 	"       -r          Run the default internal gsubrc and exit\n"
 	"       -f rcprog   Use rcprog (default gsubrc, if found)\n"
+	"       -w          Keep one gsubrc running and stream messages to it\n"
 #ifdef HAVE_DLOPEN
 	"       -l rclib    Use module (default gsubrc.so, if found)\n" 
 #endif
@@ -586,7 +800,7 @@ static int add_sub(void) {
 
 static void *on_reconnect(
 	struct gale_server *server,
-	struct gale_text host,struct sockaddr_in addr,void *d) 
+	struct gale_text host,const struct sockaddr *addr,void *d) 
 {
 	assert(0 != routing.l);
 	link_subscribe(conn,routing);
@@ -695,7 +909,7 @@ static void *on_static_loc(struct gale_text n,struct gale_location *l,void *x) {
 
 static void *on_connected(
 	struct gale_server *server,
-	struct gale_text host,struct sockaddr_in addr,void *d) 
+	struct gale_text host,const struct sockaddr *addr,void *d) 
 {
 	if (do_chat) gale_alert(GALE_NOTICE,gale_text_concat(2,
 		G_("connected to "),
@@ -761,7 +975,7 @@ int main(int argc,char **argv) {
 	if (!presence.l) presence = G_("in.present");
 
 	/* Parse command line arguments. */
-	while (EOF != (opt = getopt(argc,argv,"dDhaAenN:kKqvrf:l:p:"))) {
+	while (EOF != (opt = getopt(argc,argv,"dDhaAenN:kKqvrwf:l:p:"))) {
 	struct gale_text str = !optarg ? lame :
 		gale_text_from(gale_global->enc_cmdline,optarg,-1);
 	switch (opt) {
@@ -807,6 +1021,10 @@ int main(int argc,char **argv) {
 		do_run_default = 1;
 		break;
 
+	case 'w': /* Stream messages to one gsubrc */
+		do_worker = 1;
+		break;
+
 	case 'f': /* Use a wacky gsubrc */
 		rcprog = str;	                
 		if (do_chat) gale_alert(GALE_NOTICE,gale_text_concat(3,
@@ -123,12 +123,12 @@ typedef void *gale_call_disconnect(struct gale_server *serv,void *user);
 /** Function type for user-defined notification handler for connection.
  *  \param serv The server handle.
  *  \param host The hostname of the chosen server.
- *  \param addr The IP address of the chosen server.
+ *  \param addr The address (IPv4 or IPv6) of the chosen server.
  *  \param user The user-defined parameter to pass the function. 
  *  \return Liboop continuation code (usually OOP_CONTINUE).
  *  \sa gale_on_connect() */
 typedef void *gale_call_connect(struct gale_server *serv,
-	struct gale_text host,struct sockaddr_in addr,void *);
+	struct gale_text host,const struct sockaddr *addr,void *);
 
 /** Set a handler to be called when a connection is established.
  *  When gale_make_server() is called, the connection process is initiated 
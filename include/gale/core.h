@@ -79,20 +79,31 @@ struct gale_link *new_link(struct oop_source *oop);
 void delete_link(struct gale_link *);
 void link_shutdown(struct gale_link *);
 void link_set_fd(struct gale_link *,int fd);
+int link_detach(struct gale_link *,int *version);
+void link_adopt(struct gale_link *,int fd,int version);
 int link_get_fd(struct gale_link *);
+void link_use_ring(struct gale_link *,size_t size);
 
 void link_on_error(struct gale_link *,
      void *(*)(struct gale_link *,int,void *),
      void *);
 
 void link_put(struct gale_link *,struct gale_packet *);
+int link_put_latest(struct gale_link *,struct gale_packet *);
 void link_will(struct gale_link *,struct gale_packet *);
 void link_subscribe(struct gale_link *,struct gale_text spec);
+void link_since(struct gale_link *,struct gale_time when);
+struct gale_time link_received(struct gale_link *);
 
 int link_queue_num(struct gale_link *);
 size_t link_queue_mem(struct gale_link *);
+struct gale_packet *link_queue_get(struct gale_link *);
 struct gale_time link_queue_time(struct gale_link *);
-void link_queue_drop(struct gale_link *);
+struct gale_packet *link_queue_drop(struct gale_link *);
+struct gale_packet *link_queue_drop_newest(struct gale_link *);
+int link_queue_shed(struct gale_link *,
+     int (*)(struct gale_packet *,void *),void *,
+     int num,size_t mem);
 
 void link_on_empty(struct gale_link *, 
      void *(*)(struct gale_link *,void *),
@@ -106,6 +117,12 @@ void link_on_will(struct gale_link *,
 void link_on_subscribe(struct gale_link *,
      void *(*)(struct gale_link *,struct gale_text,void *),
      void *);
+void link_on_since(struct gale_link *,
+     void *(*)(struct gale_link *,struct gale_time,void *),
+     void *);
+void link_on_dequeue(struct gale_link *,
+     void (*)(struct gale_link *,struct gale_packet *,struct gale_time,void *),
+     void *);
 /*@}*/
 
 /** \name Sticky Categories
@@ -36,6 +36,7 @@ extern struct gale_global_data {
 	struct gale_map *cache_tree;
 	struct gale_cleanup *cleanup_list;
 	struct gale_errors *error;
+	struct gale_map *metrics;
 
 	/* Default character set encodings to use for various circumstances. */
 	struct gale_encoding 
@@ -100,6 +100,7 @@ void gale_watch_tty(oop_source *oop,int fd);
 
 void gale_daemon(oop_source *);
 void gale_detach(oop_source *);
+void gale_on_hangup(oop_source *,oop_call_signal *,void *);
 /*@}*/
 
 /** \name Memory Management */
@@ -541,6 +542,21 @@ void gale_set_file_time(struct gale_file_state *state,struct gale_time);
 
 /*@}*/
 
+/** \name Record Stores
+ *  Memory-mapped files of timestamped key-value records, shared between
+ *  processes.  Updates are appended and the file is compacted as needed. */
+/*@{*/
+struct gale_store;
+struct gale_store *gale_open_store(struct gale_text name,int mode);
+int gale_store_find(struct gale_store *,struct gale_data key,
+	struct gale_data *value,struct gale_time *stamp);
+int gale_store_put(struct gale_store *,struct gale_data key,
+	struct gale_data value,struct gale_time stamp);
+int gale_store_erase(struct gale_store *,struct gale_data key,
+	struct gale_time stamp);
+int gale_store_compact(struct gale_store *);
+/*@}*/
+
 /** \name Error Reporting */
 /*@{*/
 /** Degree of error severity for gale_alert(). */
@@ -598,6 +614,32 @@ void gale_report_remove(struct gale_report *,gale_report_call *,void *);
  *  \return The full report text. */
 struct gale_text gale_report_run(struct gale_report *);
 
+/** Kinds of metric.  \sa gale_make_metric(), gale_make_histogram() */
+enum { metric_counter, metric_gauge, metric_histogram };
+struct gale_metric;
+
+/** Function type for a gauge computed on demand.
+ *  \param user A user-defined parameter.
+ *  \return The current value of the gauge.
+ *  \sa gale_metric_probe() */
+typedef double gale_metric_call(void *user);
+
+struct gale_metric *gale_make_metric(
+	struct gale_text name,struct gale_text labels,int type);
+struct gale_metric *gale_make_histogram(
+	struct gale_text name,struct gale_text labels,
+	double first,int count);
+void gale_metric_remove(struct gale_metric *);
+
+void gale_metric_add(struct gale_metric *,double delta);
+void gale_metric_set(struct gale_metric *,double value);
+void gale_metric_probe(struct gale_metric *,gale_metric_call *,void *user);
+void gale_metric_observe(struct gale_metric *,double value);
+
+/** Generate a machine-readable snapshot of all registered metrics.
+ *  \return The formatted metrics. */
+struct gale_text gale_metric_run(void);
+
 /** Debugging printf.  Will only output if \a gale_debug > \a level. 
  *  \todo Fix this to be less gross! */
 void gale_dprintf(int level,const char *fmt,...);
@@ -614,15 +656,15 @@ void gale_diprintf(int level,int indent,const char *fmt,...);
 /** Callback when a connection completes. 
  *  \param fd File descriptor of completed connection (-1 if failed).
  *  \param hostname Name of remote host. 
- *  \param addr IP address of remote host.
+ *  \param addr Address of remote host (IPv4 or IPv6; AF_UNSPEC if failed).
  *  \param found_local Nonzero if any of the specified addresses were local.
  *  \param user User-supplied parameter. 
  *  \return Liboop continuation code (usually OOP_CONTINUE). */
 typedef void *gale_connect_call(int fd,
-	struct gale_text hostname,struct sockaddr_in addr,
+	struct gale_text hostname,const struct sockaddr *addr,
 	int found_local,void *user);
 
-struct gale_text gale_connect_text(struct gale_text host,struct sockaddr_in);
+struct gale_text gale_connect_text(struct gale_text host,const struct sockaddr *);
 
 struct gale_connect;
 struct gale_connect *gale_make_connect(
@@ -630,6 +672,7 @@ struct gale_connect *gale_make_connect(
 	gale_connect_call *,void *);
 
 void gale_abort_connect(struct gale_connect *);
+struct gale_text gale_local_socket(int port);
 /*@}*/
 
 #endif
@@ -4,10 +4,12 @@
 #include "gale/key.h"
 #include "gale/client.h"
 #include "gale/misc.h"
+#include "gale/globals.h"
 
 #include <assert.h>
 
 struct find {
+	struct gale_text name;
 	struct gale_location *loc;
 	gale_call_location *func;
 	void *user;
@@ -16,8 +18,158 @@ struct find {
 	int count,flags,is_found;
 };
 
-static gale_key_call on_key;
+/* A resolution recovered from the location cache, being checked against
+   the keys we can actually load. */
+struct cached {
+	struct find *find;
+	struct gale_location *loc;
+	struct gale_key *key;
+	struct gale_map *members;
+	int members_null,count,is_ok;
+};
+
+static gale_key_call on_key,on_cached_key;
 static void *on_graph(oop_source *,struct gale_map *,int,int,void *);
+static void find_key(oop_source *,struct find *);
+
+/* -- cache of resolved locations ------------------------------------------ */
+
+/* The cache holds conclusions (which key and members a name resolves to)
+   rather than signed data, so nothing in it can be checked on the way
+   back in; it is private to the user, never shared through sys_dir. */
+
+static struct gale_store **cache_store = NULL;
+static int cache_interval = 900;
+
+static struct gale_store *get_cache(void) {
+	if (NULL == cache_store) {
+		struct gale_text name = gale_var(G_("GALE_LOCATION_CACHE"));
+		const struct gale_text ttl = gale_var(G_("GALE_LOCATION_TTL"));
+
+		cache_store = gale_malloc_safe(sizeof(*cache_store));
+		*cache_store = NULL;
+		if (0 != ttl.l) cache_interval = gale_text_to_number(ttl);
+		if (cache_interval <= 0) return NULL;
+
+		if (0 == name.l) name = dir_file(
+			gale_global->dot_gale,G_("locations"));
+		*cache_store = gale_open_store(name,0600);
+	}
+
+	return *cache_store;
+}
+
+/* Record: resolved name, key name, members_null, member count, members. */
+static void cache_put(struct find *find) {
+	struct gale_store * const store = get_cache();
+	const struct gale_text resolved = gale_location_name(find->loc);
+	const struct gale_text key_name = gale_key_name(find->loc->key);
+	struct gale_data value,key = null_data;
+	size_t size;
+	u32 count = 0;
+	if (NULL == store) return;
+
+	size = gale_text_size(resolved) + gale_text_size(key_name)
+	     + 2 * gale_u32_size();
+	while (gale_map_walk(find->loc->members,&key,&key,NULL)) {
+		size += gale_text_size(gale_text_from_data(key));
+		++count;
+	}
+
+	value.p = gale_malloc_atomic(size);
+	value.l = 0;
+	gale_pack_text(&value,resolved);
+	gale_pack_text(&value,key_name);
+	gale_pack_u32(&value,find->loc->members_null);
+	gale_pack_u32(&value,count);
+	key = null_data;
+	while (gale_map_walk(find->loc->members,&key,&key,NULL))
+		gale_pack_text(&value,gale_text_from_data(key));
+	assert(value.l == size);
+
+	gale_store_put(store,gale_text_as_data(find->name),value,
+		gale_time_add(find->now,gale_time_seconds(cache_interval)));
+}
+
+static void *on_cached(oop_source *oop,struct cached *cached) {
+	struct find * const find = cached->find;
+	if (!cached->is_ok) {
+		find_key(oop,find);
+		return OOP_CONTINUE;
+	}
+
+	find->is_found = 1;
+	find->loc = cached->loc;
+	find->loc->key = cached->key;
+	find->loc->members = cached->members;
+	find->loc->members_null = cached->members_null;
+	return find->func(gale_location_name(find->loc),find->loc,find->user);
+}
+
+static void *on_cached_key(oop_source *oop,struct gale_key *key,void *user) {
+	struct cached * const cached = (struct cached *) user;
+	if (NULL == gale_key_public(key,cached->find->now)) cached->is_ok = 0;
+	if (0 != --(cached->count)) return OOP_CONTINUE;
+	return on_cached(oop,cached);
+}
+
+/* Try to resolve a location from the cache; if it fails, search as usual. */
+static void find_cached(oop_source *oop,struct find *find) {
+	struct gale_store * const store = get_cache();
+	struct gale_text resolved,key_name,member;
+	struct gale_data value,key;
+	struct gale_time expire;
+	struct cached *cached;
+	u32 members_null,count;
+	void *data;
+
+	if (NULL == store
+	|| !gale_store_find(store,gale_text_as_data(find->name),&value,&expire)
+	||  gale_time_compare(find->now,expire) >= 0
+	||  gale_time_compare(expire,gale_time_add(find->now,
+		gale_time_seconds(cache_interval))) > 0
+	|| !gale_unpack_text(&value,&resolved)
+	|| !gale_unpack_text(&value,&key_name)
+	|| !gale_unpack_u32(&value,&members_null)
+	|| !gale_unpack_u32(&value,&count)) {
+		find_key(oop,find);
+		return;
+	}
+
+	gale_create(cached);
+	cached->find = find;
+	cached->loc = client_i_get(resolved);
+	cached->key = gale_key_handle(key_name);
+	cached->members = gale_make_map(0);
+	cached->members_null = members_null;
+	cached->is_ok = (0 != key_name.l);
+	while (count-- > 0) {
+		if (!gale_unpack_text(&value,&member) || 0 == member.l) {
+			cached->is_ok = 0;
+			break;
+		}
+		gale_map_add(cached->members,gale_text_as_data(member),
+			gale_key_handle(member));
+	}
+
+	if (!cached->is_ok) {
+		find_key(oop,find);
+		return;
+	}
+
+	/* Make sure every key involved is at hand, without slow searches. */
+	cached->count = 1;
+	key = null_data;
+	while (gale_map_walk(cached->members,&key,&key,&data)) {
+		++(cached->count);
+		gale_key_search(oop,(struct gale_key *) data,
+			find->flags,on_cached_key,cached);
+	}
+
+	gale_key_search(oop,cached->key,find->flags,on_cached_key,cached);
+}
+
+/* -- location search ------------------------------------------------------- */
 
 static void find_key(oop_source *oop,struct find *find) {
 	const int flags = find->flags; /* can be reset by callbacks */
@@ -110,6 +262,7 @@ static void *on_graph(oop_source *oop,
 	gale_map_add(find->loc->members,
 		gale_text_as_data(gale_key_name(find->loc->key)),
 		find->loc->key);
+	if (is_complete) cache_put(find);
 	return find->func(gale_location_name(find->loc),find->loc,find->user);
 }
 
@@ -171,6 +324,7 @@ void gale_find_exact_location(oop_source *oop,
 	struct find *find;
 	gale_create(find);
 	if (name.l > 0 && '.' == name.p[name.l - 1]) --name.l;
+	find->name = name;
 	find->loc = client_i_get(name);
 	find->func = func;
 	find->user = user;
@@ -182,7 +336,7 @@ void gale_find_exact_location(oop_source *oop,
 
 	if (NULL == gale_key_public(find->loc->key,find->now)) 
 		find->loc->key = NULL;
-	find_key(oop,find);
+	find_cached(oop,find);
 }
 
 /** Find a location's name.
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
@@ -24,7 +25,9 @@ struct gale_server {
 	void *on_connect_data;
 	int on_connect_called;
 	struct gale_text current_host;
-	struct sockaddr_in current_addr;
+	struct sockaddr_storage current_addr;
+	struct gale_time connected,lost;                /* for link_since() */
+	int is_lost;
 
 	gale_call_disconnect *on_disconnect;
 	void *on_disconnect_data;
@@ -75,10 +78,17 @@ static void *on_event(oop_source *oop,struct timeval now,void *user) {
 	if (-1 != link_get_fd(s->link)) {
 		s->on_disconnect_called = 0;
 		if (NULL != s->on_connect && !s->on_connect_called) {
+			void *ret;
 			s->on_connect_called = 1;
-			return s->on_connect(s,
+			ret = s->on_connect(s,
 				s->current_host,
-				s->current_addr,s->on_connect_data);
+				(struct sockaddr *) &s->current_addr,
+				s->on_connect_data);
+			/* Now that the client has resubscribed, ask for
+			   whatever it missed while we were away. */
+			if (s->is_lost) link_since(s->link,s->lost);
+			s->is_lost = 0;
+			return ret;
 		}
 	} else {
 		s->on_connect_called = 0;
@@ -92,7 +102,7 @@ static void *on_event(oop_source *oop,struct timeval now,void *user) {
 }
 
 static void *on_connect(int fd,
-	struct gale_text host,struct sockaddr_in addr,
+	struct gale_text host,const struct sockaddr *addr,
 	int found_local,void *user) 
 {
 	struct gale_server *s = (struct gale_server *) user;
@@ -109,7 +119,11 @@ static void *on_connect(int fd,
 		}
 
 		s->current_host = host;
-		s->current_addr = addr;
+		memset(&s->current_addr,0,sizeof(s->current_addr));
+		memcpy(&s->current_addr,addr,(AF_INET6 == addr->sa_family)
+			? sizeof(struct sockaddr_in6)
+			: sizeof(struct sockaddr_in));
+		s->connected = gale_time_now();
 		link_set_fd(s->link,fd);
 		s->source->on_time(s->source,OOP_TIME_NOW,on_event,s);
 	}
@@ -120,6 +134,9 @@ static void *on_connect(int fd,
 static void *on_error(struct gale_link *l,int err,void *user) {
 	struct gale_server *s = (struct gale_server *) user;
 	assert(l == s->link);
+	s->lost = link_received(l);
+	if (gale_time_compare(s->lost,s->connected) < 0) s->lost = s->connected;
+	s->is_lost = 1;
 	link_set_fd(l,-1);
 	do_retry(s,1);
 	s->source->on_time(s->source,OOP_TIME_NOW,on_event,s);
@@ -130,6 +147,7 @@ struct gale_server *gale_make_server(
 	oop_source *source,struct gale_link *l,
         struct gale_text server,int avoid_local_port) {
 	struct gale_server *s;
+	int ring;
 
 	gale_create(s);
 	s->source = source;
@@ -143,8 +161,12 @@ struct gale_server *gale_make_server(
         if (0 == s->host.l) gale_alert(GALE_ERROR,G_("$GALE_DOMAIN not set"),0);
 	s->on_connect = NULL;
 	s->on_disconnect = NULL;
+	s->is_lost = 0;
+	s->connected = gale_time_zero();
 
 	link_set_fd(l,-1);
+	ring = gale_text_to_number(gale_var(G_("GALE_RING")));
+	if (ring > 0) link_use_ring(l,ring);
 	link_on_error(l,on_error,s);
 	s->connect = gale_make_connect(
 		s->source,s->host,s->avoid_local_port,
@@ -115,7 +115,8 @@ void gale_init(const char *s,int argc,char * const *argv) {
 
 	set_defaults(pwd);
 
+	key_i_init_misses();
 	key_i_init_builtin();
-	key_i_init_dirs();
+	key_i_init_dirs(!key_i_init_store());
 	key_i_init_akd();
 }
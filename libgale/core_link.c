@@ -6,6 +6,7 @@
 #include <assert.h>
 #include <unistd.h>
 #include <errno.h>
+#include <string.h>
 #include <sys/socket.h>
 
 #define opcode_puff 0
@@ -21,17 +22,61 @@
 #define opcode_fetch 9
 #define opcode_miss 10
 #define opcode_supply 11
+#define opcode_ring 12
+#define opcode_since 13
 
 #define SIZE_LIMIT 262144
+#define QUANTUM 4096 /* bytes a flow may send per round */
 #define PROTOCOL_VERSION 1
 #define CID_LENGTH 20
+#define SINCE_LIMIT 4000000 /* seconds; fits a u32 in milliseconds */
+#define SINCE_RECENT 256    /* messages remembered to spot a repeat */
+
+/* A client on a local (UNIX-domain) connection may ask for incoming
+   traffic to come through a shared-memory ring instead of the socket.
+   It sends opcode_ring (with the ring size) along with the ring's
+   descriptors; the other end replies with opcode_ring (1 to accept, 0 to
+   refuse), and after an acceptance writes everything through the ring.
+   The socket then only carries traffic the other way, and tells the
+   client when the server goes away. */
+
+/* A link can be handed to another process (link_detach, link_adopt) once
+   both directions are between messages, so the other process can carry
+   on where this one stopped.  While draining for that, it reads no
+   further than the end of the message under way and starts no new
+   messages, leaving the rest of its queue for the new owner. */
+
+/* A client which has reconnected may send opcode_since, with the age (in
+   milliseconds, so the two clocks needn't agree) of the last message it
+   received; a server which keeps a spool replays what it missed.  The
+   server starts a little early to be sure, so a link which might ask
+   (one which doesn't answer such requests itself) remembers the content
+   of the last SINCE_RECENT messages it received, and drops repeats among
+   the first SINCE_RECENT after asking. */
+
+enum { ring_idle, ring_polling, ring_sleeping };
+
+/* Queued messages are kept in two doubly-linked lists: one of everything,
+   oldest first (for expiry and dropping), and one per flow (for sending).
+   A flow holds the messages for one category (the first in the routing);
+   flows with messages waiting take turns by deficit round robin, so one
+   busy category cannot starve the others. */
 
 struct link {
 	struct gale_packet *msg;
-	struct link *next;
+	struct link *prev,*next;           /* all messages */
+	struct link *flow_prev,*flow_next; /* messages in this flow */
+	struct flow *flow;
 	struct gale_time when;
 };
 
+struct flow {
+	struct gale_data name;
+	struct link *head,*tail;
+	struct flow *prev,*next;           /* flows with messages waiting */
+	size_t deficit;
+};
+
 struct pair {
 	struct gale_data cid;
 	struct gale_text cat;
@@ -58,6 +103,19 @@ struct gale_link {
 	void *(*on_subscribe)(struct gale_link *,struct gale_text,void *);
 	void *on_subscribe_data;
 
+	void *(*on_since)(struct gale_link *,struct gale_time,void *);
+	void *on_since_data;
+
+	void (*on_dequeue)(struct gale_link *,struct gale_packet *,
+	                   struct gale_time,void *);
+	void *on_dequeue_data;
+
+	/* event registrations (only changed when needed) */
+
+	int is_reading,is_writing,is_processing;
+	int notify_empty;                               /* call on_empty */
+	int is_draining;                /* stop at a message boundary */
+
 	/* input stuff */
 
 	struct input_buffer *input;                     /* version 0 */
@@ -65,6 +123,10 @@ struct gale_link {
 	struct gale_packet *in_msg,*in_puff,*in_will;
 	struct gale_text in_gimme,*in_text;
 	int in_version;
+	struct gale_time in_when,in_since;              /* last message, replay */
+	u32 *in_recent;                   /* ids of recent messages, a ring */
+	int in_recent_num,in_recent_next,in_checking;
+	int in_is_since;
 
 	struct gale_text in_publish;                    /* version 1 */
 	struct gale_text in_watch,in_forget,in_complete;
@@ -77,7 +139,11 @@ struct gale_link {
 	struct output_buffer *output;                   /* version 0 */
 	struct gale_packet *out_msg,*out_will;
 	struct gale_text out_text,out_gimme;
-	struct link *out_queue;
+	struct gale_time out_since;
+	int out_is_since;
+	struct link *out_head,*out_tail;
+	struct flow *flow_head,*flow_tail;
+	struct gale_map *out_flows;
 	enum { no_shutdown, do_shutdown, done_shutdown } out_shutdown;
 	int queue_num;
 	size_t queue_mem;
@@ -86,6 +152,17 @@ struct gale_link {
 	struct gale_map *out_watch,*out_complete,*out_assert;
 	struct gale_map *out_fetch,*out_supply;
 	struct gale_data out_cid,out_data;
+
+	/* shared-memory ring */
+
+	size_t ring_size;                               /* to ask for, or 0 */
+	struct ring *in_ring,*out_ring;                 /* in use */
+	struct ring *ring_offer,*ring_accept;           /* not yet in use */
+	int ring_ask,ring_reply,ring_state;
+	int in_fd[RING_FDS],in_fd_num;                  /* descriptors received */
+	int out_fd_num;                                 /* descriptors to send */
+	int in_closed,in_error;                         /* socket behind a ring */
+	u32 out_value;
 };
 
 static void * const st_yes = (void *) 0x1;
@@ -95,18 +172,110 @@ static size_t message_size(struct gale_packet *m) {
 	return gale_u32_size() + m->content.l + m->routing.l * gale_wch_size();
 }
 
-static struct gale_packet *dequeue(struct gale_link *l) {
-	struct gale_packet *m = NULL;
-	if (NULL != l->out_queue) {
-		struct link *link = l->out_queue->next;
-		if (l->out_queue == link)
-			l->out_queue = NULL;
+static struct gale_data flow_name(struct gale_packet *m) {
+	struct gale_text cat = m->routing;
+	int i = 0;
+	while (i < cat.l && ':' != cat.p[i]) ++i;
+	return gale_text_as_data(gale_text_left(cat,i));
+}
+
+static void enqueue(struct gale_link *l,struct link *link) {
+	const struct gale_data name = flow_name(link->msg);
+	struct flow *flow = (struct flow *) gale_map_find(l->out_flows,name);
+	if (NULL == flow) {
+		gale_create(flow);
+		flow->name = name;
+		flow->head = flow->tail = NULL;
+		flow->deficit = 0;
+		flow->next = NULL;
+		flow->prev = l->flow_tail;
+		if (NULL == l->flow_tail)
+			l->flow_head = flow;
 		else
-			l->out_queue->next = link->next;
-		--l->queue_num;
-		l->queue_mem -= message_size(link->msg);
-		m = link->msg;
-		gale_free(link);
+			l->flow_tail->next = flow;
+		l->flow_tail = flow;
+		gale_map_add(l->out_flows,name,flow);
+	}
+
+	link->flow = flow;
+	link->flow_next = NULL;
+	link->flow_prev = flow->tail;
+	if (NULL == flow->tail)
+		flow->head = link;
+	else
+		flow->tail->flow_next = link;
+	flow->tail = link;
+
+	link->next = NULL;
+	link->prev = l->out_tail;
+	if (NULL == l->out_tail)
+		l->out_head = link;
+	else
+		l->out_tail->next = link;
+	l->out_tail = link;
+
+	++l->queue_num;
+	l->queue_mem += message_size(link->msg);
+}
+
+static struct gale_packet *unqueue(struct gale_link *l,struct link *link) {
+	struct flow * const flow = link->flow;
+	struct gale_packet * const m = link->msg;
+
+	if (NULL == link->prev) l->out_head = link->next;
+	else link->prev->next = link->next;
+	if (NULL == link->next) l->out_tail = link->prev;
+	else link->next->prev = link->prev;
+
+	if (NULL == link->flow_prev) flow->head = link->flow_next;
+	else link->flow_prev->flow_next = link->flow_next;
+	if (NULL == link->flow_next) flow->tail = link->flow_prev;
+	else link->flow_next->flow_prev = link->flow_prev;
+
+	if (NULL == flow->head) {
+		if (NULL == flow->prev) l->flow_head = flow->next;
+		else flow->prev->next = flow->next;
+		if (NULL == flow->next) l->flow_tail = flow->prev;
+		else flow->next->prev = flow->prev;
+		gale_map_add(l->out_flows,flow->name,NULL);
+		gale_free(flow);
+	}
+
+	--l->queue_num;
+	l->queue_mem -= message_size(m);
+	gale_free(link);
+	return m;
+}
+
+/* Pick the next message to send, by deficit round robin. */
+static struct link *next_fair(struct gale_link *l) {
+	for (;;) {
+		struct flow * const flow = l->flow_head;
+		const size_t size = message_size(flow->head->msg);
+		if (flow->deficit >= size) {
+			flow->deficit -= size;
+			return flow->head;
+		}
+
+		flow->deficit += QUANTUM;
+		if (flow != l->flow_tail) {
+			l->flow_head = flow->next;
+			l->flow_head->prev = NULL;
+			flow->prev = l->flow_tail;
+			flow->next = NULL;
+			l->flow_tail->next = flow;
+			l->flow_tail = flow;
+		}
+	}
+}
+
+static struct gale_packet *dequeue(struct gale_link *l,int is_sent) {
+	struct gale_packet *m = NULL;
+	if (NULL != l->out_head) {
+		struct link * const link = is_sent ? next_fair(l) : l->out_head;
+		if (is_sent && NULL != l->on_dequeue)
+			l->on_dequeue(l,link->msg,link->when,l->on_dequeue_data);
+		m = unqueue(l,link);
 		gale_dprintf(7,"<- dequeueing message [%p]\n",m);
 	}
 	return m;
@@ -115,7 +284,9 @@ static struct gale_packet *dequeue(struct gale_link *l) {
 /* -- input state machine --------------------------------------------------- */
 
 typedef void istate(struct input_state *inp);
-static istate ist_version,ist_idle,ist_message,ist_text,ist_cid,ist_unknown;
+static istate ist_version,ist_idle,ist_message,ist_text,ist_cid,ist_ring;
+static istate ist_since;
+static istate ist_unknown;
 
 static void ifn_version(struct input_state *inp) {
 	struct gale_link *l = (struct gale_link *) inp->private;
@@ -170,6 +341,12 @@ static void ifn_opcode(struct input_state *inp) {
 	case opcode_supply:
 		ist_cid(inp);
 		break;
+	case opcode_ring:
+		ist_ring(inp);
+		break;
+	case opcode_since:
+		ist_since(inp);
+		break;
 	default:
 		ist_unknown(inp);
 	}
@@ -385,6 +562,85 @@ static void ist_cid(struct input_state *inp) {
 	}
 }
 
+static void close_received(struct gale_link *l) {
+	while (l->in_fd_num > 0) close(l->in_fd[--l->in_fd_num]);
+}
+
+static void ifn_ring(struct input_state *inp) {
+	struct gale_link *l = (struct gale_link *) inp->private;
+	u32 value;
+	assert(inp->data.l == l->in_length);
+	l->in_length -= inp->data.l;
+	gale_unpack_u32(&inp->data,&value);
+	assert(0 == inp->data.l);
+
+	if (NULL != l->ring_offer) {
+		/* The reply to our request; if it's yes, the ring is next. */
+		if (0 != value) {
+			gale_dprintf(5,"[%d] receiving through shared ring\n",l->fd);
+			l->in_ring = l->ring_offer;
+		} else
+			delete_ring(l->ring_offer);
+		l->ring_offer = NULL;
+	} else {
+		/* A request, which brought the ring's descriptors with it. */
+		struct ring *ring = NULL;
+		if (RING_FDS == l->in_fd_num
+		&&  NULL == l->out_ring && NULL == l->ring_accept) {
+			ring = attach_ring(l->in_fd);
+			l->in_fd_num = 0;
+		}
+		close_received(l);
+		l->ring_accept = ring;
+		l->ring_reply = (NULL != ring);
+	}
+
+	ist_idle(inp);
+}
+
+static void ist_ring(struct input_state *inp) {
+	struct gale_link *l = (struct gale_link *) inp->private;
+	if (gale_u32_size() != l->in_length) {
+		ist_unknown(inp);
+		return;
+	}
+
+	inp->next = ifn_ring;
+	inp->ready = input_always_ready;
+	inp->data.p = NULL;
+	inp->data.l = gale_u32_size();
+}
+
+static void ifn_since(struct input_state *inp) {
+	struct gale_link *l = (struct gale_link *) inp->private;
+	struct timeval tv;
+	struct gale_time age;
+	u32 msec;
+	l->in_length -= inp->data.l;
+	gale_unpack_u32(&inp->data,&msec);
+	assert(0 == inp->data.l);
+
+	tv.tv_sec = msec / 1000;
+	tv.tv_usec = (msec % 1000) * 1000;
+	gale_time_from(&age,&tv);
+	l->in_since = gale_time_diff(gale_time_now(),age);
+	l->in_is_since = 1;
+	ist_idle(inp);
+}
+
+static void ist_since(struct input_state *inp) {
+	struct gale_link *l = (struct gale_link *) inp->private;
+	if (gale_u32_size() != l->in_length) {
+		ist_unknown(inp);
+		return;
+	}
+
+	inp->next = ifn_since;
+	inp->ready = input_always_ready;
+	inp->data.p = NULL;
+	inp->data.l = gale_u32_size();
+}
+
 static void ifn_unknown(struct input_state *inp) {
 	struct gale_link *l = (struct gale_link *) inp->private;
 	assert(inp->data.l <= l->in_length);
@@ -466,6 +722,14 @@ static void ofn_cid(struct output_state *out,struct output_context *ctx) {
 	out->next = ofn_data;
 }
 
+static void ofn_value(struct output_state *out,struct output_context *ctx) {
+	struct gale_link *l = (struct gale_link *) out->private;
+	struct gale_data data;
+	send_space(ctx,gale_u32_size(),&data);
+	gale_pack_u32(&data,l->out_value);
+	ost_idle(out);
+}
+
 static void ofn_idle(struct output_state *out,struct output_context *ctx) {
 	struct gale_link *l = (struct gale_link *) out->private;
 	struct gale_data data,key;
@@ -478,6 +742,23 @@ static void ofn_idle(struct output_state *out,struct output_context *ctx) {
 
 	/* out_complete must come after out_assert; otherwise, tune to taste */
 
+	/* shared-memory ring */
+
+	       if (l->ring_reply >= 0) {
+		out->next = ofn_value;
+		l->out_value = l->ring_reply;
+		l->ring_reply = -1;
+		gale_pack_u32(&data,opcode_ring);
+		gale_pack_u32(&data,gale_u32_size());
+	} else if (l->ring_ask) {
+		out->next = ofn_value;
+		l->out_value = l->ring_size;
+		l->ring_ask = 0;
+		l->out_fd_num = RING_FDS;
+		gale_pack_u32(&data,opcode_ring);
+		gale_pack_u32(&data,gale_u32_size());
+	} else
+
 	/* version 1 */
 
 	       if (gale_map_walk(l->out_watch,NULL,&key,&ptr)) {
@@ -544,6 +825,16 @@ static void ofn_idle(struct output_state *out,struct output_context *ctx) {
 		l->out_gimme = null_text;
 		gale_pack_u32(&data,opcode_gimme);
 		gale_pack_u32(&data,l->out_text.l * gale_wch_size());
+	} else if (l->out_is_since) {
+		struct timeval tv;
+		gale_time_to(&tv,gale_time_diff(gale_time_now(),l->out_since));
+		if (tv.tv_sec < 0) tv.tv_sec = tv.tv_usec = 0;
+		if (tv.tv_sec > SINCE_LIMIT) tv.tv_sec = SINCE_LIMIT;
+		out->next = ofn_value;
+		l->out_value = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+		l->out_is_since = 0;
+		gale_pack_u32(&data,opcode_since);
+		gale_pack_u32(&data,gale_u32_size());
 	} else if (NULL != l->out_will) {
 		out->next = ofn_message;
 		l->out_msg = l->out_will;
@@ -553,9 +844,9 @@ static void ofn_idle(struct output_state *out,struct output_context *ctx) {
 			+ l->out_msg->routing.l * gale_wch_size() 
 			+ gale_u32_size() 
 			+ gale_copy_size(l->out_msg->content.l));
-	} else if (NULL != l->out_queue) {
+	} else if (NULL != l->out_head) {
 		out->next = ofn_message;
-		l->out_msg = dequeue(l);
+		l->out_msg = dequeue(l,1);
 		gale_pack_u32(&data,opcode_puff);
 		gale_pack_u32(&data,gale_u32_size() 
 			+ l->out_msg->routing.l * gale_wch_size() 
@@ -566,7 +857,12 @@ static void ofn_idle(struct output_state *out,struct output_context *ctx) {
 
 static int ofn_idle_ready(struct output_state *out) {
 	struct gale_link *l = (struct gale_link *) out->private;
-	return l->out_will || l->out_gimme.l || l->out_queue || l->out_publish.l
+	/* Once we've accepted a ring, hold everything for it. */
+	if (NULL != l->ring_accept) return l->ring_reply >= 0;
+	if (l->is_draining) return 0;
+	return l->ring_reply >= 0 || l->ring_ask
+	    || l->out_will || l->out_gimme.l || l->out_is_since
+	    || l->out_head || l->out_publish.l
 	    || gale_map_walk(l->out_watch,NULL,NULL,NULL)
 	    || gale_map_walk(l->out_complete,NULL,NULL,NULL)
 	    || gale_map_walk(l->out_assert,NULL,NULL,NULL)
@@ -581,12 +877,15 @@ static void ost_idle(struct output_state *out) {
 
 /* -- API: version 0 -------------------------------------------------------- */
 
+static void activate(struct gale_link *);
+
 static int get_text(struct gale_link *l,
                     struct gale_text *from,struct gale_text *to) {
 	if (0 == from->l) return 0;
 	*to = *from;
 	*from = null_text;
 	if (l->input) input_buffer_more(l->input);
+	activate(l);
 	return 1;
 }
 
@@ -596,26 +895,101 @@ static int get_data(struct gale_link *l,
 	*to = *from;
 	*from = null_data;
 	if (l->input) input_buffer_more(l->input);
+	activate(l);
 	return 1;
 }
 
-static oop_call_fd on_read,on_write;
-static oop_call_time on_process;
+static oop_call_fd on_read,on_write,on_bell;
+static oop_call_time on_process,on_ring;
+
+static void set_reading(struct gale_link *l,int on) {
+	if (on == l->is_reading) return;
+	if (on) l->source->on_fd(l->source,l->fd,OOP_READ,on_read,l);
+	else l->source->cancel_fd(l->source,l->fd,OOP_READ);
+	l->is_reading = on;
+}
+
+static void set_writing(struct gale_link *l,int on) {
+	if (on == l->is_writing) return;
+	if (on) l->source->on_fd(l->source,l->fd,OOP_WRITE,on_write,l);
+	else l->source->cancel_fd(l->source,l->fd,OOP_WRITE);
+	l->is_writing = on;
+}
+
+static struct ring *active_ring(struct gale_link *l) {
+	return (NULL != l->in_ring) ? l->in_ring : l->out_ring;
+}
+
+/* Poll the ring in use (when on), or stop polling or waiting for it. */
+static void set_ring(struct gale_link *l,int on) {
+	if (on && ring_idle == l->ring_state) {
+		l->source->on_time(l->source,OOP_TIME_NOW,on_ring,l);
+		l->ring_state = ring_polling;
+	} else if (!on && ring_polling == l->ring_state) {
+		l->source->cancel_time(l->source,OOP_TIME_NOW,on_ring,l);
+		l->ring_state = ring_idle;
+	} else if (!on && ring_sleeping == l->ring_state) {
+		l->source->cancel_fd(l->source,
+			ring_bell(active_ring(l)),OOP_READ);
+		l->ring_state = ring_idle;
+	}
+}
 
 static void deactivate(struct gale_link *l) {
-	l->source->cancel_time(l->source,OOP_TIME_NOW,on_process,l);
+	if (l->is_processing)
+		l->source->cancel_time(l->source,OOP_TIME_NOW,on_process,l);
+	l->is_processing = 0;
 	if (-1 != l->fd) {
-		l->source->cancel_fd(l->source,l->fd,OOP_READ);
-		l->source->cancel_fd(l->source,l->fd,OOP_WRITE);
+		set_reading(l,0);
+		set_writing(l,0);
+		set_ring(l,0);
 	}
 }
 
+/* Is there room for more input?  (While draining, only if the message
+   under way isn't complete.) */
+static int want_input(struct gale_link *l) {
+	const struct input_state *in;
+	size_t needed;
+	if (NULL == l->input) return 1;
+	if (!input_buffer_ready(l->input)) return 0;
+	if (!l->is_draining) return 1;
+	in = input_buffer_state(l->input);
+	needed = input_buffer_needed(l->input);
+	return 0 != needed && (ifn_opcode != in->next || needed != in->data.l);
+}
+
+/* Does on_process() have anything to do? */
+static int want_process(struct gale_link *l) {
+	return (NULL != l->in_puff && NULL != l->on_message)
+	    || (NULL != l->in_will && NULL != l->on_will)
+	    || (0 != l->in_gimme.l && NULL != l->on_subscribe)
+	    || (l->in_is_since && NULL != l->on_since)
+	    || (-1 == l->fd && NULL != l->on_empty && 0 == link_queue_num(l));
+}
+
+/* Register for whatever events the link needs now.  Registrations persist
+   until they're no longer wanted, so this is cheap to call often. */
 static void activate(struct gale_link *l) {
-	deactivate(l);
-	l->source->on_time(l->source,OOP_TIME_NOW,on_process,l);
+	if (!l->is_processing && want_process(l)) {
+		l->source->on_time(l->source,OOP_TIME_NOW,on_process,l);
+		l->is_processing = 1;
+	}
+
 	if (-1 != l->fd) {
-		l->source->on_fd(l->source,l->fd,OOP_READ,on_read,l);
-		l->source->on_fd(l->source,l->fd,OOP_WRITE,on_write,l);
+		const int is_output = NULL == l->output || l->notify_empty
+		                   || do_shutdown == l->out_shutdown
+		                   || output_buffer_ready(l->output);
+		if (NULL != l->in_ring) {
+			set_reading(l,!l->in_closed);
+			set_ring(l,input_buffer_ready(l->input));
+		} else
+			set_reading(l,want_input(l));
+
+		if (NULL != l->out_ring)
+			set_ring(l,is_output);
+		else if (is_output)
+			set_writing(l,1);
 	}
 }
 
@@ -636,11 +1010,21 @@ struct gale_link *new_link(struct oop_source *oop) {
 	l->on_message = NULL;
 	l->on_will = NULL;
 	l->on_subscribe = NULL;
+	l->on_since = NULL;
+	l->on_dequeue = NULL;
+
+	l->is_reading = l->is_writing = l->is_processing = 0;
+	l->notify_empty = 0;
+	l->is_draining = 0;
 
 	l->input = NULL;
 	l->in_msg = l->in_puff = l->in_will = NULL;
 	l->in_gimme = null_text;
 	l->in_version = -1;
+	l->in_when = gale_time_zero();
+	l->in_is_since = 0;
+	l->in_recent = NULL;
+	l->in_recent_num = l->in_recent_next = l->in_checking = 0;
 
 	l->in_publish = null_text;
 	l->in_watch = l->in_forget = l->in_complete = null_text;
@@ -651,8 +1035,11 @@ struct gale_link *new_link(struct oop_source *oop) {
 	l->output = NULL;
 	l->out_text = null_text;
 	l->out_gimme = null_text;
+	l->out_is_since = 0;
 	l->out_msg = l->out_will = NULL;
-	l->out_queue = NULL;
+	l->out_head = l->out_tail = NULL;
+	l->flow_head = l->flow_tail = NULL;
+	l->out_flows = gale_make_map(0);
 	l->out_shutdown = no_shutdown;
 	l->queue_num = 0;
 	l->queue_mem = 0;
@@ -664,6 +1051,15 @@ struct gale_link *new_link(struct oop_source *oop) {
 	l->out_fetch = gale_make_map(0);
 	l->out_supply = gale_make_map(0);
 
+	l->ring_size = 0;
+	l->in_ring = l->out_ring = NULL;
+	l->ring_offer = l->ring_accept = NULL;
+	l->ring_ask = 0;
+	l->ring_reply = -1;
+	l->ring_state = ring_idle;
+	l->in_fd_num = l->out_fd_num = 0;
+	l->in_closed = 0;
+
 	return l;
 }
 
@@ -675,15 +1071,56 @@ void delete_link(struct gale_link *l) {
 	deactivate(l);
 }
 
+/* Identify a message by (a hash of) its content, which a replay keeps. */
+static void message_id(struct gale_packet *msg,u32 *id) {
+	u32 a = 2166136261U,b = 5381;
+	size_t i;
+	for (i = 0; i < msg->content.l; ++i) {
+		a = (a ^ msg->content.p[i]) * 16777619U;
+		b = b * 33 + msg->content.p[i];
+	}
+	id[0] = a;
+	id[1] = b ^ msg->content.l;
+}
+
+/* True if a message repeats one we had before asking for a replay. */
+static int is_repeat(struct gale_link *l,struct gale_packet *msg) {
+	u32 id[2];
+	int i;
+
+	if (NULL != l->on_since) return 0;
+	if (NULL == l->in_recent)
+		l->in_recent = gale_malloc_atomic(
+			2 * SINCE_RECENT * sizeof(*l->in_recent));
+
+	message_id(msg,id);
+	if (l->in_checking > 0) {
+		--l->in_checking;
+		for (i = 0; i < l->in_recent_num; ++i)
+			if (id[0] == l->in_recent[2 * i]
+			&&  id[1] == l->in_recent[2 * i + 1])
+				return 1;
+	}
+
+	l->in_recent[2 * l->in_recent_next] = id[0];
+	l->in_recent[2 * l->in_recent_next + 1] = id[1];
+	l->in_recent_next = (l->in_recent_next + 1) % SINCE_RECENT;
+	if (l->in_recent_num < SINCE_RECENT) ++l->in_recent_num;
+	return 0;
+}
+
 static void *on_process(oop_source *source,struct timeval tv,void *user) {
 	struct gale_link *l = (struct gale_link *) user;
 	assert(source == l->source);
+	l->is_processing = 0;
 
 	if (NULL != l->in_puff && NULL != l->on_message) {
 		struct gale_packet *puff = l->in_puff;
 		l->in_puff = NULL;
 		if (NULL != l->input) input_buffer_more(l->input);
 		activate(l);
+		if (is_repeat(l,puff)) return OOP_CONTINUE;
+		l->in_when = gale_time_now();
 		return l->on_message(l,puff,l->on_message_data);
 	}
 
@@ -701,6 +1138,12 @@ static void *on_process(oop_source *source,struct timeval tv,void *user) {
 		return l->on_subscribe(l,sub,l->on_subscribe_data);
 	}
 
+	if (l->in_is_since && NULL != l->on_since) {
+		l->in_is_since = 0;
+		activate(l);
+		return l->on_since(l,l->in_since,l->on_since_data);
+	}
+
 	if (-1 == l->fd && 0 == link_queue_num(l) && NULL != l->on_empty) {
 		activate(l);
 		return l->on_empty(l,l->on_empty_data);
@@ -709,9 +1152,104 @@ static void *on_process(oop_source *source,struct timeval tv,void *user) {
 	return OOP_CONTINUE;
 }
 
+/* Read from the socket, keeping any descriptors that come with the data. */
+static ssize_t read_socket(void *user,const struct iovec *vec,int count) {
+	struct gale_link *l = (struct gale_link *) user;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(RING_FDS * sizeof(int))];
+	} control;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec clip[2];
+	ssize_t r;
+	int flags = 0;
+#ifdef MSG_CMSG_CLOEXEC
+	flags |= MSG_CMSG_CLOEXEC;
+#endif
+
+	if (l->is_draining) {
+		/* Read no further than the end of the message. */
+		size_t want = input_buffer_needed(l->input);
+		int i;
+		for (i = 0; i < count && i < 2 && want > 0; ++i) {
+			clip[i] = vec[i];
+			if (clip[i].iov_len > want) clip[i].iov_len = want;
+			want -= clip[i].iov_len;
+		}
+		vec = clip;
+		count = i;
+	}
+
+	memset(&msg,0,sizeof(msg));
+	msg.msg_iov = (struct iovec *) vec;
+	msg.msg_iovlen = count;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	r = recvmsg(l->fd,&msg,flags);
+	if (r < 0) return r;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); NULL != cmsg;
+	     cmsg = CMSG_NXTHDR(&msg,cmsg)) {
+		const byte *data = (const byte *) CMSG_DATA(cmsg);
+		int i,fd;
+		if (SOL_SOCKET != cmsg->cmsg_level
+		||  SCM_RIGHTS != cmsg->cmsg_type) continue;
+		for (i = 0; CMSG_LEN((i + 1) * sizeof(int)) <= cmsg->cmsg_len; ++i) {
+			memcpy(&fd,data + i * sizeof(int),sizeof(int));
+			if (l->in_fd_num < RING_FDS) l->in_fd[l->in_fd_num++] = fd;
+			else close(fd);
+		}
+	}
+
+	return r;
+}
+
+/* Write to the socket, sending the ring's descriptors if it's time. */
+static ssize_t write_socket(void *user,const struct iovec *vec,int count) {
+	struct gale_link *l = (struct gale_link *) user;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(RING_FDS * sizeof(int))];
+	} control;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	ssize_t w;
+
+	if (0 == l->out_fd_num) return writev(l->fd,vec,count);
+
+	memset(&msg,0,sizeof(msg));
+	msg.msg_iov = (struct iovec *) vec;
+	msg.msg_iovlen = count;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = CMSG_SPACE(l->out_fd_num * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(l->out_fd_num * sizeof(int));
+	memcpy(CMSG_DATA(cmsg),ring_fds(l->ring_offer),
+	       l->out_fd_num * sizeof(int));
+
+	w = sendmsg(l->fd,&msg,0);
+	if (w > 0) l->out_fd_num = 0;
+	return w;
+}
+
+static void *read_failed(struct gale_link *l) {
+	if (done_shutdown == l->out_shutdown && 0 == errno) {
+		l->out_shutdown = no_shutdown;
+		if (NULL != l->on_empty)
+			return l->on_empty(l,l->on_empty_data);
+	} else {
+		if (NULL != l->on_error) 
+			return l->on_error(l,errno,l->on_error_data);
+	}
+
+	return OOP_CONTINUE;
+}
+
 static void *on_read(oop_source *source,int fd,oop_event event,void *user) {
 	struct gale_link *l = (struct gale_link *) user;
-	void *ret = OOP_CONTINUE;
 	assert(source == l->source);
 	assert(fd == l->fd);
 
@@ -722,21 +1260,25 @@ static void *on_read(oop_source *source,int fd,oop_event event,void *user) {
 		l->input = create_input_buffer(initial);
 	}
 
-	if (!input_buffer_ready(l->input))
-		l->source->cancel_fd(l->source,l->fd,OOP_READ);
-	else if (input_buffer_read(l->input,l->fd)) {
-		if (done_shutdown == l->out_shutdown && 0 == errno) {
-			l->out_shutdown = no_shutdown;
-			if (NULL != l->on_empty)
-				ret = l->on_empty(l,l->on_empty_data);
-		} else {
-			if (NULL != l->on_error) 
-				ret = l->on_error(l,errno,l->on_error_data);
-		}
-	} else
+	if (NULL != l->in_ring) {
+		/* Nothing more should arrive here; remember why the socket
+		   woke us, and report it once the ring is drained. */
+		byte extra;
+		const ssize_t r = read(l->fd,&extra,sizeof(extra));
+		if (r < 0 && (EINTR == errno || EAGAIN == errno))
+			return OOP_CONTINUE;
+		l->in_closed = 1;
+		l->in_error = (r < 0) ? errno : (r > 0) ? EPROTO : 0;
+		set_ring(l,0);
+		activate(l);
+	} else if (!want_input(l))
+		set_reading(l,0);
+	else if (input_buffer_readv(l->input,read_socket,l))
+		return read_failed(l);
+	else
 		activate(l);
 
-	return ret;
+	return OOP_CONTINUE;
 }
 
 static void *on_write(oop_source *source,int fd,oop_event event,void *user) {
@@ -752,7 +1294,17 @@ static void *on_write(oop_source *source,int fd,oop_event event,void *user) {
 	}
 
 	if (!output_buffer_ready(l->output)) {
-		l->source->cancel_fd(l->source,l->fd,OOP_WRITE);
+		set_writing(l,0);
+		if (NULL != l->ring_accept) {
+			/* The reply is out; everything else goes in the ring. */
+			gale_dprintf(5,"[%d] sending through shared ring\n",l->fd);
+			l->out_ring = l->ring_accept;
+			l->ring_accept = NULL;
+			activate(l);
+			return OOP_CONTINUE;
+		}
+
+		l->notify_empty = 0;
 		switch (l->out_shutdown) {
 		case no_shutdown:
 			if (0 == link_queue_num(l) && NULL != l->on_empty)
@@ -769,12 +1321,78 @@ static void *on_write(oop_source *source,int fd,oop_event event,void *user) {
 		default:
 			assert(0);
 		}
-	} else if (output_buffer_write(l->output,l->fd) && NULL != l->on_error)
+	} else if (NULL != l->out_ring) {
+		if (output_buffer_writev(l->output,ring_writev,l->out_ring)
+		&&  NULL != l->on_error)
+			return l->on_error(l,errno,l->on_error_data);
+		activate(l);
+	} else if (output_buffer_writev(l->output,write_socket,l)
+	       &&  NULL != l->on_error)
 		return l->on_error(l,errno,l->on_error_data);
 
 	return OOP_CONTINUE;
 }
 
+static void *on_ring(oop_source *source,struct timeval tv,void *user) {
+	struct gale_link *l = (struct gale_link *) user;
+	struct ring * const ring = active_ring(l);
+	assert(source == l->source);
+	assert(NULL != ring);
+	l->ring_state = ring_idle;
+
+	if (NULL != l->out_ring) {
+		if (!output_buffer_ready(l->output) || ring_ready(ring)
+		||  !ring_sleep(ring))
+			return on_write(source,l->fd,OOP_WRITE,l);
+	} else if (ring_ready(ring) || (!l->in_closed && !ring_sleep(ring))) {
+		while (input_buffer_ready(l->input) && ring_ready(ring))
+			if (input_buffer_readv(l->input,ring_readv,ring))
+				return read_failed(l);
+		activate(l);
+		return OOP_CONTINUE;
+	} else if (l->in_closed) {
+		errno = l->in_error;
+		return read_failed(l);
+	}
+
+	/* Wait for the other end to ring the bell. */
+	source->on_fd(source,ring_bell(ring),OOP_READ,on_bell,l);
+	l->ring_state = ring_sleeping;
+	return OOP_CONTINUE;
+}
+
+static void *on_bell(oop_source *source,int fd,oop_event event,void *user) {
+	struct gale_link *l = (struct gale_link *) user;
+	struct ring * const ring = active_ring(l);
+	assert(source == l->source);
+	assert(fd == ring_bell(ring));
+	source->cancel_fd(source,fd,OOP_READ);
+	l->ring_state = ring_idle;
+	ring_wake(ring);
+	activate(l);
+	return OOP_CONTINUE;
+}
+
+static int is_local(int fd) {
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	return !getsockname(fd,(struct sockaddr *) &addr,&len)
+	    && AF_UNIX == addr.ss_family;
+}
+
+static void drop_ring(struct gale_link *l) {
+	if (NULL != l->in_ring) delete_ring(l->in_ring);
+	if (NULL != l->out_ring) delete_ring(l->out_ring);
+	if (NULL != l->ring_offer) delete_ring(l->ring_offer);
+	if (NULL != l->ring_accept) delete_ring(l->ring_accept);
+	l->in_ring = l->out_ring = l->ring_offer = l->ring_accept = NULL;
+	l->ring_ask = 0;
+	l->ring_reply = -1;
+	l->out_fd_num = 0;
+	l->in_closed = 0;
+	close_received(l);
+}
+
 /** Attach a protocol link to a physical file descriptor.
  *  The link will reset its state and use the supplied file descriptor for I/O.
  *  \param l The link to associate with a file descriptor.
@@ -789,11 +1407,84 @@ void link_set_fd(struct gale_link *l,int fd) {
 		if (l->out_msg) l->out_msg = NULL;
 		if (l->out_text.l) l->out_text = null_text;
 		if (l->output) l->output = NULL;
+		l->in_is_since = l->out_is_since = 0;
+		l->is_draining = 0;
 
 		close(l->fd);
 	}
 
 	deactivate(l);
+	drop_ring(l);
+	l->fd = fd;
+	if (-1 != fd && 0 != l->ring_size && is_local(fd)) {
+		l->ring_offer = create_ring(l->ring_size);
+		l->ring_ask = (NULL != l->ring_offer);
+	}
+	activate(l);
+}
+
+/** Take a link's connection away, to hand it to another process.
+ *  The link stops reading and writing at the next message boundary in
+ *  each direction.  Once it has (call this again until then), the link is
+ *  left detached, with any unsent messages still queued (see
+ *  link_queue_get()), and its file descriptor is returned for the other
+ *  process to link_adopt().  Links using a shared-memory ring can't be
+ *  handed over.
+ *  \param l The link to detach.
+ *  \param version Where to store the protocol version of the other end.
+ *  \return The file descriptor, or -1 if the link isn't ready.
+ *  \sa link_adopt() */
+int link_detach(struct gale_link *l,int *version) {
+	const struct input_state *in;
+	const struct output_state *out;
+	const int fd = l->fd;
+
+	if (-1 == fd || NULL != l->in_ring || NULL != l->out_ring
+	||  NULL != l->ring_offer || NULL != l->ring_accept) return -1;
+	if (!l->is_draining) {
+		l->is_draining = 1;
+		activate(l);
+	}
+
+	if (NULL == l->input || NULL == l->output || l->in_version < 0)
+		return -1;
+	in = input_buffer_state(l->input);
+	out = output_buffer_state(l->output);
+	if (ifn_opcode != in->next || input_buffer_needed(l->input) != in->data.l
+	||  ofn_idle != out->next || !output_buffer_empty(l->output)
+	||  NULL != l->in_puff || NULL != l->in_will || 0 != l->in_gimme.l
+	||  l->in_is_since)
+		return -1;
+
+	deactivate(l);
+	*version = l->in_version;
+	l->input = NULL;
+	l->output = NULL;
+	l->is_draining = 0;
+	l->fd = -1;
+	return fd;
+}
+
+/** Attach a link to a connection handed over by another process.
+ *  Like link_set_fd(), but the connection is already under way, so the
+ *  version exchange is skipped; link_detach() left it between messages.
+ *  \param l The link to attach, which must be detached.
+ *  \param fd The file descriptor (from link_detach() in the other process).
+ *  \param version The protocol version (likewise).
+ *  \sa link_detach() */
+void link_adopt(struct gale_link *l,int fd,int version) {
+	struct input_state in;
+	struct output_state out;
+	assert(-1 == l->fd);
+
+	l->in_length = 0;
+	in.private = l;
+	ist_idle(&in);
+	out.private = l;
+	ost_idle(&out);
+	l->input = create_input_buffer(in);
+	l->output = create_output_buffer(out);
+	l->in_version = version;
 	l->fd = fd;
 	activate(l);
 }
@@ -806,6 +1497,19 @@ int link_get_fd(struct gale_link *l) {
 	return l->fd;
 }
 
+/** Receive through shared memory when possible.
+ *  When the link is attached to a local (UNIX-domain) connection, ask the
+ *  other end to send everything through a shared-memory ring of about
+ *  \a size bytes instead of the socket.  Busy local clients save a copy
+ *  and, usually, a system call per batch of messages.  Servers which
+ *  don't support it carry on using the socket.  Takes effect the next
+ *  time link_set_fd() is called.
+ *  \param l The link to configure.
+ *  \param size Size of the ring in bytes, or 0 to use the socket. */
+void link_use_ring(struct gale_link *l,size_t size) {
+	l->ring_size = size;
+}
+
 /** Close a link gracefully.
  *  Unlike delete_link(), this function closes the outgoing half of the
  *  connection and waits for the other end to finish sending.  When the link
@@ -839,20 +1543,39 @@ void link_put(struct gale_link *l,struct gale_packet *m) {
 	gale_create(link);
 	link->when = gale_time_now();
 	link->msg = m;
-	if (NULL == l->out_queue)
-		link->next = link;
-	else {
-		link->next = l->out_queue->next;
-		l->out_queue->next = link;
-	}
-	l->out_queue = link;
-
-	++l->queue_num;
-	l->queue_mem += message_size(m);
+	enqueue(l,link);
 	gale_dprintf(7,"-> enqueueing message [%p]\n",m);
 	activate(l);
 }
 
+/** Transmit a message which supersedes earlier ones.
+ *  Any unsent messages with exactly the same categories as \a m are
+ *  dropped from the queue first, so only the latest is sent.  This suits
+ *  messages which describe a current state, such as presence notices.
+ *  \param l The link to send the message with.
+ *  \param m The message to enqueue on the link.
+ *  \return The number of unsent messages replaced.
+ *  \sa link_put() */
+int link_put_latest(struct gale_link *l,struct gale_packet *m) {
+	const struct flow *flow = gale_map_find(l->out_flows,flow_name(m));
+	struct link *link = (NULL == flow) ? NULL : flow->head;
+	int replaced = 0;
+
+	/* Messages with the same categories are all in the same flow. */
+	while (NULL != link) {
+		struct link * const next = link->flow_next;
+		if (!gale_text_compare(link->msg->routing,m->routing)) {
+			unqueue(l,link);
+			++replaced;
+		}
+		link = next;
+	}
+
+	if (replaced > 0) gale_dprintf(7,"-> replaced %d messages\n",replaced);
+	link_put(l,m);
+	return replaced;
+}
+
 /** Register a 'will' message.
  *  A 'will' is a message that is sent to the server, but is only transmitted
  *  when the link is broken.  This can be used to notify others when you lose
@@ -879,14 +1602,66 @@ size_t link_queue_mem(struct gale_link *l) {
 /** Return the time when the oldest unsent message in a link's outgoing queue
     was sent. */
 struct gale_time link_queue_time(struct gale_link *l) {
-	if (NULL == l->out_queue) return gale_time_forever();
-	return l->out_queue->next->when;
+	if (NULL == l->out_head) return gale_time_forever();
+	return l->out_head->when;
+}
+
+/** Remove the oldest unsent message from a link's outgoing queue.
+ *  \return The message, or NULL if the queue is empty. */
+struct gale_packet *link_queue_get(struct gale_link *l) {
+	if (NULL == l->out_head) return NULL;
+	return unqueue(l,l->out_head);
+}
+
+/** Drop the oldest unsent message from a link's outgoing queue.
+ *  \return The message dropped, or NULL if the queue was empty. */
+struct gale_packet *link_queue_drop(struct gale_link *l) {
+	struct gale_packet *m = NULL;
+	if (NULL != l->out_head) m = dequeue(l,0);
+	l->notify_empty = 1;
+	activate(l);
+	return m;
 }
 
-/** Drop the oldest unsent message from a link's outgoing queue. */
-void link_queue_drop(struct gale_link *l) {
-	if (NULL != l->out_queue) dequeue(l);
+/** Drop the newest unsent message from a link's outgoing queue.
+ *  \return The message dropped, or NULL if the queue was empty. */
+struct gale_packet *link_queue_drop_newest(struct gale_link *l) {
+	struct gale_packet *m = NULL;
+	if (NULL != l->out_tail) m = unqueue(l,l->out_tail);
+	l->notify_empty = 1;
 	activate(l);
+	return m;
+}
+
+/** Drop selected unsent messages until a link's outgoing queue is small
+ *  enough.  Messages are considered oldest first; those for which \a select
+ *  returns nonzero are dropped, the rest are left in place.
+ *  \param l The link whose queue to trim.
+ *  \param select Function which returns nonzero if a message may be dropped.
+ *  \param user User-specified parameter to pass \a select.
+ *  \param num Stop when there are no more than this many messages (or 0).
+ *  \param mem Stop when the queue uses no more than this much memory (or 0).
+ *  \return The number of messages dropped.
+ *  \sa link_queue_drop() */
+int link_queue_shed(struct gale_link *l,
+    int (*select)(struct gale_packet *,void *),void *user,
+    int num,size_t mem)
+{
+	struct link *link = l->out_head;
+	int dropped = 0;
+	while (NULL != link && ((num > 0 && l->queue_num > num)
+	                    ||  (mem > 0 && l->queue_mem > mem))) {
+		struct link * const next = link->next;
+		if (select(link->msg,user)) {
+			unqueue(l,link);
+			++dropped;
+		}
+		link = next;
+	}
+
+	l->notify_empty = 1;
+	activate(l);
+	return dropped;
 }
 
 /** Set the event handler for I/O errors.
@@ -915,6 +1690,7 @@ void link_on_empty(struct gale_link *l,
      void *user) {
 	l->on_empty = call;
 	l->on_empty_data = user;
+	l->notify_empty = 1;
 	activate(l);
 }
 
@@ -960,6 +1736,63 @@ void link_on_subscribe(struct gale_link *l,
 	activate(l);
 }
 
+/** Set the handler for when a queued message is about to be transmitted.
+ *  Unlike the other handlers, this one is called synchronously, as each
+ *  message leaves the outgoing queue (but not for link_queue_drop()).
+ *  \param l The link to monitor.
+ *  \param call The function to call with the message and the time it was
+ *         queued by link_put().
+ *  \param user User-specified parameter.
+ *  \sa link_put(), link_queue_time() */
+void link_on_dequeue(struct gale_link *l,
+     void (*call)(struct gale_link *l,struct gale_packet *msg,
+                  struct gale_time queued,void *user),
+     void *user) {
+	l->on_dequeue = call;
+	l->on_dequeue_data = user;
+}
+
+/** Ask the other end to replay messages we may have missed.
+ *  After reconnecting, a client can ask the server to send again whatever
+ *  arrived for its subscription since \a when (usually the time returned
+ *  by link_received() before the connection was lost).  Only servers which
+ *  keep a spool can do so; others ignore the request.  Subscribe first,
+ *  since the replay is matched against the subscription in effect.  The
+ *  replay may start a little before \a when; messages it repeats from
+ *  among those recently received are not delivered again.
+ *  \param l The link to ask with.
+ *  \param when The time (by our clock) to replay from.
+ *  \sa link_on_since(), link_received() */
+void link_since(struct gale_link *l,struct gale_time when) {
+	l->out_since = when;
+	l->out_is_since = 1;
+	l->in_checking = SINCE_RECENT;
+	activate(l);
+}
+
+/** When the last message arrived on a link.
+ *  \param l The link to examine.
+ *  \return The time the last message was delivered to the link_on_message()
+ *          handler, or gale_time_zero() if none has been.
+ *  \sa link_since() */
+struct gale_time link_received(struct gale_link *l) {
+	return l->in_when;
+}
+
+/** Set the event handler for when the other end asks for a replay.
+ *  \param l The link to monitor for replay requests.
+ *  \param call The function to call when the other end wants a replay.
+ *  \param when The time (by our clock) to replay messages from.
+ *  \param user User-specified parameter.
+ *  \sa link_since() */
+void link_on_since(struct gale_link *l,
+     void *(*call)(struct gale_link *l,struct gale_time when,void *user),
+     void *user) {
+	l->on_since = call;
+	l->on_since_data = user;
+	activate(l);
+}
+
 /* -- API: version 1 -------------------------------------------------------- */
 
 static struct gale_data combine(struct gale_text cat,struct gale_data cid) {
@@ -65,6 +65,14 @@ void gale_init_signals(oop_source *source) {
 	source->on_signal(source,SIGQUIT,on_halt,NULL);
 }
 
+/** Call a function on SIGHUP (to reload configuration) instead of halting.
+ *  \param source Liboop event source to use for signals.
+ *  \param call Function to call when SIGHUP arrives.
+ *  \param user User-specified parameter to pass the function. */
+void gale_on_hangup(oop_source *source,oop_call_signal *call,void *user) {
+	source->cancel_signal(source,SIGHUP,on_halt,NULL);
+	source->on_signal(source,SIGHUP,call,user);
+}
 
 struct gale_cleanup {
 	void (*func)(void *);
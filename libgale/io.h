@@ -3,6 +3,9 @@
 
 #include "gale/types.h"
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 /* Internal I/O buffer management. */
 
 struct input_buffer;
@@ -17,7 +20,11 @@ struct input_state {
 struct input_buffer *create_input_buffer(struct input_state initial);
 int input_buffer_ready(struct input_buffer *);
 int input_buffer_read(struct input_buffer *,int fd);
+int input_buffer_readv(struct input_buffer *,
+    ssize_t (*)(void *,const struct iovec *,int),void *);
 void input_buffer_more(struct input_buffer *);
+const struct input_state *input_buffer_state(struct input_buffer *);
+size_t input_buffer_needed(struct input_buffer *);
 
 int input_always_ready(struct input_state *);
 
@@ -33,6 +40,10 @@ struct output_state {
 struct output_buffer *create_output_buffer(struct output_state initial);
 int output_buffer_ready(struct output_buffer *);
 int output_buffer_write(struct output_buffer *,int fd);
+int output_buffer_writev(struct output_buffer *,
+    ssize_t (*)(void *,const struct iovec *,int),void *);
+const struct output_state *output_buffer_state(struct output_buffer *);
+int output_buffer_empty(struct output_buffer *);
 
 int output_always_ready(struct output_state *);
 void send_data(struct output_context *,struct gale_data);
@@ -40,4 +51,23 @@ void send_space(struct output_context *,size_t,struct gale_data *);
 void send_buffer(struct output_context *,struct gale_data,
                  void (*release)(struct gale_data,void *),void *);
 
+/* Shared-memory ring: the consumer creates it, the producer attaches to
+   the descriptors (memory, data doorbell, space doorbell) it was sent. */
+
+#define RING_FDS 3
+
+struct ring;
+
+struct ring *create_ring(size_t size);
+struct ring *attach_ring(const int *fds);
+void delete_ring(struct ring *);
+const int *ring_fds(struct ring *);
+int ring_bell(struct ring *);
+int ring_ready(struct ring *);
+int ring_sleep(struct ring *);
+void ring_wake(struct ring *);
+
+ssize_t ring_readv(void *,const struct iovec *,int);
+ssize_t ring_writev(void *,const struct iovec *,int);
+
 #endif
@@ -76,7 +76,16 @@ void input_buffer_more(struct input_buffer *buf) {
 	eat_remnant(buf);
 }
 
+static ssize_t read_fd(void *user,const struct iovec *vec,int count) {
+	return readv(* (int *) user,vec,count);
+}
+
 int input_buffer_read(struct input_buffer *buf,int fd) {
+	return input_buffer_readv(buf,read_fd,&fd);
+}
+
+int input_buffer_readv(struct input_buffer *buf,
+    ssize_t (*reader)(void *,const struct iovec *,int),void *user) {
 	if (NULL == buf->state.data.p 
 	&&  buf->state.data.l > sizeof(buf->buffer)) 
 	{
@@ -93,16 +102,19 @@ int input_buffer_read(struct input_buffer *buf,int fd) {
 		vec[1].iov_base = buf->buffer;
 		vec[1].iov_len = sizeof(buf->buffer);
 		errno = 0;
-		l = readv(fd,vec,2);
-		if (l < 0) return -(errno != EINTR);
+		l = reader(user,vec,2);
+		if (l < 0) return -(errno != EINTR && errno != EAGAIN);
 		if (l <= 0) return -1;
 		buf->remnant += l;
 	} else {
+		struct iovec vec;
 		int l,r = buf->remnant;
 		if (NULL != buf->state.data.p) r -= buf->state.data.l;
+		vec.iov_base = buf->buffer + r;
+		vec.iov_len = sizeof(buf->buffer) - r;
 		errno = 0;
-		l = read(fd,buf->buffer + r,sizeof(buf->buffer) - r);
-		if (l < 0) return -(errno != EINTR);
+		l = reader(user,&vec,1);
+		if (l < 0) return -(errno != EINTR && errno != EAGAIN);
 		if (l <= 0) return -1;
 		buf->remnant += l;
 	}
@@ -119,6 +131,17 @@ int input_buffer_ready(struct input_buffer *buf) {
 		return buf->remnant < sizeof(buf->buffer);
 }
 
+/* The state the buffer is filling. */
+const struct input_state *input_buffer_state(struct input_buffer *buf) {
+	return &buf->state;
+}
+
+/* How many more bytes the current state needs (0 if it has them all). */
+size_t input_buffer_needed(struct input_buffer *buf) {
+	if (buf->remnant >= buf->state.data.l) return 0;
+	return buf->state.data.l - buf->remnant;
+}
+
 int input_always_ready(struct input_state *buf) {
 	(void) buf;
 	return 1;
@@ -48,7 +48,16 @@ int output_buffer_ready(struct output_buffer *buf) {
 	return (sptr != buf->shead || buf->state.ready(&buf->state));
 }
 
+static ssize_t write_fd(void *user,const struct iovec *vec,int count) {
+	return writev(* (int *) user,vec,count);
+}
+
 int output_buffer_write(struct output_buffer *buf,int fd) {
+	return output_buffer_writev(buf,write_fd,&fd);
+}
+
+int output_buffer_writev(struct output_buffer *buf,
+    ssize_t (*writer)(void *,const struct iovec *,int),void *user) {
 	struct iovec vec[NUM_SEG];
 	size_t count = 0;
 	int sptr,w;
@@ -76,8 +85,8 @@ int output_buffer_write(struct output_buffer *buf,int fd) {
 	}
 
 	if (0 == count) return 0;
-	w = writev(fd,vec,count);
-	if (w <= 0) return -(errno != EINTR);
+	w = writer(user,vec,count);
+	if (w <= 0) return -(errno != EINTR && errno != EAGAIN);
 
 	w += buf->remnant;
 	sptr = buf->stail;
@@ -94,6 +103,18 @@ int output_buffer_write(struct output_buffer *buf,int fd) {
 	return 0;
 }
 
+/* The state the buffer is draining. */
+const struct output_state *output_buffer_state(struct output_buffer *buf) {
+	return &buf->state;
+}
+
+/* True if everything sent so far has been written. */
+int output_buffer_empty(struct output_buffer *buf) {
+	int sptr = buf->stail;
+	if (NUM_SEG == ++sptr) sptr = 0;
+	return sptr == buf->shead;
+}
+
 void send_data(struct output_context *ctx,struct gale_data data) {
 	struct output_buffer *buf = (struct output_buffer *) ctx;
 	size_t ptr = 0;
@@ -0,0 +1,351 @@
+#define _GNU_SOURCE 1 /* for memfd_create() */
+
+#include "io.h"
+#include "gale/misc.h"
+#include "gale/config.h"
+
+#include <poll.h>
+#include <errno.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_EVENTFD)
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#endif
+
+/* A single-producer, single-consumer byte ring in a shared memory file.
+   The header holds the two free-running positions, each written by one
+   side only, and a "waiting" flag for each side.  A side that finds the
+   ring empty (or full) sets its flag and sleeps on its doorbell (an
+   eventfd); the other side rings the bell only if the flag is set, so
+   a busy ring costs no system calls at all.  Neither side trusts the
+   other's view of the ring: each keeps its own position and size, and
+   the side which attaches checks that the doorbells really are eventfds
+   and never lets them block (without changing their flags, which are
+   shared with the other end). */
+
+#define RING_MAGIC 0x67526e67
+#define RING_HEADER 4096 /* data starts on its own page */
+#define RING_MIN 65536
+#define RING_MAX (1 << 30)
+
+enum { fd_memory, fd_data, fd_space };
+
+struct ring_header {
+	u32 magic,size;
+	byte pad0[56];
+	volatile u32 head,reader_waiting;          /* written by producer */
+	byte pad1[56];
+	volatile u32 tail,writer_waiting;          /* written by consumer */
+};
+
+struct ring {
+	struct ring_header *shared;
+	byte *data;
+	size_t map;
+	u32 size,pos;
+	int is_producer;
+	int fd[RING_FDS];
+};
+
+#define barrier() __sync_synchronize()
+
+static void close_fds(int *fd) {
+	int i;
+	for (i = 0; i < RING_FDS; ++i)
+		if (-1 != fd[i]) close(fd[i]);
+}
+
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_EVENTFD)
+
+static struct ring *map_ring(const int *fd,u32 size,int is_producer) {
+	struct ring *r;
+	void *map = mmap(NULL,RING_HEADER + size,PROT_READ | PROT_WRITE,
+	                 MAP_SHARED,fd[fd_memory],0);
+	if (MAP_FAILED == map) return NULL;
+
+	gale_create(r);
+	r->shared = (struct ring_header *) map;
+	r->data = (byte *) map + RING_HEADER;
+	r->map = RING_HEADER + size;
+	r->size = size;
+	r->pos = 0;
+	r->is_producer = is_producer;
+	memcpy(r->fd,fd,sizeof(r->fd));
+	return r;
+}
+
+/* Create a ring to receive data through (size is rounded up). */
+struct ring *create_ring(size_t size) {
+	int fd[RING_FDS] = { -1, -1, -1 };
+	struct ring *r;
+	u32 actual = RING_MIN;
+
+	while (actual < size && actual < RING_MAX) actual <<= 1;
+
+	fd[fd_memory] = memfd_create("gale-ring",MFD_CLOEXEC|MFD_ALLOW_SEALING);
+	fd[fd_data] = eventfd(0,EFD_CLOEXEC | EFD_NONBLOCK);
+	fd[fd_space] = eventfd(0,EFD_CLOEXEC | EFD_NONBLOCK);
+	if (-1 == fd[fd_memory] || -1 == fd[fd_data] || -1 == fd[fd_space]
+	||  ftruncate(fd[fd_memory],RING_HEADER + actual)
+	||  fcntl(fd[fd_memory],F_ADD_SEALS,
+	          F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+	||  NULL == (r = map_ring(fd,actual,0))) {
+		gale_alert(GALE_WARNING,G_("cannot create shared ring"),errno);
+		close_fds(fd);
+		return NULL;
+	}
+
+	r->shared->size = actual;
+	r->shared->head = r->shared->tail = 0;
+	r->shared->reader_waiting = r->shared->writer_waiting = 0;
+	r->shared->magic = RING_MAGIC;
+	return r;
+}
+
+/* True if a descriptor from the other end is an eventfd. */
+static int is_eventfd(int fd) {
+	char path[64],name[64];
+	struct stat buf;
+	eventfd_t value;
+	ssize_t len;
+
+	/* Eventfds are anonymous inodes, which have no file type. */
+	if (fstat(fd,&buf) || 0 != (buf.st_mode & S_IFMT)) return 0;
+
+	sprintf(path,"/proc/self/fd/%d",fd);
+	len = readlink(path,name,sizeof(name) - 1);
+	if (len >= 0) {
+		name[len] = '\0';
+		return !strcmp(name,"anon_inode:[eventfd]");
+	}
+
+	/* Without /proc, settle for refusing a short read, as eventfds do. */
+	return -1 == read(fd,&value,1) && EINVAL == errno;
+}
+
+/* Attach to a ring created by the other end of a connection.  The
+   descriptors become the ring's (or are closed) either way. */
+struct ring *attach_ring(const int *fds) {
+	int fd[RING_FDS];
+	struct ring_header header;
+	struct stat buf;
+	struct ring *r = NULL;
+	int seals;
+
+	memcpy(fd,fds,sizeof(fd));
+
+	/* The memory must be sealed, or the consumer could shrink it under
+	   us; and the doorbells must be what they claim. */
+	seals = fcntl(fd[fd_memory],F_GET_SEALS);
+	if (-1 != seals && (seals & F_SEAL_SHRINK)
+	&&  !fstat(fd[fd_memory],&buf)
+	&&  sizeof(header) == pread(fd[fd_memory],&header,sizeof(header),0)
+	&&  RING_MAGIC == header.magic
+	&&  header.size >= RING_MIN && header.size <= RING_MAX
+	&&  0 == (header.size & (header.size - 1))
+	&&  buf.st_size >= RING_HEADER + (off_t) header.size
+	&&  is_eventfd(fd[fd_data])
+	&&  is_eventfd(fd[fd_space]))
+		r = map_ring(fd,header.size,1);
+
+	if (NULL == r) {
+		close_fds(fd);
+		return NULL;
+	}
+
+	r->pos = r->shared->head;
+	return r;
+}
+
+/* Unmap a ring and close its descriptors. */
+void delete_ring(struct ring *r) {
+	munmap((void *) r->shared,r->map);
+	close_fds(r->fd);
+	gale_free(r);
+}
+
+/* True if a doorbell can be read or written without blocking. */
+static int is_ready(int fd,short events) {
+	struct pollfd p;
+	p.fd = fd;
+	p.events = events;
+	return 1 == poll(&p,1,0) && (p.revents & events);
+}
+
+static void knock(int fd) {
+	const eventfd_t one = 1;
+	if (is_ready(fd,POLLOUT)) write(fd,&one,sizeof(one));
+}
+
+/* Clear a ring's doorbell, after it has woken us up. */
+void ring_wake(struct ring *r) {
+	eventfd_t value;
+#ifdef HAVE_PREADV2
+	struct iovec vec;
+	vec.iov_base = &value;
+	vec.iov_len = sizeof(value);
+	if (-1 != preadv2(ring_bell(r),&vec,1,-1,RWF_NOWAIT)
+	||  EOPNOTSUPP != errno) return;
+#endif
+	if (is_ready(ring_bell(r),POLLIN))
+		read(ring_bell(r),&value,sizeof(value));
+}
+
+#else
+
+struct ring *create_ring(size_t size) {
+	return NULL;
+}
+
+struct ring *attach_ring(const int *fds) {
+	int fd[RING_FDS];
+	memcpy(fd,fds,sizeof(fd));
+	close_fds(fd);
+	return NULL;
+}
+
+void delete_ring(struct ring *r) {
+	assert(0);
+}
+
+static void knock(int fd) {
+	assert(0);
+}
+
+void ring_wake(struct ring *r) {
+	assert(0);
+}
+
+#endif
+
+/* The descriptors to send the other end (memory, data bell, space bell). */
+const int *ring_fds(struct ring *r) {
+	return r->fd;
+}
+
+/* The descriptor to wait on when ring_sleep() says to. */
+int ring_bell(struct ring *r) {
+	return r->fd[r->is_producer ? fd_space : fd_data];
+}
+
+/* Bytes we may read or write now, or -1 if the ring is corrupt. */
+static long available(struct ring *r) {
+	if (r->is_producer) {
+		const u32 used = r->pos - r->shared->tail;
+		if (used > r->size) return -1;
+		return r->size - used;
+	} else {
+		const u32 used = r->shared->head - r->pos;
+		if (used > r->size) return -1;
+		return used;
+	}
+}
+
+/* True if there is room to write (for the producer) or data to read
+   (for the consumer) without waiting. */
+int ring_ready(struct ring *r) {
+	return 0 != available(r);
+}
+
+/* Get ready to wait for the other end.  Returns nonzero if the caller
+   should wait for ring_bell() to become readable, zero if the ring
+   became ready in the meantime. */
+int ring_sleep(struct ring *r) {
+	volatile u32 *flag = r->is_producer
+		? &r->shared->writer_waiting : &r->shared->reader_waiting;
+	*flag = 1;
+	barrier();
+	if (!ring_ready(r)) return 1;
+	*flag = 0;
+	return 0;
+}
+
+/* Tell the other end about our progress, if it's waiting for us. */
+static void notify(struct ring *r) {
+	volatile u32 *flag = r->is_producer
+		? &r->shared->reader_waiting : &r->shared->writer_waiting;
+	barrier();
+	if (*flag) {
+		*flag = 0;
+		knock(r->fd[r->is_producer ? fd_data : fd_space]);
+	}
+}
+
+/* Copy data into a ring (producer only), like writev(). */
+ssize_t ring_writev(void *user,const struct iovec *vec,int count) {
+	struct ring * const r = (struct ring *) user;
+	const long space = available(r);
+	u32 done = 0;
+	int i;
+
+	assert(r->is_producer);
+	if (space <= 0) {
+		errno = (space < 0) ? EPROTO : EAGAIN;
+		return -1;
+	}
+
+	barrier();
+	for (i = 0; i < count && done < space; ++i) {
+		const byte *from = (const byte *) vec[i].iov_base;
+		size_t len = vec[i].iov_len;
+		if (len > space - done) len = space - done;
+		while (len > 0) {
+			const u32 at = r->pos & (r->size - 1);
+			size_t part = r->size - at;
+			if (part > len) part = len;
+			memcpy(r->data + at,from,part);
+			from += part;
+			len -= part;
+			done += part;
+			r->pos += part;
+		}
+	}
+
+	barrier();
+	r->shared->head = r->pos;
+	notify(r);
+	return done;
+}
+
+/* Copy data out of a ring (consumer only), like readv(). */
+ssize_t ring_readv(void *user,const struct iovec *vec,int count) {
+	struct ring * const r = (struct ring *) user;
+	const long ready = available(r);
+	u32 done = 0;
+	int i;
+
+	assert(!r->is_producer);
+	if (ready <= 0) {
+		errno = (ready < 0) ? EPROTO : EAGAIN;
+		return -1;
+	}
+
+	barrier();
+	for (i = 0; i < count && done < ready; ++i) {
+		byte *to = (byte *) vec[i].iov_base;
+		size_t len = vec[i].iov_len;
+		if (len > ready - done) len = ready - done;
+		while (len > 0) {
+			const u32 at = r->pos & (r->size - 1);
+			size_t part = r->size - at;
+			if (part > len) part = len;
+			memcpy(to,r->data + at,part);
+			to += part;
+			len -= part;
+			done += part;
+			r->pos += part;
+		}
+	}
+
+	barrier();
+	r->shared->tail = r->pos;
+	notify(r);
+	return done;
+}
@@ -5,6 +5,10 @@
 
 #include <assert.h>
 
+/* Bumped whenever the key database changes; memoized validity results
+   computed under an older epoch are stale. */
+static unsigned long key_epoch = 1;
+
 static struct gale_key_assertion *create(struct gale_time time,int is_trusted) {
 	struct gale_key_assertion *output;
 	gale_create(output);
@@ -17,12 +21,14 @@ static struct gale_key_assertion *create(struct gale_time time,int is_trusted) {
 	output->group = gale_group_empty();
 	output->stamp = time;
 	output->signer = NULL;
+	output->good_epoch = 0;
+	output->is_good = 0;
 	return output;
 }
 
-static int public_good(struct gale_key_assertion *assert) {
-	if (NULL == assert) return 0;
+static int public_good(struct gale_key_assertion *assert);
 
+static int check_good(struct gale_key_assertion *assert) {
 	if (NULL == assert->key
 	||  NULL == assert->key->signer
 	||  NULL == assert->key->signer->public
@@ -43,6 +49,15 @@ static int public_good(struct gale_key_assertion *assert) {
 	return assert->trust_count > 0;
 }
 
+static int public_good(struct gale_key_assertion *assert) {
+	if (NULL == assert) return 0;
+	if (key_epoch != assert->good_epoch) {
+		assert->is_good = check_good(assert);
+		assert->good_epoch = key_epoch;
+	}
+	return assert->is_good;
+}
+
 static int not_expired(struct gale_key *key,struct gale_time now) {
 	struct gale_fragment f;
 	if (key->public->trust_count > 0) return 1;
@@ -51,6 +66,17 @@ static int not_expired(struct gale_key *key,struct gale_time now) {
 	return not_expired(key->signer,now);
 }
 
+/* The earliest time at which not_expired() could fail for a good key. */
+static struct gale_time first_expiry(struct gale_key *key) {
+	struct gale_fragment f;
+	struct gale_time rest;
+	if (key->public->trust_count > 0) return gale_time_forever();
+	rest = first_expiry(key->signer);
+	if (gale_group_lookup(key->public->group,G_("key.expires"),frag_time,&f)
+	&&  gale_time_compare(f.value.time,rest) < 0) return f.value.time;
+	return rest;
+}
+
 /** Report the assertion currently active for a particular public key, if any.
  *  \param key The key handle from gale_key_handle().
  *  \param time The time to use for time-dependent validity checks.  
@@ -65,10 +91,19 @@ const struct gale_key_assertion *gale_key_public(
 	struct gale_key *key,
 	struct gale_time time) 
 {
-	if (NULL == key
-	|| !public_good(key->public) 
-	|| !not_expired(key,time)) return NULL;
-	return key->public;
+	if (NULL == key) return NULL;
+	if (key_epoch != key->valid_epoch) {
+		key->valid = public_good(key->public) ? key->public : NULL;
+		key->expires = (NULL == key->valid) 
+		             ? gale_time_forever() : first_expiry(key);
+		key->valid_epoch = key_epoch;
+	}
+
+	/* Until the first expiration in the chain, nothing can expire. */
+	if (NULL == key->valid
+	|| (gale_time_compare(time,key->expires) >= 0 
+	&&  !not_expired(key,time))) return NULL;
+	return key->valid;
 }
 
 /** Report the assertion currently active for a particular private key, if any.
@@ -192,14 +227,7 @@ static void check_mismatch(struct gale_key *key) {
 	}
 }
 
-/** Supply some raw key data to the system. 
- *  \param source Raw key bits.
- *  \param from Text describing where the key came from.
- *  \param is_trusted Nonzero iff the key comes from a trusted source and
- *         doesn't require external validation.
- *  \return Assertion handle. 
- *  \sa gale_key_assert_group(), gale_key_retract() */
-struct gale_key_assertion *gale_key_assert(
+static struct gale_key_assertion *assert_key(
 	struct gale_data source,struct gale_text from,
         struct gale_time stamp,int is_trusted) 
 {
@@ -339,6 +367,23 @@ struct gale_key_assertion *gale_key_assert(
 	return output;
 }
 
+/** Supply some raw key data to the system. 
+ *  \param source Raw key bits.
+ *  \param from Text describing where the key came from.
+ *  \param is_trusted Nonzero iff the key comes from a trusted source and
+ *         doesn't require external validation.
+ *  \return Assertion handle. 
+ *  \sa gale_key_assert_group(), gale_key_retract() */
+struct gale_key_assertion *gale_key_assert(
+	struct gale_data source,struct gale_text from,
+        struct gale_time stamp,int is_trusted) 
+{
+	struct gale_key_assertion * const output = 
+		assert_key(source,from,stamp,is_trusted);
+	++key_epoch; /* after the fact, since assert_key() checks validity */
+	return output;
+}
+
 /** Supply some slightly cooked key data.
  *  \param source Key data.
  *  \param from Text describing where the key came from.
@@ -361,6 +406,7 @@ struct gale_key_assertion *gale_key_assert_group(
  *  \sa gale_key_assert() */
 void gale_key_retract(struct gale_key_assertion *ass,int is_trusted) {
 	if (NULL == ass) return;
+	++key_epoch;
 	if (is_trusted) retract_trust(ass);
 
 	assert(0 != ass->ref_count);
@@ -41,6 +41,9 @@ struct gale_key *gale_key_handle(struct gale_text name) {
 		key->public = NULL;
 		key->private = NULL;
 		key->search = NULL;
+		key->valid_epoch = 0;
+		key->valid = NULL;
+		key->expires = gale_time_zero();
 		key->signer = gale_text_compare(s,name) 
 		            ? gale_key_handle(s)
 		            : NULL;
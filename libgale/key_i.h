@@ -16,6 +16,8 @@ struct gale_key_assertion {
 	struct gale_group group;
 	struct gale_time stamp;
 	struct gale_key_assertion *signer;
+	unsigned long good_epoch;	/* is_good is valid for this epoch */
+	int is_good;
 };
 
 struct gale_key {
@@ -23,6 +25,9 @@ struct gale_key {
 	struct gale_key_assertion *public,*private;
 	struct gale_key *signer;
 	struct gale_key_search *search;
+	unsigned long valid_epoch;	/* valid, expires are for this epoch */
+	struct gale_key_assertion *valid;
+	struct gale_time expires;
 };
 
 /* Magic numbers for key formats. */
@@ -50,9 +55,13 @@ struct gale_data key_i_create(struct gale_group);
 
 /* Add standard search hooks. */
 void key_i_init_builtin(void);
-void key_i_init_dirs(void);
+int key_i_init_store(void);
+void key_i_init_dirs(int use_cache);
 void key_i_init_akd(void);
 
+/* Remember failed slow searches between processes. */
+void key_i_init_misses(void);
+
 /* Recursively expand key relationships. */
 void key_i_graph(oop_source *,struct gale_key *,int flags,struct gale_text name,
 	void *(*)(oop_source *,struct gale_map *,int is_complete,int has_null,void *user),
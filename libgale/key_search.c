@@ -1,5 +1,6 @@
 #include "key_i.h"
 #include "gale/key.h"
+#include "gale/globals.h"
 
 #include <assert.h>
 
@@ -22,7 +23,7 @@ struct gale_key_search {
 	struct gale_key_request *status;
 	struct gale_time last;
 	int last_flags;
-	int in_wakeup;
+	int in_wakeup,is_slow;
 };
 
 struct key_hook {
@@ -36,6 +37,32 @@ static const int refresh_flag = 0x10000000;
 
 static struct key_hook **hook_list = NULL;
 
+/* Keys that slow searches recently failed to find, shared between processes;
+   each record's timestamp is the time it expires.  Anyone can write the
+   store, so an expiry further off than miss_interval is not believed. */
+static struct gale_store **miss_store = NULL;
+static int miss_interval = 3600;
+
+static int is_missing(struct gale_key *key,struct gale_time now) {
+	struct gale_time expire;
+	return NULL != miss_store
+	    && gale_store_find(*miss_store,
+	           gale_text_as_data(key->name),NULL,&expire)
+	    && gale_time_compare(now,expire) < 0
+	    && gale_time_compare(expire,gale_time_add(now,
+	           gale_time_seconds(miss_interval))) <= 0;
+}
+
+static void note_result(struct gale_key *key,struct gale_time now,int found) {
+	if (NULL == miss_store) return;
+	if (found)
+		gale_store_erase(*miss_store,gale_text_as_data(key->name),now);
+	else
+		gale_store_put(*miss_store,
+			gale_text_as_data(key->name),null_data,
+			gale_time_add(now,gale_time_seconds(miss_interval)));
+}
+
 static void *on_call(oop_source *oop,struct timeval when,void *x) {
         struct key_callback *call = (struct key_callback *) x;
         void *ret = OOP_CONTINUE;
@@ -106,6 +133,9 @@ static void wakeup(oop_source *oop,struct gale_key *key) {
 
 	key->search->in_wakeup = 0;
 	if (!is_active) {
+		if (key->search->is_slow)
+			note_result(key,now,NULL != gale_key_public(key,now));
+		key->search->is_slow = 0;
                 oop->on_time(oop,OOP_TIME_NOW,on_call,key->search->chain);
 		key->search->chain = NULL;
 	}
@@ -139,6 +169,7 @@ void gale_key_search(oop_source *source,
 		key->search->last = gale_time_zero();
 		key->search->last_flags = 0;
 		key->search->in_wakeup = 0;
+		key->search->is_slow = 0;
 	}
 
 	gale_create(callback);
@@ -153,6 +184,12 @@ void gale_key_search(oop_source *source,
 		gale_time_seconds(retry_interval))))
 		key->search->last_flags = 0;
 
+	/* Don't repeat a slow search that failed recently, unless pressed. */
+	if ((flags & search_slow) && !(flags & search_harder)
+	&&  NULL == gale_key_public(key,now) && is_missing(key,now))
+		flags &= ~search_slow;
+	if (flags & search_slow) key->search->is_slow = 1;
+
 	flags |= refresh_flag | key->search->last_flags;
 	if (flags != key->search->last_flags) {
 		parent = gale_key_parent(key);
@@ -200,3 +237,19 @@ void gale_key_hook_done(oop_source *source,
 	handle->is_active = 0;
 	wakeup(source,key);
 }
+
+/* Set up the shared cache of failed searches. */
+void key_i_init_misses(void) {
+	struct gale_text name = gale_var(G_("GALE_KEY_MISSES"));
+	const struct gale_text ttl = gale_var(G_("GALE_KEY_MISS_TTL"));
+
+	if (0 != ttl.l) miss_interval = gale_text_to_number(ttl);
+	if (miss_interval <= 0) return;
+
+	if (0 == name.l) name = dir_file(
+		submk_dir(gale_global->sys_dir,G_("auth"),0777),
+		G_("misses"));
+
+	miss_store = gale_malloc_safe(sizeof(*miss_store));
+	*miss_store = gale_open_store(name,0666);
+}
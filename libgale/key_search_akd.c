@@ -5,59 +5,188 @@
 
 #include <assert.h>
 
+/* All the AKD traffic for one domain shares a single server connection. */
+struct domain {
+	oop_source *oop;
+	struct gale_text name;
+	struct gale_link *link;
+	struct gale_server *server;
+	struct gale_map *active;
+	struct gale_text routing;
+	struct timeval linger;
+	int is_connected,is_lingering;
+};
+
 struct cache {
 	oop_source *oop;
 	struct gale_key *key;
 	struct gale_key_request *handle;
-	struct gale_link *link;
-	struct gale_server *server;
-	struct gale_text local,domain;
+	struct domain *domain;
+	struct gale_text local;
 	struct gale_message *query_message;
 	struct gale_text key_routing;
 	struct gale_time last_attempt;
 	struct gale_time last_refresh;
 	int waiting_for_query;
+	int is_pending; /* still waiting for an answer */
 };
 
 static const int timeout_interval = 20;
 static const int retry_interval = 300;
 static const int refresh_interval = 86400;
+static const int linger_interval = 120;
 
-static oop_call_time on_timeout;
+static struct gale_map **domain_map = NULL;
+
+static oop_call_time on_timeout,on_linger;
+static void *on_packet(struct gale_link *,struct gale_packet *,void *);
+
+/* The active queries for a domain, keyed by the name of the key sought. */
+static struct gale_data active_key(struct cache *cache) {
+	return gale_text_as_data(gale_key_name(cache->key));
+}
+
+/* Subscribe to the union of the answer categories of all queries still
+   waiting for an answer. */
+static void resubscribe(struct domain *domain) {
+	struct gale_text_accumulator accum = null_accumulator;
+	struct gale_data key = null_data;
+	struct gale_text routing;
+	void *data;
+
+	while (gale_map_walk(domain->active,&key,&key,&data)) {
+		const struct cache * const cache = (struct cache *) data;
+		if (!cache->is_pending || 0 == cache->key_routing.l) continue;
+		if (!gale_text_accumulator_empty(&accum))
+			gale_text_accumulate(&accum,G_(":"));
+		gale_text_accumulate(&accum,cache->key_routing);
+	}
+
+	routing = gale_text_collect(&accum);
+	if (0 == routing.l) routing = G_("-");
+	if (!gale_text_compare(routing,domain->routing)) return;
+
+	domain->routing = routing;
+	if (domain->is_connected) link_subscribe(domain->link,domain->routing);
+}
 
 static void *on_packed_query(struct gale_packet *packet,void *x) {
 	struct cache *cache = (struct cache *) x;
 	packet->routing = gale_text_concat(7,
 		packet->routing,G_(":"),G_("@"),
-		gale_text_replace(gale_text_replace(cache->domain,
+		gale_text_replace(gale_text_replace(cache->domain->name,
 			G_(":"),G_("..")),
 			G_("/"),G_(".|")),
 		G_("/auth/query/"),
 		gale_text_replace(cache->local,G_(":"),G_("..")),G_("/"));
 
-	link_put(cache->link,packet);
+	if (NULL != cache->domain->link) link_put(cache->domain->link,packet);
 	return OOP_CONTINUE;
 }
 
-static void *on_connect(struct gale_server *s,
-	struct gale_text h,struct sockaddr_in a,void *x)
-{
-	struct cache *cache = (struct cache *) x;
-	assert(s == cache->server);
-
-	if (0 != cache->key_routing.l) 
-		link_subscribe(cache->link,cache->key_routing);
-
+static void send_query(struct cache *cache) {
 	if (!(cache->waiting_for_query = (NULL == cache->query_message)))
 		gale_pack_message(
 			cache->oop,cache->query_message,
 			on_packed_query,cache);
+}
+
+static void *on_connect(struct gale_server *s,
+	struct gale_text h,const struct sockaddr *a,void *x)
+{
+	struct domain *domain = (struct domain *) x;
+	struct gale_data key = null_data;
+	void *data;
+	assert(s == domain->server);
+
+	domain->is_connected = 1;
+	if (0 != domain->routing.l) 
+		link_subscribe(domain->link,domain->routing);
+
+	/* (Re)send every unanswered query in one burst. */
+	while (gale_map_walk(domain->active,&key,&key,&data))
+		if (((struct cache *) data)->is_pending)
+			send_query((struct cache *) data);
+
+	return OOP_CONTINUE;
+}
+
+static void *on_disconnect(struct gale_server *s,void *x) {
+	struct domain *domain = (struct domain *) x;
+	domain->is_connected = 0;
+	return OOP_CONTINUE;
+}
+
+static struct domain *get_domain(oop_source *oop,struct gale_text name) {
+	struct domain *domain;
+
+	if (NULL == domain_map) {
+		domain_map = gale_malloc_safe(sizeof(*domain_map));
+		*domain_map = gale_make_map(0);
+	}
+
+	domain = gale_map_find(*domain_map,gale_text_as_data(name));
+	if (NULL == domain) {
+		gale_create(domain);
+		domain->oop = oop;
+		domain->name = name;
+		domain->link = NULL;
+		domain->server = NULL;
+		domain->active = gale_make_map(0);
+		domain->routing = null_text;
+		domain->is_connected = 0;
+		domain->is_lingering = 0;
+		gale_map_add(*domain_map,gale_text_as_data(name),domain);
+	}
+
+	return domain;
+}
+
+static void open_domain(struct domain *domain) {
+	if (domain->is_lingering) {
+		domain->oop->cancel_time(domain->oop,
+			domain->linger,on_linger,domain);
+		domain->is_lingering = 0;
+	}
+
+	if (NULL != domain->server) return;
+
+	domain->link = new_link(domain->oop);
+	domain->routing = null_text;
+	domain->is_connected = 0;
+	link_on_message(domain->link,on_packet,domain);
+	domain->server = gale_make_server(domain->oop,domain->link,null_text,0);
+	gale_on_connect(domain->server,on_connect,domain);
+	gale_on_disconnect(domain->server,on_disconnect,domain);
+}
+
+static void *on_linger(oop_source *oop,struct timeval when,void *x) {
+	struct domain *domain = (struct domain *) x;
+	domain->is_lingering = 0;
+	if (NULL != domain->server
+	&& !gale_map_walk(domain->active,NULL,NULL,NULL)) {
+		gale_close(domain->server);
+		domain->server = NULL;
+		domain->link = NULL;
+		domain->is_connected = 0;
+	}
 
 	return OOP_CONTINUE;
 }
 
+/* Keep an idle connection around for a while in case more queries follow. */
+static void idle_domain(struct domain *domain) {
+	if (domain->is_lingering
+	||  gale_map_walk(domain->active,NULL,NULL,NULL)) return;
+	gale_time_to(&domain->linger,gale_time_now());
+	domain->linger.tv_sec += linger_interval;
+	domain->is_lingering = 1;
+	domain->oop->on_time(domain->oop,domain->linger,on_linger,domain);
+}
+
 static void end_search(struct cache *cache) {
 	struct gale_key_request * const handle = cache->handle;
+	cache->is_pending = 0;
 	if (NULL != handle) {
 		cache->handle = NULL;
 		gale_key_hook_done(cache->oop,cache->key,handle);
@@ -82,10 +211,10 @@ static void *on_timeout(oop_source *oop,struct timeval when,void *x) {
 		end_search(cache);
 	}
 
-	if (NULL != cache->server) {
-		gale_close(cache->server);
-		cache->server = NULL;
-	}
+	cache->is_pending = 0;
+	gale_map_add(cache->domain->active,active_key(cache),NULL);
+	resubscribe(cache->domain);
+	idle_domain(cache->domain);
 
 	if (NULL != ass) {
 		/* Update the timestamp if we didn't find anything. */
@@ -103,15 +232,46 @@ static void *on_timeout(oop_source *oop,struct timeval when,void *x) {
 	return OOP_CONTINUE;
 }
 
+/* Does any category in the message routing fall under the subscription? */
+static int is_routed(struct gale_text routing,struct gale_text sub) {
+	struct gale_text cat = null_text;
+	while (gale_text_token(routing,':',&cat)) {
+		struct gale_text prefix = null_text;
+		while (gale_text_token(sub,':',&prefix))
+			if (0 != prefix.l && !gale_text_compare(prefix,
+				gale_text_left(cat,prefix.l))) return 1;
+	}
+
+	return 0;
+}
+
+static void on_error(struct cache *cache,
+	struct gale_group group,struct gale_text error)
+{
+	const struct gale_time now = gale_time_now();
+	struct gale_key * const signer = gale_key_parent(cache->key);
+	const struct gale_key_assertion *pub;
+	if (NULL == signer) return;
+
+	pub = gale_key_public(signer,now);
+	if (NULL != pub) {
+		struct gale_group verify = gale_key_data(pub);
+		if (gale_crypto_verify(1,&verify,group)) {
+			gale_alert(GALE_WARNING,error,0);
+			end_search(cache);
+		}
+	}
+}
+
 static void *on_packet(struct gale_link *l,struct gale_packet *packet,void *x) {
 	struct gale_group group,original;
 	struct gale_fragment frag;
-        struct gale_text from;
+        struct gale_text from,error = null_text;
 	struct gale_time now = gale_time_now(),then;
 	const struct gale_data *bundled;
-	struct cache *cache = (struct cache *) x;
-	struct gale_key *signer = gale_key_parent(cache->key);
-	struct gale_data copy = packet->content;
+	struct domain *domain = (struct domain *) x;
+	struct gale_data copy = packet->content,key = null_data;
+	void *data;
 	if (!gale_unpack_group(&copy,&group)) {
 		gale_alert(GALE_WARNING,gale_text_concat(3,
 			G_("error decoding message on \""),
@@ -141,24 +301,22 @@ static void *on_packet(struct gale_link *l,struct gale_packet *packet,void *x) {
                             G_("in AKD response from "),from),then,0);
         }
 
-	if (NULL != gale_key_public(cache->key,now))
-		end_search(cache);
-
-	if (NULL != signer && NULL != cache->handle
-	&& (gale_group_lookup(original,G_("answer/key/error"),frag_text,&frag)
-	||  gale_group_lookup(original,G_("answer.key.error"),frag_text,&frag)))
-	{
-		const struct gale_key_assertion *pub;
-		pub = gale_key_public(signer,now);
-		if (NULL != pub) {
-			struct gale_group verify = gale_key_data(pub);
-			if (gale_crypto_verify(1,&verify,group)) {
-				gale_alert(GALE_WARNING,frag.value.text,0);
-				end_search(cache);
-			}
-		}
+	if (gale_group_lookup(original,G_("answer/key/error"),frag_text,&frag)
+	||  gale_group_lookup(original,G_("answer.key.error"),frag_text,&frag))
+		error = frag.value.text;
+
+	/* One answer may satisfy any number of the queries we're waiting on;
+	   errors only apply to the queries whose answer category they match. */
+	while (gale_map_walk(domain->active,&key,&key,&data)) {
+		struct cache * const cache = (struct cache *) data;
+		if (NULL == cache->handle) continue;
+		if (NULL != gale_key_public(cache->key,now))
+			end_search(cache);
+		else if (0 != error.l && is_routed(packet->routing,cache->key_routing))
+			on_error(cache,group,error);
 	}
 
+	resubscribe(domain);
 	return OOP_CONTINUE;
 }
 
@@ -180,7 +338,7 @@ static void *on_query_location(
 	frag.type = frag_text;
 	frag.name = G_("question/key");
 	frag.value.text = gale_text_concat(3,
-		cache->local,G_("@"),cache->domain);
+		cache->local,G_("@"),cache->domain->name);
 	gale_group_add(&cache->query_message->data,frag);
 
 	gale_create_array(cache->query_message->to,2);
@@ -188,12 +346,7 @@ static void *on_query_location(
 	cache->query_message->to[1] = NULL;
 	cache->query_message->from = NULL;
 
-	if (cache->waiting_for_query) {
-		cache->waiting_for_query = 0;
-		gale_pack_message(
-			cache->oop,cache->query_message,
-			on_packed_query,cache);
-	}
+	if (cache->waiting_for_query) send_query(cache);
 
 	return OOP_CONTINUE;
 }
@@ -211,12 +364,12 @@ static void *on_key_location(
 	assert(NULL != loc && 0 != r.l); /* _gale is built in! */
 	cache->key_routing = gale_text_concat(6,r,G_(":"),
 		G_("@"),
-		gale_text_replace(gale_text_replace(cache->domain,
+		gale_text_replace(gale_text_replace(cache->domain->name,
 			G_(":"),G_("..")),
 			G_("/"),G_(".|")),
 		G_("/auth/key/"),
 		gale_text_replace(cache->local,G_(":"),G_("..")));
-	link_subscribe(cache->link,cache->key_routing);
+	if (NULL != cache->oop) resubscribe(cache->domain);
 	return OOP_CONTINUE;
 }
 
@@ -248,18 +401,16 @@ static void on_search(struct gale_time now,oop_source *oop,
 		cache->oop = NULL;
 		cache->key = key;
 		cache->handle = NULL;
-		cache->server = NULL;
 		cache->local = gale_text_left(name,at);
-		cache->domain = gale_text_right(name,-at - 1);
+		cache->domain = get_domain(oop,gale_text_right(name,-at - 1));
 		cache->query_message = NULL;
 		cache->key_routing = null_text;
 		cache->last_attempt = gale_time_zero();
 		cache->last_refresh = gale_time_zero();
 		cache->waiting_for_query = 0;
-		cache->link = new_link(oop);
+		cache->is_pending = 0;
 		*ptr = cache;
 
-		link_on_message(cache->link,on_packet,cache);
 		gale_find_exact_location(oop,gale_text_concat(2,
 			G_("_gale.query."),key_name),
 			on_query_location,cache);
@@ -292,13 +443,14 @@ static void on_search(struct gale_time now,oop_source *oop,
 	}
 
 	/* BUG?  We're assuming the timeout is actually scheduled... */
-	assert(NULL == cache->oop 
-	    && NULL == cache->handle 
-	    && NULL == cache->server);
+	assert(NULL == cache->oop && NULL == cache->handle);
 	cache->oop = oop;
 	cache->handle = handle;
-	cache->server = gale_make_server(oop,cache->link,null_text,0);
-	gale_on_connect(cache->server,on_connect,cache);
+	cache->is_pending = 1;
+	gale_map_add(cache->domain->active,active_key(cache),cache);
+	open_domain(cache->domain);
+	resubscribe(cache->domain);
+	if (cache->domain->is_connected) send_query(cache);
 
 	cache->last_attempt = now;
 	gale_time_to(&timeout,now);
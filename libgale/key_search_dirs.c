@@ -168,7 +168,7 @@ static void add_dir(struct gale_text dir,enum dir_type type) {
 	gale_key_add_hook(dir_hook,data);
 }
 
-void key_i_init_dirs(void) {
+void key_i_init_dirs(int use_cache) {
 	struct gale_text dot_auth,sys_auth;
 
 	dot_auth = submk_dir(gale_global->dot_gale,G_("auth"),0700);
@@ -183,5 +183,6 @@ void key_i_init_dirs(void) {
 	add_dir(sub_dir(dot_auth,G_("local")),public_dir);
 	add_dir(sub_dir(sys_auth,G_("local")),public_dir);
 
-	add_dir(submk_dir(sys_auth,G_("cache"),0777),cache_dir);
+	if (use_cache)
+		add_dir(submk_dir(sys_auth,G_("cache"),0777),cache_dir);
 }
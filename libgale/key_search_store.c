@@ -0,0 +1,100 @@
+#include "key_i.h"
+#include "gale/key.h"
+#include "gale/globals.h"
+
+struct store_data {
+	struct gale_text name;
+	struct gale_store *store;
+};
+
+struct store_cache {
+	struct gale_key_assertion *ass;
+	struct gale_time stamp;
+	const struct gale_key_assertion *written;
+};
+
+static struct gale_data store_key(struct gale_text name) {
+	struct gale_data key;
+	key.p = gale_malloc_atomic(gale_text_len_size(name));
+	key.l = 0;
+	gale_pack_text_len(&key,name);
+	return key;
+}
+
+static void store_hook(struct gale_time now,oop_source *oop,
+	struct gale_key *key,int flags,
+	struct gale_key_request *handle,
+	void *user,void **ptr)
+{
+	struct store_data *data = (struct store_data *) user;
+	const struct gale_text name = gale_key_name(key);
+	const struct gale_key_assertion *pub;
+	struct store_cache *cache;
+	struct gale_data raw,k;
+	struct gale_time stamp;
+
+	if (0 == name.l) {
+		gale_key_hook_done(oop,key,handle);
+		return;
+	}
+
+	if (NULL != *ptr)
+		cache = *ptr;
+	else {
+		gale_create(cache);
+		cache->ass = NULL;
+		cache->stamp = gale_time_zero();
+		cache->written = NULL;
+		*ptr = cache;
+	}
+
+	k = store_key(name);
+	if (!gale_store_find(data->store,k,&raw,&stamp)) {
+		gale_key_retract(cache->ass,0);
+		cache->ass = NULL;
+	} else if (NULL == cache->ass
+	       ||  gale_time_compare(stamp,cache->stamp)
+	       ||  gale_data_compare(raw,gale_key_raw(cache->ass))) {
+		gale_key_retract(cache->ass,0);
+		cache->ass = gale_key_assert(raw,gale_text_concat(2,
+			G_("in store "),data->name),stamp,0);
+		cache->stamp = stamp;
+	}
+
+	/* Like the cache directory, keep only signed public keys. */
+	pub = gale_key_public(key,now);
+	if (NULL != pub && NULL == gale_key_signed(pub)) pub = NULL;
+
+	if (NULL == pub) {
+		if (NULL != cache->ass && gale_store_erase(data->store,k,now)) {
+			gale_key_retract(cache->ass,0);
+			cache->ass = NULL;
+		}
+	} else if ((pub != cache->ass && pub != cache->written)
+	       ||  gale_time_compare(gale_key_time(pub),cache->stamp) > 0) {
+		raw = gale_key_raw(pub);
+		stamp = gale_key_time(pub);
+		if (gale_store_put(data->store,k,raw,stamp)) {
+			gale_key_retract(cache->ass,0);
+			cache->ass = gale_key_assert(raw,
+				gale_key_from(pub),stamp,0);
+			cache->stamp = stamp;
+		}
+		cache->written = pub;
+	}
+
+	gale_key_hook_done(oop,key,handle);
+}
+
+/* Use a shared key store in place of the cache directory, if configured. */
+int key_i_init_store(void) {
+	struct store_data *data;
+	const struct gale_text name = gale_var(G_("GALE_KEY_STORE"));
+	if (0 == name.l) return 0;
+
+	gale_create(data);
+	data->name = name;
+	data->store = gale_open_store(name,0666);
+	gale_key_add_hook(store_hook,data);
+	return 1;
+}
@@ -1,12 +1,18 @@
 #include <assert.h>
+#include <dirent.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -17,42 +23,74 @@
 #ifdef HAVE_ADNS
 #include "adns.h"
 #include "oop-adns.h"
-#define ADNS_ONLY(x) x
+#endif
+
+/* Nothing here may block the event loop.  Names are looked up in the
+   background (by ADNS, or else by getaddrinfo() in a child process), and
+   the answers are cached for the whole process, for as long as the DNS
+   says (or DNS_TTL seconds, if we can't tell), so that every attempt to
+   reach a host shares one lookup.  The addresses found are tried in turn,
+   alternating IPv6 and IPv4, with a new attempt started every
+   CONNECT_DELAY milliseconds (or as soon as the last one fails) while the
+   earlier ones carry on; the first to connect wins (RFC 8305). */
+
+#define DNS_TTL 300         /* seconds to cache an answer of unknown age */
+#define DNS_NEGATIVE_TTL 30 /* seconds to remember that a name is unknown */
+#define DNS_CACHE 1024      /* names cached before old ones are dropped */
+#define CONNECT_DELAY 250   /* milliseconds between connection attempts */
+
+struct lookup {
+	struct gale_text name,canon;
+	struct sockaddr_storage *addrs;
+	int num,is_pending;
+	struct gale_time expires;
+	struct resolution *waiting;
+	struct lookup *older,*newer;
+#ifdef HAVE_ADNS
+	oop_adns_query *query;
 #else
-#define ADNS_ONLY(x)
+	int fd;
+	struct gale_data reply;
+	size_t alloc;
 #endif
+};
 
-static struct in_addr *local_addrs = NULL;
+struct resolution {
+	struct gale_connect *owner;
+	struct lookup *lookup;
+	int port,is_self;
+	struct resolution *next;
+};
 
-struct address {
-	int sock;
-	enum { sock_connecting, sock_connected } state;
-	struct sockaddr_in sin;
+struct candidate {
+	struct sockaddr_storage sa;
 	struct gale_text name;
+	struct candidate *next;
 };
 
-#ifdef HAVE_ADNS
-struct resolution {
-	struct gale_connect *owner;
+struct address {
+	int sock,is_unix;
+	struct sockaddr_storage sa;
 	struct gale_text name;
-	int port;
-	oop_adns_query *query;
 };
-#endif
 
 struct gale_connect {
 	oop_source *source;
-	ADNS_ONLY(oop_adapter_adns *adns;)
 
 	int avoid_local_port,found_local;
-	struct in_addr least_local;
+	struct sockaddr_storage least_local;
+	struct sockaddr_storage *self;  /* our own addresses, by name */
+	int num_self,self_pending;
 
 	struct address **addresses;
 	int num_address,alloc_address;
 
-	ADNS_ONLY(struct resolution **resolving;)
-	ADNS_ONLY(int num_resolve; int alloc_resolve;)
-	ADNS_ONLY(int all_names;)
+	struct candidate *queue[2];     /* IPv6, then everything else */
+	int last_family,is_staggered;
+	struct timeval stagger;
+
+	struct resolution **resolving;
+	int num_resolve,alloc_resolve,all_names;
 
 	gale_connect_call *call;
 	void *data;
@@ -65,125 +103,232 @@ extern int Rconnect(int,const struct sockaddr *,size_t);
 #define CONNECT_F connect
 #endif
 
+static struct gale_map *cache = NULL;
+static int num_cached = 0;
+static struct lookup *oldest = NULL,*newest = NULL; /* by answer time */
+static struct gale_time next_sweep;
+
 static oop_call_fd on_write;
-static oop_call_time on_abort;
-ADNS_ONLY(static oop_adns_call on_lookup;)
+static oop_call_time on_abort,on_stagger;
+static void start_next(struct gale_connect *conn);
+
+static socklen_t addr_len(const struct sockaddr_storage *sa) {
+	return (AF_INET6 == sa->ss_family)
+		? sizeof(struct sockaddr_in6)
+		: sizeof(struct sockaddr_in);
+}
+
+static int addr_port(const struct sockaddr_storage *sa) {
+	if (AF_INET6 == sa->ss_family)
+		return ntohs(((const struct sockaddr_in6 *) sa)->sin6_port);
+	return ntohs(((const struct sockaddr_in *) sa)->sin_port);
+}
+
+static void set_port(struct sockaddr_storage *sa,int port) {
+	if (AF_INET6 == sa->ss_family)
+		((struct sockaddr_in6 *) sa)->sin6_port = htons(port);
+	else
+		((struct sockaddr_in *) sa)->sin_port = htons(port);
+}
+
+/* Order addresses (by family, then in network byte order). */
+static int compare_addr(
+	const struct sockaddr_storage *a,
+	const struct sockaddr_storage *b)
+{
+	if (a->ss_family != b->ss_family) return a->ss_family - b->ss_family;
+	if (AF_INET6 == a->ss_family)
+		return memcmp(&((const struct sockaddr_in6 *) a)->sin6_addr,
+		              &((const struct sockaddr_in6 *) b)->sin6_addr,
+		              sizeof(struct in6_addr));
+	return memcmp(&((const struct sockaddr_in *) a)->sin_addr,
+	              &((const struct sockaddr_in *) b)->sin_addr,
+	              sizeof(struct in_addr));
+}
+
+static struct gale_text addr_text(const struct sockaddr *sa) {
+	char buf[INET6_ADDRSTRLEN];
+	if (AF_INET6 == sa->sa_family) {
+		const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) sa;
+		inet_ntop(AF_INET6,&sin6->sin6_addr,buf,sizeof(buf));
+		return gale_text_concat(4,
+			G_("["),gale_text_from(NULL,buf,-1),G_("]:"),
+			gale_text_from_number(ntohs(sin6->sin6_port),10,0));
+	}
+
+	if (AF_INET == sa->sa_family) {
+		const struct sockaddr_in *sin = (const struct sockaddr_in *) sa;
+		inet_ntop(AF_INET,&sin->sin_addr,buf,sizeof(buf));
+		return gale_text_concat(3,
+			gale_text_from(NULL,buf,-1),G_(":"),
+			gale_text_from_number(ntohs(sin->sin_port),10,0));
+	}
+
+	return G_("unknown");
+}
+
+static const char *show(const struct sockaddr_storage *sa) {
+	return gale_text_to(gale_global->enc_console,
+		addr_text((const struct sockaddr *) sa));
+}
 
 static void *on_abort(oop_source *s,struct timeval tv,void *x) {
 	struct gale_connect *conn = (struct gale_connect *) x;
-	struct sockaddr_in addr;
+	struct sockaddr_storage addr;
 	gale_abort_connect(conn);
 	memset(&addr,0,sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = 0;
-	addr.sin_port = 0;
-	return conn->call(-1,null_text,addr,conn->found_local,conn->data);
+	addr.ss_family = AF_UNSPEC;
+	return conn->call(-1,null_text,(struct sockaddr *) &addr,
+	                  conn->found_local,conn->data);
 }
 
 static void check_done(struct gale_connect *conn) {
-	if (0 == conn->num_address
-	ADNS_ONLY(&& 0 == conn->num_resolve && conn->all_names))
+	if (0 == conn->num_address && 0 == conn->num_resolve
+	&&  NULL == conn->queue[0] && NULL == conn->queue[1]
+	&&  conn->all_names)
 		conn->source->on_time(conn->source,OOP_TIME_NOW,on_abort,conn);
 }
 
 static void del_address(struct gale_connect *conn,int i) {
-	gale_dprintf(6,"(connect %p) removing address %s\n", conn,
-	             inet_ntoa(conn->addresses[i]->sin.sin_addr),
-	             ntohs(conn->addresses[i]->sin.sin_port));
+	gale_dprintf(6,"(connect %p) removing address %s\n",
+	             conn,show(&conn->addresses[i]->sa));
 	conn->source->cancel_fd(conn->source,
 	                        conn->addresses[i]->sock,OOP_WRITE);
 	conn->addresses[i] = conn->addresses[--(conn->num_address)];
 	check_done(conn);
 }
 
-static int is_local(int sock,struct in_addr *addr) {
-	struct sockaddr_in sin;
+static int is_bindable(int sock,const struct sockaddr_storage *addr) {
+	struct sockaddr_storage sa = *addr;
+	set_port(&sa,0);
+	return 0 == bind(sock,(struct sockaddr *) &sa,addr_len(&sa));
+}
+
+static int is_local(struct gale_connect *conn,
+                    int sock,const struct sockaddr_storage *addr) {
 	int i;
-	memset(&sin,0,sizeof(sin));
-	sin.sin_family = AF_INET;
-	sin.sin_addr = *addr;
-	sin.sin_port = 0;
-	if (0 == bind(sock,(struct sockaddr *) &sin,sizeof(sin))) 
-		return 1;
-
-	/* Too bad this isn't asynchronous, but that just hurts my head. */
-	if (NULL == local_addrs) {
-		struct hostent *host;
-		host = gethostbyname(gale_text_to(
-			gale_global->enc_sys,gale_var(G_("HOST"))));
-		if (NULL == host) {
-			local_addrs = gale_malloc_safe(sizeof(*local_addrs));
-			local_addrs[0].s_addr = 0;
-		} else {
-			int num;
-			assert(AF_INET == host->h_addrtype);
-			assert(sizeof(*local_addrs) == host->h_length);
-			for (num = 0; NULL != host->h_addr_list[num]; ++num) ;
-			local_addrs = gale_malloc_safe(
-				(1 + num) * sizeof(*local_addrs));
-			for (num = 0; NULL != host->h_addr_list[num]; ++num)
-				memcpy(&local_addrs[num],
-					host->h_addr_list[num],
-					host->h_length);
-			local_addrs[num].s_addr = 0;
-		}
+	if (is_bindable(sock,addr)) return 1;
+	for (i = 0; i < conn->num_self; ++i)
+		if (!compare_addr(&conn->self[i],addr)) return 1;
+	return 0;
+}
+
+/* The socket lives in a shared directory (normally /tmp), so anyone could
+   have put it there.  Trust it only if it belongs to root, to the owner
+   of the system directory, or to us; the sticky bit keeps others from
+   replacing it after we look. */
+static int is_trusted(struct gale_text path,const char *name) {
+	struct stat st,sys;
+
+	if (lstat(name,&st)) return 0;
+	if (S_ISSOCK(st.st_mode)) {
+		if (0 == st.st_uid || geteuid() == st.st_uid) return 1;
+		if (!stat(gale_text_to(gale_global->enc_filesys,
+			gale_global->sys_dir),&sys)
+		&&  sys.st_uid == st.st_uid) return 1;
 	}
 
-	for (i = 0; 0 != local_addrs[i].s_addr; ++i)
-		if (local_addrs[i].s_addr == addr->s_addr)
-			return 1;
+	gale_alert(GALE_WARNING,gale_text_concat(2,path,
+		G_(": not a server socket we trust, ignoring it")),0);
 	return 0;
 }
 
-static void add_address(
-	struct gale_connect *conn,
-	struct gale_text name,struct sockaddr_in sin) 
-{
-	struct address *addr;
+/* Try the UNIX-domain socket of a server on this host. */
+static int connect_local(int port) {
+	const struct gale_text path = gale_local_socket(port);
+	const char *name = gale_text_to(gale_global->enc_filesys,path);
+	struct sockaddr_un sun;
+	int sock;
 
-	gale_dprintf(5,"(connect %p) \"%s\" is %s\n",
-	             conn, gale_text_to(0, name), inet_ntoa(sin.sin_addr));
+	if (strlen(name) >= sizeof(sun.sun_path)) return -1;
+	if (!is_trusted(path,name)) return -1;
+	memset(&sun,0,sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path,name);
+
+	sock = socket(AF_UNIX,SOCK_STREAM,0);
+	if (sock < 0) return -1;
+	fcntl(sock,F_SETFD,FD_CLOEXEC);
+	if (fcntl(sock,F_SETFL,O_NONBLOCK)) {
+		close(sock);
+		return -1;
+	}
+
+	while (connect(sock,(struct sockaddr *) &sun,sizeof(sun))) {
+		if (errno != EINTR) {
+			close(sock);
+			return -1;
+		}
+	}
+
+	return sock;
+}
+
+static void push_address(struct gale_connect *conn,struct address *addr) {
 	if (conn->alloc_address == conn->num_address) {
 		gale_resize_array(conn->addresses,
-			conn->alloc_address = conn->alloc_address 
+			conn->alloc_address = conn->alloc_address
 			? 2*conn->alloc_address : 6);
 	}
 
+	conn->addresses[conn->num_address++] = addr;
+	conn->source->on_fd(conn->source,addr->sock,OOP_WRITE,on_write,conn);
+}
+
+/* Start connecting to an address; return nonzero if an attempt is
+   under way. */
+static int try_address(
+	struct gale_connect *conn,
+	struct gale_text name,const struct sockaddr_storage *sa)
+{
+	struct address *addr;
+
 	/* Are we a sucker? */
 	if (0 != conn->avoid_local_port && conn->found_local
-	&&  ntohl(sin.sin_addr.s_addr) 
-	>=  ntohl(conn->least_local.s_addr)) {
+	&&  compare_addr(sa,&conn->least_local) >= 0) {
 		gale_dprintf(5,"(connect %p) ignoring sucker address %s\n",
-		             conn, inet_ntoa(sin.sin_addr));
-		return;
+		             conn,show(sa));
+		return 0;
 	}
 
 	gale_create(addr);
-	addr->sin = sin;
+	addr->sa = *sa;
 	addr->name = name;
-	addr->state = sock_connecting;
-	addr->sock = socket(AF_INET,SOCK_STREAM,IPPROTO_TCP);
-	if (addr->sock < 0) return;
+	addr->is_unix = 0;
+	addr->sock = socket(sa->ss_family,SOCK_STREAM,IPPROTO_TCP);
+	if (addr->sock < 0) return 0;
 	fcntl(addr->sock, F_SETFD, FD_CLOEXEC);
 
-	if (conn->avoid_local_port == ntohs(sin.sin_port)
-	&&  is_local(addr->sock,&sin.sin_addr))
+	/* Clients prefer a server's local socket to TCP over loopback. */
+	if (0 == conn->avoid_local_port && is_bindable(addr->sock,sa)) {
+		const int sock = connect_local(addr_port(sa));
+		if (sock >= 0) {
+			gale_dprintf(5,"(connect %p) using local socket for %s\n",
+			             conn,show(sa));
+			close(addr->sock);
+			addr->sock = sock;
+			addr->is_unix = 1;
+			push_address(conn,addr);
+			return 1;
+		}
+	}
+
+	if (conn->avoid_local_port == addr_port(sa)
+	&&  is_local(conn,addr->sock,sa))
 	{
 		gale_dprintf(5,"(connect %p) address %s is local, skipping\n",
-		             conn, inet_ntoa(sin.sin_addr));
+		             conn,show(sa));
 
 		if (!conn->found_local
-		||  ntohl(sin.sin_addr.s_addr) 
-		  < ntohl(conn->least_local.s_addr)) {
+		||  compare_addr(sa,&conn->least_local) < 0) {
 			int i = 0;
 			conn->found_local = 1;
-			conn->least_local = sin.sin_addr;
+			conn->least_local = *sa;
 
 			/* Terminate other suckers. */
 			while (i < conn->num_address)
-			    if (ntohl(conn->addresses[i]->sin.sin_addr.s_addr)
-			    >=  ntohl(sin.sin_addr.s_addr)) {
-				gale_dprintf(5,"(connect %p) killing sucker address %s\n", conn, inet_ntoa(conn->addresses[i]->sin.sin_addr));
+			    if (compare_addr(&conn->addresses[i]->sa,sa) >= 0) {
+				gale_dprintf(5,"(connect %p) killing sucker address %s\n", conn, show(&conn->addresses[i]->sa));
 				close(conn->addresses[i]->sock);
 				del_address(conn,i);
 			    } else
@@ -191,114 +336,451 @@ static void add_address(
 		}
 
 		close(addr->sock);
-		return;
+		return 0;
 	}
 
-	gale_dprintf(5,"(connect %p) connecting to %s:%d\n", conn,
-	             inet_ntoa(sin.sin_addr),ntohs(sin.sin_port));
+	gale_dprintf(5,"(connect %p) connecting to %s\n",conn,show(sa));
 	if (fcntl(addr->sock,F_SETFL,O_NONBLOCK)) {
 		close(addr->sock);
-		return;
+		return 0;
 	}
 
-	while (CONNECT_F(addr->sock,(struct sockaddr *) &sin,sizeof(sin))) {
+	while (CONNECT_F(addr->sock,(struct sockaddr *) sa,addr_len(sa))) {
 		if (errno == EINPROGRESS) break;
 		if (errno != EINTR) {
 			gale_dprintf(5,"(connect %p) error connecting to %s: %s\n",
-				     conn,inet_ntoa(sin.sin_addr),strerror(errno));
+				     conn,show(sa),strerror(errno));
 			close(addr->sock);
+			return 0;
+		}
+	}
+
+	push_address(conn,addr);
+	return 1;
+}
+
+static void *on_stagger(oop_source *src,struct timeval tv,void *x) {
+	struct gale_connect *conn = (struct gale_connect *) x;
+	conn->is_staggered = 0;
+	start_next(conn);
+	return OOP_CONTINUE;
+}
+
+static void cancel_stagger(struct gale_connect *conn) {
+	if (!conn->is_staggered) return;
+	conn->source->cancel_time(conn->source,conn->stagger,on_stagger,conn);
+	conn->is_staggered = 0;
+}
+
+/* Give the attempts under way a head start before the next. */
+static void stagger(struct gale_connect *conn) {
+	if (conn->is_staggered) return;
+	gettimeofday(&conn->stagger,NULL);
+	conn->stagger.tv_usec += CONNECT_DELAY * 1000;
+	conn->stagger.tv_sec += conn->stagger.tv_usec / 1000000;
+	conn->stagger.tv_usec %= 1000000;
+	conn->is_staggered = 1;
+	conn->source->on_time(conn->source,conn->stagger,on_stagger,conn);
+}
+
+/* Start the next attempt (unless we're waiting for one to get going),
+   and arrange for the one after. */
+static void start_next(struct gale_connect *conn) {
+	if (conn->is_staggered || conn->self_pending) return;
+
+	for (;;) {
+		struct candidate *next;
+		int which;
+
+		if (NULL == conn->queue[0] && NULL == conn->queue[1]) {
+			check_done(conn);
 			return;
 		}
+
+		/* Alternate families, IPv6 first. */
+		which = (NULL == conn->queue[1]
+		     || (NULL != conn->queue[0] && AF_INET6 != conn->last_family))
+		      ? 0 : 1;
+		next = conn->queue[which];
+		conn->queue[which] = next->next;
+		conn->last_family = next->sa.ss_family;
+		if (try_address(conn,next->name,&next->sa)) break;
 	}
 
-	conn->addresses[conn->num_address++] = addr;
-	conn->source->on_fd(conn->source,addr->sock,OOP_WRITE,on_write,conn);
+	if (NULL != conn->queue[0] || NULL != conn->queue[1]) stagger(conn);
 }
 
-static void last_address(struct gale_connect *conn) {
-	ADNS_ONLY(assert(0 == conn->num_resolve);)
+/* Queue an address to try, unless it's already queued or under way. */
+static void add_address(
+	struct gale_connect *conn,
+	struct gale_text name,const struct sockaddr_storage *sa)
+{
+	const int which = (AF_INET6 == sa->ss_family) ? 0 : 1;
+	struct candidate **ptr,*cand;
+	int i;
+
+	gale_dprintf(5,"(connect %p) \"%s\" is %s\n",
+	             conn,gale_text_to(0,name),show(sa));
+	if (AF_INET != sa->ss_family && AF_INET6 != sa->ss_family) return;
+	for (i = 0; i < conn->num_address; ++i)
+		if (!compare_addr(&conn->addresses[i]->sa,sa)
+		&&  addr_port(&conn->addresses[i]->sa) == addr_port(sa)) return;
+	for (ptr = &conn->queue[which]; NULL != *ptr; ptr = &(*ptr)->next)
+		if (!compare_addr(&(*ptr)->sa,sa)
+		&&  addr_port(&(*ptr)->sa) == addr_port(sa)) return;
+
+	gale_create(cand);
+	cand->sa = *sa;
+	cand->name = name;
+	cand->next = NULL;
+	*ptr = cand;
+
+	/* If nothing is in progress, there's no reason to wait. */
+	if (0 != conn->num_address)
+		stagger(conn);
+	else {
+		cancel_stagger(conn);
+		start_next(conn);
+	}
+}
+
+static void del_name(struct gale_connect *conn,int i) {
+	struct resolution *res = conn->resolving[i];
+	struct resolution **ptr = &res->lookup->waiting;
+	assert(res->owner == conn);
+	while (NULL != *ptr && res != *ptr) ptr = &(*ptr)->next;
+	if (NULL != *ptr) *ptr = res->next;
+	conn->resolving[i] = conn->resolving[--(conn->num_resolve)];
+}
+
+/* Hand a finished lookup to one of the connections waiting for it. */
+static void deliver(struct resolution *res) {
+	struct gale_connect * const conn = res->owner;
+	const struct lookup * const look = res->lookup;
+	int i;
+
+	for (i = 0; res != conn->resolving[i]; ++i)
+		assert(i < conn->num_resolve);
+	del_name(conn,i);
+
+	if (0 == look->num)
+		gale_dprintf(5,"(connect %p) no addresses for \"%s\"\n",
+		             conn,gale_text_to(0,look->name));
+
+	if (res->is_self) {
+		conn->self = look->addrs;
+		conn->num_self = look->num;
+		conn->self_pending = 0;
+		start_next(conn);
+		return;
+	}
+
+	for (i = 0; i < look->num; ++i) {
+		struct sockaddr_storage sa = look->addrs[i];
+		set_port(&sa,res->port);
+		add_address(conn,look->canon,&sa);
+	}
+
 	check_done(conn);
 }
 
-static void add_name(struct gale_connect *conn,struct gale_text name,int port) {
-	const char *hostname = gale_text_to(NULL, name);
-	struct sockaddr_in sin;
+static void unlink_lookup(struct lookup *look) {
+	if (NULL == look->older) oldest = look->newer;
+	else look->older->newer = look->newer;
+	if (NULL == look->newer) newest = look->older;
+	else look->newer->older = look->older;
+	look->older = look->newer = NULL;
+}
+
+static void link_lookup(struct lookup *look) {
+	look->older = newest;
+	look->newer = NULL;
+	if (NULL == newest) oldest = look;
+	else newest->newer = look;
+	newest = look;
+}
+
+static void finish_lookup(struct lookup *look,
+	struct sockaddr_storage *addrs,int num,int ttl)
+{
+	struct resolution *res = look->waiting;
+	unlink_lookup(look);
+	link_lookup(look);
+	look->addrs = addrs;
+	look->num = num;
+	look->is_pending = 0;
+	look->expires = gale_time_add(gale_time_now(),gale_time_seconds(
+		(ttl > 0) ? ttl : (num > 0) ? DNS_TTL : DNS_NEGATIVE_TTL));
+	if (0 > gale_time_compare(look->expires,next_sweep))
+		next_sweep = look->expires;
+	look->waiting = NULL;
+
+	while (NULL != res) {
+		struct resolution * const next = res->next;
+		deliver(res);
+		res = next;
+	}
+}
 
 #ifdef HAVE_ADNS
-	struct resolution *res;
+static oop_adapter_adns *adns = NULL;
+static oop_adns_call on_lookup;
+
+static int start_lookup(oop_source *src,struct lookup *look) {
+	if (NULL == adns) adns = oop_adns_new(src,0,NULL);
+	if (NULL == adns) return 0;
+	look->query = oop_adns_submit(adns,NULL,
+		gale_text_to(NULL,look->name),
+		adns_r_addr,0,on_lookup,look);
+	return NULL != look->query;
+}
+
+static void *on_lookup(oop_adapter_adns *a,adns_answer *answer,void *data) {
+	struct lookup *look = (struct lookup *) data;
+	struct sockaddr_storage *addrs = NULL;
+	int i,num = 0;
+
+	look->query = NULL;
+	if (adns_s_ok == answer->status) {
+		if (answer->cname)
+			look->canon = gale_text_from(NULL,answer->cname,-1);
+		gale_create_array(addrs,answer->nrrs);
+		for (i = 0; i < answer->nrrs; ++i) {
+			const adns_rr_addr *rr = &answer->rrs.addr[i];
+			if (rr->len > sizeof(*addrs)) continue;
+			memset(&addrs[num],0,sizeof(*addrs));
+			memcpy(&addrs[num++],&rr->addr,rr->len);
+		}
+	}
+
+	i = answer->expires - time(NULL);
+	free(answer);
+	finish_lookup(look,addrs,num,i);
+	return OOP_CONTINUE;
+}
 #else
-	struct hostent *he = gethostbyname(gale_text_to(NULL,name));
-	int i;
+/* Look a name up with getaddrinfo() and write the addresses down a pipe.
+   This runs in a grandchild (which the parent needn't wait for). */
+static void lookup_child(int fd,const char *name) {
+	struct addrinfo hints,*res = NULL,*ai;
+
+	/* Don't hold the parent's connections open.  Move the pipe to fd 0
+	   and close the rest, without trying every possible descriptor. */
+	if (0 != fd && 0 == dup2(fd,0)) fd = 0;
+	if (0 == fd) {
+#ifdef HAVE_CLOSEFROM
+		closefrom(1);
+#else
+		DIR * const dir = opendir("/proc/self/fd");
+		struct dirent *de;
+		if (NULL != dir) {
+			while (NULL != (de = readdir(dir))) {
+				const int i = atoi(de->d_name);
+				if (i > 0 && i != dirfd(dir)) close(i);
+			}
+			closedir(dir);
+		}
 #endif
+	}
 
-	gale_dprintf(4,"(connect %p) looking for \"%s\"\n",
-	             conn, gale_text_to(gale_global->enc_console,name));
-
-#ifdef HAVE_ADNS
-	if (NULL == conn->adns)
-		conn->adns = oop_adns_new(conn->source,0,NULL);
-
-	if (NULL != conn->adns) {
-		if (conn->alloc_resolve == conn->num_resolve) {
-			gale_resize_array(conn->resolving,
-				conn->alloc_resolve = conn->alloc_resolve 
-				? 2*conn->alloc_resolve : 6);
+	memset(&hints,0,sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (0 == getaddrinfo(name,NULL,&hints,&res))
+		for (ai = res; NULL != ai; ai = ai->ai_next) {
+			struct sockaddr_storage sa;
+			const char *p = (const char *) &sa;
+			size_t left = sizeof(sa);
+			if (ai->ai_addrlen > sizeof(sa)) continue;
+			memset(&sa,0,sizeof(sa));
+			memcpy(&sa,ai->ai_addr,ai->ai_addrlen);
+			while (left > 0) {
+				const ssize_t r = write(fd,p,left);
+				if (r < 0 && EINTR == errno) continue;
+				if (r <= 0) _exit(1);
+				p += r;
+				left -= r;
+			}
 		}
 
-		gale_create(res);
-		res->owner = conn;
-		res->name = name;
-		res->port = port;
-		res->query = oop_adns_submit(conn->adns, NULL,
-			hostname,
-			adns_r_a,0,on_lookup,res);
+	_exit(0);
+}
 
-		if (NULL != res->query)
-			conn->resolving[conn->num_resolve++] = res;
+static void *on_reply(oop_source *src,int fd,oop_event ev,void *x) {
+	struct lookup *look = (struct lookup *) x;
+	struct sockaddr_storage *addrs;
+	ssize_t r;
+	int num;
+
+	if (look->reply.l == look->alloc) {
+		const byte *old = look->reply.p;
+		look->alloc = look->alloc ? 2 * look->alloc : 8 * sizeof(*addrs);
+		look->reply.p = gale_malloc_atomic(look->alloc);
+		if (look->reply.l > 0) memcpy(look->reply.p,old,look->reply.l);
 	}
 
-	memset(&sin,0,sizeof(sin));
-	if (inet_aton(hostname, &sin.sin_addr)) {
-		sin.sin_family = AF_INET;
-		sin.sin_port = htons(port);
-		add_address(conn,name,sin);
+	r = read(fd,look->reply.p + look->reply.l,look->alloc - look->reply.l);
+	if (r < 0 && (EINTR == errno || EAGAIN == errno)) return OOP_CONTINUE;
+	if (r > 0) {
+		look->reply.l += r;
+		return OOP_CONTINUE;
 	}
-#else
-	if (NULL == he) {
-		gale_dprintf(5,"(connect %p) no addresses for \"%s\"\n",
-		             conn, hostname);
-		return;
+
+	src->cancel_fd(src,fd,OOP_READ);
+	close(fd);
+	look->fd = -1;
+
+	num = look->reply.l / sizeof(*addrs);
+	gale_create_array(addrs,num);
+	if (num > 0) memcpy(addrs,look->reply.p,num * sizeof(*addrs));
+	look->reply = null_data;
+	look->alloc = 0;
+	finish_lookup(look,addrs,num,0);
+	return OOP_CONTINUE;
+}
+
+static int start_lookup(oop_source *src,struct lookup *look) {
+	const char *name = gale_text_to(NULL,look->name);
+	int fds[2];
+	pid_t pid;
+
+	if (pipe(fds)) return 0;
+	pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return 0;
 	}
 
-	memset(&sin,0,sizeof(sin));
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(port);
-	for (i = 0; NULL != he->h_addr_list[i]; ++i) {
-		sin.sin_addr = * (struct in_addr *) he->h_addr_list[i];
-		add_address(conn,name,sin);
+	if (0 == pid) {
+		if (0 == fork()) lookup_child(fds[1],name);
+		_exit(0);
 	}
+
+	close(fds[1]);
+	while (waitpid(pid,NULL,0) < 0 && EINTR == errno) ;
+	fcntl(fds[0],F_SETFD,FD_CLOEXEC);
+	fcntl(fds[0],F_SETFL,O_NONBLOCK);
+	look->fd = fds[0];
+	look->reply = null_data;
+	look->alloc = 0;
+	src->on_fd(src,look->fd,OOP_READ,on_reply,look);
+	return 1;
+}
 #endif
+
+static void drop_lookup(struct lookup *look) {
+	unlink_lookup(look);
+	gale_map_add(cache,gale_text_as_data(look->name),NULL);
+	--num_cached;
 }
 
-#ifdef HAVE_ADNS
-static void del_name(struct gale_connect *conn,int i) {
-	assert(conn->resolving[i]->owner == conn);
-	if (NULL != conn->resolving[i]->query) {
-		oop_adns_cancel(conn->resolving[i]->query);
-		conn->resolving[i]->query = NULL;
+/* Make room for another name, if the cache is full.  Expired answers go
+   first (but we only look for them once the earliest is due); otherwise
+   the oldest answer is dropped. */
+static void sweep(void) {
+	const struct gale_time now = gale_time_now();
+	struct gale_data key = null_data;
+	struct lookup *look;
+	void *data;
+
+	if (num_cached < DNS_CACHE) return;
+	if (0 <= gale_time_compare(now,next_sweep)) {
+		next_sweep = gale_time_forever();
+		while (gale_map_walk(cache,&key,&key,&data)) {
+			look = (struct lookup *) data;
+			if (look->is_pending) continue;
+			if (0 >= gale_time_compare(look->expires,now))
+				drop_lookup(look);
+			else if (0 > gale_time_compare(look->expires,next_sweep))
+				next_sweep = look->expires;
+		}
+	}
+
+	for (look = oldest; num_cached >= DNS_CACHE && NULL != look; ) {
+		struct lookup * const newer = look->newer;
+		if (!look->is_pending) drop_lookup(look);
+		look = newer;
 	}
-	conn->resolving[i] = conn->resolving[--(conn->num_resolve)];
-	check_done(conn);
 }
-#endif
 
-static void last_name(struct gale_connect *conn) {
-#ifdef HAVE_ADNS
-	conn->all_names = 1;
-	if (0 == conn->num_resolve) last_address(conn);
-#else
-	last_address(conn);
-#endif
+static void add_name(struct gale_connect *conn,
+                     struct gale_text name,int port,int is_self)
+{
+	const char *hostname = gale_text_to(NULL,name);
+	struct sockaddr_storage sa;
+	struct resolution *res;
+	struct lookup *look;
+
+	gale_dprintf(4,"(connect %p) looking for \"%s\"\n",
+	             conn, gale_text_to(gale_global->enc_console,name));
+
+	/* Addresses need no lookup. */
+	memset(&sa,0,sizeof(sa));
+	if (inet_pton(AF_INET,hostname,
+		&((struct sockaddr_in *) &sa)->sin_addr) > 0)
+		sa.ss_family = AF_INET;
+	else if (inet_pton(AF_INET6,hostname,
+		&((struct sockaddr_in6 *) &sa)->sin6_addr) > 0)
+		sa.ss_family = AF_INET6;
+	if (AF_UNSPEC != sa.ss_family) {
+		set_port(&sa,port);
+		if (!is_self)
+			add_address(conn,name,&sa);
+		else {
+			gale_create(conn->self);
+			*conn->self = sa;
+			conn->num_self = 1;
+		}
+		return;
+	}
+
+	if (NULL == cache) cache = gale_make_map(0);
+	look = (struct lookup *) gale_map_find(cache,gale_text_as_data(name));
+	if (NULL == look) {
+		sweep();
+		gale_create(look);
+		look->name = look->canon = name;
+		look->addrs = NULL;
+		look->num = 0;
+		look->is_pending = 0;
+		look->expires = gale_time_zero();
+		look->waiting = NULL;
+		link_lookup(look);
+		gale_map_add(cache,gale_text_as_data(name),look);
+		++num_cached;
+	}
+
+	gale_create(res);
+	res->owner = conn;
+	res->lookup = look;
+	res->port = port;
+	res->is_self = is_self;
+	res->next = NULL;
+
+	if (conn->alloc_resolve == conn->num_resolve) {
+		gale_resize_array(conn->resolving,
+			conn->alloc_resolve = conn->alloc_resolve
+			? 2*conn->alloc_resolve : 6);
+	}
+	conn->resolving[conn->num_resolve++] = res;
+	if (is_self) conn->self_pending = 1;
+
+	if (!look->is_pending
+	&&  0 < gale_time_compare(look->expires,gale_time_now())) {
+		gale_dprintf(5,"(connect %p) \"%s\" is cached\n",conn,hostname);
+		deliver(res);
+		return;
+	}
+
+	res->next = look->waiting;
+	look->waiting = res;
+	if (look->is_pending) return;
+
+	look->is_pending = 1;
+	look->canon = name;
+	if (!start_lookup(conn->source,look))
+		finish_lookup(look,NULL,0,0);
 }
 
 /** Start attempting to establish a TCP connection.
@@ -308,6 +790,9 @@ static void last_name(struct gale_connect *conn) {
  *  liboop); the function \a call will be invoked when one of them
  *  succeeds or all of them fail.  If the port is not specified with the
  *  \a serv string, the default Gale port will be used.
+ *  Names are resolved without blocking and the answers cached; the
+ *  addresses found (IPv6 and IPv4) are tried a little apart, and the
+ *  first to connect is used.
  *  \param src Liboop event source to use for connection.
  *  \param serv Comma-separated list of one or more hostnames.
  *  \param avoid_local_port If nonzero, avoid reconnecting to ourselves.
@@ -324,20 +809,30 @@ struct gale_connect *gale_make_connect(
 
 	gale_create(conn);
 	conn->source = src;
-	conn->adns = NULL;
 	conn->avoid_local_port = avoid_local_port;
 	conn->found_local = 0;
+	conn->self = NULL;
+	conn->num_self = conn->self_pending = 0;
 
 	conn->addresses = NULL;
 	conn->alloc_address = conn->num_address = 0;
+	conn->queue[0] = conn->queue[1] = NULL;
+	conn->last_family = AF_UNSPEC;
+	conn->is_staggered = 0;
 
-	ADNS_ONLY(conn->resolving = NULL;)
-	ADNS_ONLY(conn->alloc_resolve = conn->num_resolve = 0;)
-	ADNS_ONLY(conn->all_names = 0);
+	conn->resolving = NULL;
+	conn->alloc_resolve = conn->num_resolve = 0;
+	conn->all_names = 0;
 
 	conn->call = call;
 	conn->data = user;
 
+	/* Find out what we're called, to recognize ourselves. */
+	if (0 != avoid_local_port) {
+		const struct gale_text host = gale_var(G_("HOST"));
+		if (0 != host.l) add_name(conn,host,0,1);
+	}
+
 	while (gale_text_token(serv,',',&spec)) {
 		struct gale_text part = null_text;
 		struct gale_text name;
@@ -351,45 +846,49 @@ struct gale_connect *gale_make_connect(
 		else
 			port = gale_port;
 
-		add_name(conn,name,port);
-		add_name(conn,gale_text_concat(2,G_("gale."),name),port);
-		add_name(conn,gale_text_concat(2,name,G_(".gale.org")),port);
+		add_name(conn,name,port,0);
+		add_name(conn,gale_text_concat(2,G_("gale."),name),port,0);
+		add_name(conn,gale_text_concat(2,name,G_(".gale.org")),port,0);
 	}
 
-	last_name(conn);
+	conn->all_names = 1;
+	check_done(conn);
 	return conn;
 }
 
 static void *on_write(oop_source *src,int fd,oop_event event,void *user) {
-	struct sockaddr *sa;
+	struct gale_connect *conn = (struct gale_connect *) user;
+	struct sockaddr_storage *sa;
 	int i;
 
-	struct gale_connect *conn = (struct gale_connect *) user;
-	for (i = 0; fd != conn->addresses[i]->sock; ++i) 
+	for (i = 0; fd != conn->addresses[i]->sock; ++i)
 		assert(i < conn->num_address);
 
-	sa = (struct sockaddr *) &conn->addresses[i]->sin;
+	sa = &conn->addresses[i]->sa;
 	do errno = 0;
-	while (CONNECT_F(fd,sa,sizeof(struct sockaddr_in))
+	while (!conn->addresses[i]->is_unix
+	   &&  CONNECT_F(fd,(struct sockaddr *) sa,addr_len(sa))
 	   &&  EINTR == errno);
 
 	if (EISCONN != errno && 0 != errno) {
-		gale_dprintf(4,"(connect %p) connection to %s:%d failed: %s\n",
-		             conn, inet_ntoa(conn->addresses[i]->sin.sin_addr),
-		             ntohs(conn->addresses[i]->sin.sin_port),
-		             strerror(errno));
+		gale_dprintf(4,"(connect %p) connection to %s failed: %s\n",
+		             conn,show(sa),strerror(errno));
 		close(fd);
 		del_address(conn,i);
+
+		/* Don't wait to try the next one. */
+		cancel_stagger(conn);
+		start_next(conn);
 	} else {
 		int one = 1;
 #if 0
 		struct linger linger = { 1, 5000 }; /* 5 seconds */
 #endif
 		struct gale_text name = conn->addresses[i]->name;
-		struct sockaddr_in addr = conn->addresses[i]->sin;
+		struct sockaddr_storage addr = *sa;
 
-		gale_dprintf(4,"(connect %p) established connection to %s:%d\n",
-		             conn,inet_ntoa(addr.sin_addr),ntohs(addr.sin_port));
+		gale_dprintf(4,"(connect %p) established connection to %s\n",
+		             conn,show(&addr));
 
 		del_address(conn,i);
 		gale_abort_connect(conn);
@@ -405,85 +904,52 @@ static void *on_write(oop_source *src,int fd,oop_event event,void *user) {
 		setsockopt(fd,SOL_SOCKET,SO_KEEPALIVE,
 		           (SETSOCKOPT_ARG_4_T) &one,sizeof(one));
 
-		return conn->call(fd,name,addr,conn->found_local,conn->data);
+		return conn->call(fd,name,(struct sockaddr *) &addr,
+		                  conn->found_local,conn->data);
 	}
 
 	return OOP_CONTINUE;
 }
 
-#ifdef HAVE_ADNS
-static void *on_lookup(oop_adapter_adns *adns,adns_answer *answer,void *data) {
-	struct resolution *res = (struct resolution *) data;
-	struct gale_connect *conn = res->owner;
-	int i;
-
-	res->query = NULL;
-
-	if (adns_s_ok == answer->status) {
-		struct gale_text name = answer->cname 
-		     ? gale_text_from(NULL,answer->cname,-1) 
-		     : res->name;
-		struct sockaddr_in sin;
-		assert(adns_r_a == answer->type);
-		memset(&sin,0,sizeof(sin));
-		sin.sin_family = AF_INET;
-		sin.sin_port = htons(res->port);
-		for (i = 0; i < answer->nrrs; ++i) {
-			sin.sin_addr = answer->rrs.inaddr[i];
-			add_address(conn,name,sin);
-		}
-	}
-	else {
-		gale_dprintf(5,"(connect %p) no addresses for \"%s\"\n",
-		             conn, gale_text_to(0, res->name));
-	}
-
-	free(answer);
-
-	for (i = 0; res != conn->resolving[i]; ++i) 
-		assert(i < conn->num_resolve);
-	del_name(conn,i);
-
-	if (0 == conn->num_resolve && conn->all_names) 
-		last_address(conn);
-
-	return OOP_CONTINUE;
-}
-#endif
-
 /** Abort a connection attempt.
  *  This function stops attempting to establish a connection and releases
- *  all resources associated with the connection attempt.
+ *  all resources associated with the connection attempt.  (Lookups under
+ *  way carry on, to fill the cache.)
  *  \param conn Connection handle from gale_make_connect().
  *  \sa gale_make_connect() */
 void gale_abort_connect(struct gale_connect *conn) {
-	ADNS_ONLY(while (conn->num_resolve) del_name(conn,0);)
+	conn->all_names = 0; /* so we don't schedule on_abort again */
+	while (conn->num_resolve) del_name(conn,0);
+	conn->queue[0] = conn->queue[1] = NULL;
+	cancel_stagger(conn);
 	while (conn->num_address) {
 		close(conn->addresses[0]->sock);
 		del_address(conn,0);
 	}
-#ifdef HAVE_ADNS
-	if (NULL != conn->adns) {
-		oop_adns_delete(conn->adns);
-		conn->adns = NULL;
-	}
-#endif
 	conn->source->cancel_time(conn->source,OOP_TIME_NOW,on_abort,conn);
 }
 
+/** Find the UNIX-domain socket of a server on this host.
+ *  Servers listen here as well as on TCP, and clients use it instead of
+ *  TCP when the server address is local, provided the socket belongs to
+ *  root, to the owner of the system directory, or to the user.
+ *  \param port The server's TCP port number.
+ *  \return The filename of the socket (GALE_LOCAL_SOCKET, if set).
+ *  \sa gale_make_connect() */
+struct gale_text gale_local_socket(int port) {
+	const struct gale_text path = gale_var(G_("GALE_LOCAL_SOCKET"));
+	if (0 != path.l) return path;
+	return gale_text_concat(2,
+		G_("/tmp/.gale."),gale_text_from_number(port,10,0));
+}
+
 /** Return a description of the connected host.
  *  \param host Hostname (usually as passed to ::gale_make_connect).
- *  \param addr IP address (usually as passed to ::gale_make_connect).
+ *  \param addr Address (usually as passed to ::gale_make_connect).
  *  \return Human-readable text string describing the remote host. */
 struct gale_text gale_connect_text(
 	struct gale_text host,
-	struct sockaddr_in addr) 
+	const struct sockaddr *addr)
 {
-	return gale_text_concat(6,
-		host,
-		G_(" ("),
-		gale_text_from(NULL,inet_ntoa(addr.sin_addr),-1),
-		G_(":"),
-		gale_text_from_number(ntohs(addr.sin_port),10,0),
-		G_(")"));
+	return gale_text_concat(4,host,G_(" ("),addr_text(addr),G_(")"));
 }
@@ -0,0 +1,235 @@
+#include "gale/misc.h"
+#include "gale/globals.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+struct gale_metric {
+	struct gale_text name,labels;
+	int type;
+	double value;
+	gale_metric_call *probe;
+	void *user;
+
+	/* histograms only */
+	int count;
+	double first,sum;
+	unsigned long *buckets,total;
+};
+
+struct output {
+	wch *buffer;
+	size_t len,alloc;
+};
+
+static struct gale_data metric_key(struct gale_text name,struct gale_text labels) {
+	return gale_text_as_data(gale_text_concat(3,name,G_("{"),labels));
+}
+
+static struct gale_metric *make(struct gale_text name,struct gale_text labels,int type) {
+	const struct gale_data key = metric_key(name,labels);
+	struct gale_metric *metric;
+
+	if (NULL == gale_global->metrics)
+		gale_global->metrics = gale_make_map(0);
+
+	metric = (struct gale_metric *) gale_map_find(gale_global->metrics,key);
+	if (NULL != metric) {
+		assert(type == metric->type);
+		return metric;
+	}
+
+	gale_create(metric);
+	metric->name = name;
+	metric->labels = labels;
+	metric->type = type;
+	metric->value = 0;
+	metric->probe = NULL;
+	metric->user = NULL;
+	metric->count = 0;
+	metric->first = metric->sum = 0;
+	metric->buckets = NULL;
+	metric->total = 0;
+	gale_map_add(gale_global->metrics,key,metric);
+	return metric;
+}
+
+/** Find or create a counter or gauge.
+ *  Metrics with the same name and labels are shared.
+ *  \param name Metric name (e.g. "galed_messages_in").
+ *  \param labels Label list without braces (e.g. "conn=\"3\""), or
+ *         ::null_text for none.
+ *  \param type Either ::metric_counter or ::metric_gauge.
+ *  \return The metric handle.
+ *  \sa gale_make_histogram(), gale_metric_remove() */
+struct gale_metric *gale_make_metric(
+	struct gale_text name,struct gale_text labels,int type)
+{
+	assert(metric_counter == type || metric_gauge == type);
+	return make(name,labels,type);
+}
+
+/** Find or create a histogram.
+ *  The buckets are exponential: the first holds values up to \a first,
+ *  and each subsequent bucket doubles the bound.
+ *  \param name Metric name.
+ *  \param labels Label list without braces, or ::null_text for none.
+ *  \param first The upper bound of the first bucket.
+ *  \param count The number of buckets (not counting the overflow).
+ *  \return The metric handle. */
+struct gale_metric *gale_make_histogram(
+	struct gale_text name,struct gale_text labels,
+	double first,int count)
+{
+	struct gale_metric *metric = make(name,labels,metric_histogram);
+	if (NULL == metric->buckets) {
+		metric->first = first;
+		metric->count = count;
+		metric->buckets = gale_malloc_atomic(
+			(count + 1) * sizeof(*metric->buckets));
+		memset(metric->buckets,0,(count + 1) * sizeof(*metric->buckets));
+	}
+	return metric;
+}
+
+/** Remove a metric from the registry.
+ *  \param metric The metric handle to remove. */
+void gale_metric_remove(struct gale_metric *metric) {
+	if (NULL == metric || NULL == gale_global->metrics) return;
+	gale_map_add(gale_global->metrics,
+		metric_key(metric->name,metric->labels),NULL);
+}
+
+/** Add to a counter or gauge.
+ *  \param metric The metric handle.
+ *  \param delta The amount to add (negative only for gauges). */
+void gale_metric_add(struct gale_metric *metric,double delta) {
+	assert(metric_histogram != metric->type);
+	metric->value += delta;
+}
+
+/** Set the value of a gauge.
+ *  \param metric The metric handle.
+ *  \param value The new value. */
+void gale_metric_set(struct gale_metric *metric,double value) {
+	assert(metric_gauge == metric->type);
+	metric->value = value;
+}
+
+/** Compute a gauge only when it is reported.
+ *  \param metric The metric handle.
+ *  \param func Function which returns the current value.
+ *  \param user User-defined parameter to pass the function. */
+void gale_metric_probe(struct gale_metric *metric,
+	gale_metric_call *func,void *user)
+{
+	assert(metric_gauge == metric->type);
+	metric->probe = func;
+	metric->user = user;
+}
+
+/** Record a value in a histogram.
+ *  \param metric The metric handle from gale_make_histogram().
+ *  \param value The observed value. */
+void gale_metric_observe(struct gale_metric *metric,double value) {
+	double bound = metric->first;
+	int i;
+	assert(metric_histogram == metric->type);
+	for (i = 0; i < metric->count && value > bound; ++i) bound *= 2;
+	++(metric->buckets[i]);
+	++(metric->total);
+	metric->sum += value;
+}
+
+static void put(struct output *out,const char *str) {
+	const size_t len = strlen(str);
+	size_t i;
+	if (out->len + len > out->alloc) {
+		wch *buffer;
+		out->alloc = 2 * (out->len + len);
+		buffer = gale_malloc_atomic(out->alloc * sizeof(wch));
+		memcpy(buffer,out->buffer,out->len * sizeof(wch));
+		out->buffer = buffer;
+	}
+
+	for (i = 0; i < len; ++i) out->buffer[out->len++] = (unsigned char) str[i];
+}
+
+static void put_text(struct output *out,struct gale_text text) {
+	put(out,gale_text_to(gale_global->enc_ascii,text));
+}
+
+static void put_sample(struct output *out,
+	struct gale_text name,const char *suffix,
+	struct gale_text labels,const char *extra,double value)
+{
+	char buf[64];
+	put_text(out,name);
+	put(out,suffix);
+	if (0 != labels.l || NULL != extra) {
+		put(out,"{");
+		put_text(out,labels);
+		if (NULL != extra) {
+			if (0 != labels.l) put(out,",");
+			put(out,extra);
+		}
+		put(out,"}");
+	}
+	sprintf(buf," %.15g\n",value);
+	put(out,buf);
+}
+
+/** Generate a snapshot of every registered metric.
+ *  The output uses the line-oriented text exposition format understood by
+ *  common monitoring scrapers ("name{labels} value", with a "# TYPE" line
+ *  before each family).
+ *  \return The formatted metrics. */
+struct gale_text gale_metric_run(void) {
+	static const char * const type_name[] = { "counter", "gauge", "histogram" };
+	struct output out = { NULL, 0, 0 };
+	struct gale_text family = null_text,ret;
+	struct gale_data key = null_data;
+	void *data;
+
+	while (NULL != gale_global->metrics
+	&&     gale_map_walk(gale_global->metrics,&key,&key,&data)) {
+		struct gale_metric * const metric = (struct gale_metric *) data;
+		if (0 == family.l || gale_text_compare(family,metric->name)) {
+			family = metric->name;
+			put(&out,"# TYPE ");
+			put_text(&out,family);
+			put(&out," ");
+			put(&out,type_name[metric->type]);
+			put(&out,"\n");
+		}
+
+		if (metric_histogram != metric->type) {
+			if (NULL != metric->probe)
+				metric->value = metric->probe(metric->user);
+			put_sample(&out,metric->name,"",metric->labels,NULL,
+				metric->value);
+		} else {
+			unsigned long total = 0;
+			double bound = metric->first;
+			char le[64];
+			int i;
+			for (i = 0; i < metric->count; ++i, bound *= 2) {
+				total += metric->buckets[i];
+				sprintf(le,"le=\"%g\"",bound);
+				put_sample(&out,metric->name,"_bucket",
+					metric->labels,le,total);
+			}
+			put_sample(&out,metric->name,"_bucket",
+				metric->labels,"le=\"+Inf\"",metric->total);
+			put_sample(&out,metric->name,"_sum",
+				metric->labels,NULL,metric->sum);
+			put_sample(&out,metric->name,"_count",
+				metric->labels,NULL,metric->total);
+		}
+	}
+
+	ret.p = out.buffer;
+	ret.l = out.len;
+	return ret;
+}
@@ -0,0 +1,577 @@
+#include "gale/misc.h"
+#include "gale/globals.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* A store file looks like this:
+
+     header | sorted records | index | log records
+
+   The header gives the number of sorted records and the offsets of the
+   index and of the log.  The index is an array of u32 offsets to the sorted
+   records, in key order, for binary search.  New records are only ever
+   appended to the log (under an exclusive flock()); when the log gets too
+   long, the file is rewritten under a new inode with the log folded into
+   the sorted part.  Readers just map the file and notice when it changes.
+
+   Only a writer with the exclusive lock may shrink the file (to discard a
+   record left half-written by a crash), so readers stay within the records
+   they have already checked, and look past them only with a shared lock.
+   A file which is not a store is never overwritten. */
+
+static const byte store_magic[] = { 0x47, 0x41, 0x4C, 0x45, 0x00, 0x53 };
+static const byte record_magic[] = { 0x68, 0x13, 0x53, 0x00 };
+
+#define HEADER_SIZE (sizeof(store_magic) + 3 * gale_u32_size())
+
+static const size_t compact_slack = 65536;
+
+struct record {
+	struct gale_data key,value;
+	struct gale_time stamp;
+	int is_live;
+	size_t end;
+};
+
+struct entry { size_t at; };
+
+struct gale_store {
+	struct gale_text name;
+	int mode,fd,is_locked;
+	dev_t device;
+	ino_t inode;
+	byte *map;
+	size_t map_len;
+	u32 count,index,log;
+	size_t valid;
+	struct gale_map *log_map;
+};
+
+static int parse_within(const struct gale_store *s,size_t at,size_t limit,
+                        struct record *rec)
+{
+	struct gale_data d;
+	u32 len,live,key_len,value_len;
+
+	if (at >= limit) return 0;
+	d.p = s->map + at;
+	d.l = limit - at;
+	if (!gale_unpack_compare(&d,record_magic,sizeof(record_magic))
+	||  !gale_unpack_u32(&d,&len) || len > d.l) return 0;
+
+	rec->end = (d.p - s->map) + len;
+	d.l = len;
+	if (!gale_unpack_time(&d,&rec->stamp)
+	||  !gale_unpack_u32(&d,&live)
+	||  !gale_unpack_u32(&d,&key_len) || key_len > d.l) return 0;
+
+	rec->key.p = d.p;
+	rec->key.l = key_len;
+	d.p += key_len;
+	d.l -= key_len;
+
+	if (!gale_unpack_u32(&d,&value_len) || value_len != d.l) return 0;
+	rec->value = d;
+	rec->is_live = live;
+	return 1;
+}
+
+/* Parse a record we already know to be complete. */
+static int parse(const struct gale_store *s,size_t at,struct record *rec) {
+	return parse_within(s,at,s->valid,rec);
+}
+
+static void reset(struct gale_store *s) {
+	s->count = s->index = s->log = 0;
+	s->valid = 0;
+	s->log_map = gale_make_map(0);
+}
+
+static void unmap(struct gale_store *s) {
+	if (NULL != s->map) munmap(s->map,s->map_len);
+	s->map = NULL;
+	s->map_len = 0;
+}
+
+static void close_store(struct gale_store *s) {
+	unmap(s);
+	if (s->fd >= 0) close(s->fd);
+	s->fd = -1;
+	s->is_locked = 0;
+	reset(s);
+}
+
+static void on_destroy(void *obj,void *user) {
+	close_store((struct gale_store *) obj);
+}
+
+static int remap(struct gale_store *s,size_t size) {
+	void *map;
+	unmap(s);
+	if (0 == size) return 1;
+
+	map = mmap(NULL,size,PROT_READ,MAP_SHARED,s->fd,0);
+	if (MAP_FAILED == map) {
+		gale_alert(GALE_WARNING,s->name,errno);
+		return 0;
+	}
+
+	s->map = map;
+	s->map_len = size;
+	return 1;
+}
+
+static int header(struct gale_store *s) {
+	struct gale_data d;
+	d.p = s->map;
+	d.l = s->map_len;
+	if (!gale_unpack_compare(&d,store_magic,sizeof(store_magic))
+	||  !gale_unpack_u32(&d,&s->count)
+	||  !gale_unpack_u32(&d,&s->index)
+	||  !gale_unpack_u32(&d,&s->log)
+	||  s->index < HEADER_SIZE
+	||  s->log < s->index
+	||  (s->log - s->index) / gale_u32_size() != s->count
+	||  s->log > s->map_len) {
+		reset(s);
+		return 0;
+	}
+
+	s->valid = s->log;
+	return 1;
+}
+
+/* Bring our mapping up to date with whatever is on disk now. */
+static void refresh(struct gale_store *s) {
+	struct record rec;
+	struct stat buf;
+
+	if (stat(gale_text_to(gale_global->enc_filesys,s->name),&buf)) {
+		close_store(s);
+		return;
+	}
+
+	if (s->fd < 0 || buf.st_dev != s->device || buf.st_ino != s->inode) {
+		const char *sz = gale_text_to(gale_global->enc_filesys,s->name);
+		close_store(s);
+		do s->fd = open(sz,O_RDWR);
+		while (s->fd < 0 && EINTR == errno);
+		if (s->fd < 0) do s->fd = open(sz,O_RDONLY);
+		while (s->fd < 0 && EINTR == errno);
+		if (s->fd < 0 || fstat(s->fd,&buf)) {
+			close_store(s);
+			return;
+		}
+
+		fcntl(s->fd,F_SETFD,FD_CLOEXEC);
+		s->device = buf.st_dev;
+		s->inode = buf.st_ino;
+	}
+
+	if ((size_t) buf.st_size != s->map_len) {
+		if ((size_t) buf.st_size < s->valid) reset(s);
+		if (!remap(s,buf.st_size)) {
+			reset(s);
+			return;
+		}
+	}
+
+	if (s->map_len <= s->valid) return;
+
+	/* Past what we've checked, the file could be cut short under us. */
+	if (!s->is_locked && flock(s->fd,LOCK_SH | LOCK_NB)) return;
+
+	if (0 != s->valid || header(s))
+		while (parse_within(s,s->valid,s->map_len,&rec)) {
+			struct entry *entry;
+			gale_create(entry);
+			entry->at = s->valid;
+			gale_map_add(s->log_map,gale_data_copy(rec.key),entry);
+			s->valid = rec.end;
+		}
+
+	if (!s->is_locked) flock(s->fd,LOCK_UN);
+}
+
+/* Take an exclusive lock on the current incarnation of the file. */
+static int lock(struct gale_store *s) {
+	int created = 0;
+	for (;;) {
+		dev_t device;
+		ino_t inode;
+
+		refresh(s);
+		if (s->fd < 0 && created) {
+			gale_alert(GALE_WARNING,s->name,errno);
+			return 0;
+		}
+
+		if (s->fd < 0) {
+			const char *sz = gale_text_to(
+				gale_global->enc_filesys,s->name);
+			int fd;
+			do fd = open(sz,O_RDWR | O_CREAT | O_EXCL,s->mode);
+			while (fd < 0 && EINTR == errno);
+			if (fd < 0 && EEXIST != errno) {
+				gale_alert(GALE_WARNING,s->name,errno);
+				return 0;
+			}
+
+			if (fd >= 0) {
+				fchmod(fd,s->mode);
+				close(fd);
+			}
+			created = 1;
+			continue;
+		}
+
+		device = s->device;
+		inode = s->inode;
+		while (flock(s->fd,LOCK_EX))
+			if (EINTR != errno) {
+				gale_alert(GALE_WARNING,s->name,errno);
+				return 0;
+			}
+
+		/* If someone compacted the file, our lock went with it. */
+		s->is_locked = 1;
+		refresh(s);
+		if (s->fd >= 0 && device == s->device && inode == s->inode)
+			return 1;
+	}
+}
+
+static void unlock(struct gale_store *s) {
+	if (s->fd >= 0) flock(s->fd,LOCK_UN);
+	s->is_locked = 0;
+}
+
+/* True if the file is empty, or holds the start of a store header left by
+   an interrupted initialization; anything else isn't ours to overwrite. */
+static int is_blank(const struct gale_store *s) {
+	size_t len = s->map_len;
+	if (len > sizeof(store_magic)) len = sizeof(store_magic);
+	return s->map_len < HEADER_SIZE
+	    && (0 == len || !memcmp(s->map,store_magic,len));
+}
+
+/* Called with the lock held: discard trailing junk and write a header. */
+static int prepare(struct gale_store *s) {
+	if (0 == s->valid) {
+		struct gale_data d;
+		if (!is_blank(s)) {
+			gale_alert(GALE_WARNING,gale_text_concat(3,G_("\""),
+				s->name,G_("\": not a store, leaving it alone")),0);
+			return 0;
+		}
+		gale_alert(GALE_NOTICE,gale_text_concat(3,
+			G_("initializing \""),s->name,G_("\"")),0);
+		d.p = gale_malloc(HEADER_SIZE);
+		d.l = 0;
+		gale_pack_copy(&d,store_magic,sizeof(store_magic));
+		gale_pack_u32(&d,0);
+		gale_pack_u32(&d,HEADER_SIZE);
+		gale_pack_u32(&d,HEADER_SIZE);
+		if (ftruncate(s->fd,0) || lseek(s->fd,0,SEEK_SET)
+		|| !gale_write_to(s->fd,d)) {
+			gale_alert(GALE_WARNING,s->name,errno);
+			return 0;
+		}
+		refresh(s);
+		return 0 != s->valid;
+	}
+
+	if (s->map_len > s->valid) {
+		gale_alert(GALE_WARNING,gale_text_concat(3,
+			G_("\""),s->name,G_("\": discarding incomplete record")),0);
+		if (ftruncate(s->fd,s->valid)) {
+			gale_alert(GALE_WARNING,s->name,errno);
+			return 0;
+		}
+		refresh(s);
+	}
+
+	return 1;
+}
+
+static size_t record_size(struct gale_data key,struct gale_data value) {
+	return gale_copy_size(sizeof(record_magic)) + gale_u32_size()
+	     + gale_time_size() + gale_u32_size()
+	     + gale_u32_size() + gale_copy_size(key.l)
+	     + gale_u32_size() + gale_copy_size(value.l);
+}
+
+static void pack_record(struct gale_data *d,
+	struct gale_data key,struct gale_data value,
+	struct gale_time stamp,int is_live)
+{
+	gale_pack_copy(d,record_magic,sizeof(record_magic));
+	gale_pack_u32(d,record_size(key,value)
+		- sizeof(record_magic) - gale_u32_size());
+	gale_pack_time(d,stamp);
+	gale_pack_u32(d,is_live);
+	gale_pack_u32(d,key.l);
+	gale_pack_copy(d,key.p,key.l);
+	gale_pack_u32(d,value.l);
+	gale_pack_copy(d,value.p,value.l);
+}
+
+static int sorted_at(const struct gale_store *s,u32 i,struct record *rec) {
+	struct gale_data d;
+	u32 at;
+	d.p = s->map + s->index + i * gale_u32_size();
+	d.l = gale_u32_size();
+	return gale_unpack_u32(&d,&at) && parse(s,at,rec);
+}
+
+static int find(struct gale_store *s,struct gale_data key,struct record *rec) {
+	const struct entry *entry = gale_map_find(s->log_map,key);
+	u32 lo = 0,hi = s->count;
+
+	if (NULL != entry) return parse(s,entry->at,rec);
+
+	while (lo < hi) {
+		const u32 mid = lo + (hi - lo) / 2;
+		int x;
+
+		if (!sorted_at(s,mid,rec)) return 0;
+		x = gale_data_compare(key,rec->key);
+		if (x < 0)
+			hi = mid;
+		else if (x > 0)
+			lo = mid + 1;
+		else
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Walk the sorted records and the log together, in key order. */
+struct merge {
+	u32 next;
+	struct gale_data after;
+	int have_sorted,have_log;
+	struct record sorted,log;
+};
+
+static void next_sorted(const struct gale_store *s,struct merge *m) {
+	m->have_sorted = 0;
+	while (!m->have_sorted && m->next < s->count)
+		m->have_sorted = sorted_at(s,m->next++,&m->sorted);
+}
+
+static void next_log(const struct gale_store *s,struct merge *m) {
+	struct entry *entry;
+	m->have_log = 0;
+	while (!m->have_log
+	    && gale_map_walk(s->log_map,&m->after,&m->after,(void **) &entry))
+		m->have_log = parse(s,entry->at,&m->log);
+}
+
+static void start_merge(const struct gale_store *s,struct merge *m) {
+	m->next = 0;
+	m->after = null_data;
+	next_sorted(s,m);
+	next_log(s,m);
+}
+
+static int merge(const struct gale_store *s,struct merge *m,struct record *rec) {
+	do {
+		int x;
+		if (!m->have_sorted && !m->have_log) return 0;
+		if (m->have_sorted && m->have_log)
+			x = gale_data_compare(m->sorted.key,m->log.key);
+		else
+			x = m->have_sorted ? -1 : 1;
+
+		if (x < 0) {
+			*rec = m->sorted;
+			next_sorted(s,m);
+		} else {
+			*rec = m->log;
+			if (0 == x) next_sorted(s,m);
+			next_log(s,m);
+		}
+	} while (!rec->is_live);
+	return 1;
+}
+
+/* Called with the lock held: fold the log into a fresh sorted file. */
+static int compact(struct gale_store *s) {
+	struct gale_data d;
+	struct merge m;
+	struct record rec;
+	const char *sz,*sztemp;
+	size_t size = HEADER_SIZE;
+	u32 i,count = 0,index;
+	int fd;
+
+	start_merge(s,&m);
+	while (merge(s,&m,&rec)) {
+		size += record_size(rec.key,rec.value) + gale_u32_size();
+		++count;
+	}
+
+	d.p = gale_malloc_atomic(size);
+	d.l = 0;
+	index = size - count * gale_u32_size();
+	gale_pack_copy(&d,store_magic,sizeof(store_magic));
+	gale_pack_u32(&d,count);
+	gale_pack_u32(&d,index);
+	gale_pack_u32(&d,size);
+
+	i = 0;
+	start_merge(s,&m);
+	while (merge(s,&m,&rec)) {
+		struct gale_data slot;
+		slot.p = d.p + index + i++ * gale_u32_size();
+		slot.l = 0;
+		gale_pack_u32(&slot,d.l);
+		pack_record(&d,rec.key,rec.value,rec.stamp,1);
+	}
+
+	assert(i == count && d.l == index);
+	d.l = size;
+
+	sz = gale_text_to(gale_global->enc_filesys,s->name);
+	sztemp = gale_text_to(gale_global->enc_filesys,gale_text_concat(3,
+		s->name,G_(".tmp."),gale_text_from_number(getpid(),10,0)));
+
+	do fd = open(sztemp,O_WRONLY | O_CREAT | O_TRUNC,s->mode);
+	while (fd < 0 && EINTR == errno);
+	if (fd < 0) {
+		gale_alert(GALE_WARNING,
+			gale_text_from(gale_global->enc_filesys,sztemp,-1),
+			errno);
+		return 0;
+	}
+
+	if (!gale_write_to(fd,d) || fchmod(fd,s->mode)) {
+		close(fd);
+		unlink(sztemp);
+		return 0;
+	}
+
+	close(fd);
+	if (rename(sztemp,sz)) {
+		gale_alert(GALE_WARNING,s->name,errno);
+		unlink(sztemp);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int append(struct gale_store *s,
+	struct gale_data key,struct gale_data value,
+	struct gale_time stamp,int is_live)
+{
+	struct gale_data d;
+	int ok;
+
+	if (!lock(s)) return 0;
+	if (!prepare(s)) {
+		unlock(s);
+		return 0;
+	}
+
+	d.p = gale_malloc_atomic(record_size(key,value));
+	d.l = 0;
+	pack_record(&d,key,value,stamp,is_live);
+	ok = ((off_t) s->valid == lseek(s->fd,s->valid,SEEK_SET))
+	  && gale_write_to(s->fd,d);
+
+	refresh(s);
+	if (ok && s->valid - s->log > compact_slack) compact(s);
+	unlock(s);
+	return ok;
+}
+
+/** Open a record store.
+ *  A store is a memory-mapped file of timestamped key-value records which
+ *  can be shared (and updated) by many processes at once.  The file is
+ *  created on first write if it doesn't exist.
+ *  \param name Filename of the store.
+ *  \param mode Permissions to use if the file is created.
+ *  \return Store handle.
+ *  \sa gale_store_find(), gale_store_put() */
+struct gale_store *gale_open_store(struct gale_text name,int mode) {
+	struct gale_store *s;
+	gale_create(s);
+	s->name = name;
+	s->mode = mode;
+	s->fd = -1;
+	s->is_locked = 0;
+	s->device = 0;
+	s->inode = 0;
+	s->map = NULL;
+	s->map_len = 0;
+	reset(s);
+	gale_finalizer(s,on_destroy,NULL);
+	return s;
+}
+
+/** Look up a record in a store.
+ *  \param s Store handle from gale_open_store().
+ *  \param key The key to look for.
+ *  \param value If not NULL, receives a copy of the most recent value.
+ *  \param stamp If not NULL, receives the timestamp of that value.
+ *  \return Nonzero iff a (non-erased) record was found. */
+int gale_store_find(struct gale_store *s,struct gale_data key,
+	struct gale_data *value,struct gale_time *stamp)
+{
+	struct record rec;
+	refresh(s);
+	if (!find(s,key,&rec) || !rec.is_live) return 0;
+	if (NULL != value) *value = gale_data_copy(rec.value);
+	if (NULL != stamp) *stamp = rec.stamp;
+	return 1;
+}
+
+/** Add a record to a store, superseding any previous value for the key.
+ *  \param s Store handle from gale_open_store().
+ *  \param key The key to store.
+ *  \param value The data to associate with the key.
+ *  \param stamp Timestamp to record with the value.
+ *  \return Nonzero iff the record was written.
+ *  \sa gale_store_erase() */
+int gale_store_put(struct gale_store *s,struct gale_data key,
+	struct gale_data value,struct gale_time stamp)
+{
+	return append(s,key,value,stamp,1);
+}
+
+/** Remove a record from a store.
+ *  \param s Store handle from gale_open_store().
+ *  \param key The key to remove.
+ *  \param stamp Timestamp of the removal.
+ *  \return Nonzero iff the removal was written. */
+int gale_store_erase(struct gale_store *s,struct gale_data key,
+	struct gale_time stamp)
+{
+	struct record rec;
+	refresh(s);
+	if (!find(s,key,&rec) || !rec.is_live) return 1;
+	return append(s,key,null_data,stamp,0);
+}
+
+/** Rewrite a store, discarding obsolete and erased records.
+ *  This happens automatically as the store grows; you only need to call
+ *  it to reclaim space immediately.
+ *  \param s Store handle from gale_open_store().
+ *  \return Nonzero iff the store was successfully rewritten. */
+int gale_store_compact(struct gale_store *s) {
+	int ok;
+	if (!lock(s)) return 0;
+	ok = prepare(s) && compact(s);
+	unlock(s);
+	return ok;
+}
@@ -48,7 +48,7 @@ static void *on_will_message(struct gale_message *msg,void *x) {
 }
 
 static void *on_connect(struct gale_server *server,
-                 struct gale_text name,struct sockaddr_in addr,
+                 struct gale_text name,const struct sockaddr *addr,
                  void *data) 
 {
 	struct attach *att = (struct attach *) data;
@@ -80,7 +80,8 @@ struct attach *new_attach(
 	oop_source *source,
 	struct gale_text server,
 	filter *func,void *data,
-	struct gale_text in,struct gale_text out) 
+	struct gale_text in,struct gale_text out,
+	int class) 
 {
 	struct gale_link *link = new_link(source);
 	struct attach *att;
@@ -88,7 +89,7 @@ struct attach *new_attach(
 	att->source = source;
 	att->name = server;
 	att->link = link;
-	att->connect = new_connect(source,link,out);
+	att->connect = new_connect(source,link,out,class);
 	att->will = gale_make_queue(source);
 	gale_on_queue(att->will,on_will_message,att);
 	att->in_subs = in;
@@ -108,6 +109,11 @@ void close_attach(struct attach *att) {
 	close_connect(att->connect);
 }
 
+void attach_subscribe(struct attach *att,struct gale_text in) {
+	att->in_subs = in;
+	link_subscribe(att->link,in);
+}
+
 void on_empty_attach(struct attach *att,attach_empty_call *f,void *d) {
 	link_on_empty(att->link,f ? on_empty : NULL,att);
 	att->func = f;
@@ -17,8 +17,10 @@ struct attach *new_attach(
 	oop_source *source,
 	struct gale_text server,
 	filter *func,void *data,
-	struct gale_text in,struct gale_text out);
+	struct gale_text in,struct gale_text out,
+	int class);
 void close_attach(struct attach *);
+void attach_subscribe(struct attach *,struct gale_text in);
 
 typedef void *attach_empty_call(struct attach *,void *);
 void on_empty_attach(struct attach *,attach_empty_call *,void *);
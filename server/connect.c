@@ -2,6 +2,11 @@
 #include "connect.h"
 #include "subscr.h"
 #include "server.h"
+#include "policy.h"
+#include "federate.h"
+#include "spool.h"
+#include "presence.h"
+#include "limit.h"
 
 #include <assert.h>
 #include <syslog.h>
@@ -10,35 +15,208 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
 
 struct connect {
 	oop_source *source;
 	struct gale_link *link;
 	struct gale_text subscr;
 	struct gale_packet *will;
-	struct sockaddr_in peer;
-	struct timeval expire;
+	struct gale_text peer;
+	struct timeval expire,resume;
 	filter *func;
 	void *data;
+	int class,id;
+	int is_peer;    /* another server, which we don't relay between */
+	int expendable; /* queued messages which might be shed */
+	struct limit *limit;
+	struct gale_packet *held; /* over the rate limits, waiting to go in */
+
+	struct gale_metric *msg_in,*msg_out,*bytes_in,*bytes_out,*drops,*limited;
+	struct gale_metric *queue_num,*queue_mem,*queue_wait,*slow;
+	struct gale_text labels;
+	double delay;
+	struct connect *prev,*next;
+	int handoff_fd,handoff_version; /* detached for handoff, or -1 */
 };
 
+static struct connect *connects = NULL; /* all of them, for handoff */
+static int connect_count = 0;
+static struct gale_metric *connections = NULL,*queue_wait = NULL;
+
+static double seconds(struct gale_time t) {
+	struct timeval tv;
+	gale_time_to(&tv,t);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* How far behind the consumer is: the recent average wait, or the age of
+   the oldest message still waiting, whichever is worse (or nothing, once
+   it has caught up). */
+static double delay_probe(void *d) {
+	struct connect *conn = (struct connect *) d;
+	double age;
+	if (0 == link_queue_num(conn->link)) return 0;
+	age = seconds(gale_time_diff(gale_time_now(),
+		link_queue_time(conn->link)));
+	return (age > conn->delay) ? age : conn->delay;
+}
+
+/* Keep the slow-consumer list (a gauge per slow connection) current. */
+static void set_slow(struct connect *conn,int is_slow) {
+	if (is_slow && NULL == conn->slow) {
+		conn->slow = gale_make_metric(G_("galed_slow_consumer_seconds"),
+			conn->labels,metric_gauge);
+		gale_metric_probe(conn->slow,delay_probe,conn);
+		gale_dprintf(2,"[%p] slow consumer\n",conn->link);
+	} else if (!is_slow && NULL != conn->slow) {
+		gale_metric_remove(conn->slow);
+		conn->slow = NULL;
+	}
+}
+
+static void check_slow(struct connect *conn) {
+	set_slow(conn,delay_probe(conn) > SLOW_DELAY);
+}
+
+/* A queued message is gone, one way or another. */
+static void unqueued(struct connect *conn,struct gale_packet *msg) {
+	if (NULL != msg && conn->expendable > 0 && is_expendable(msg,NULL))
+		--conn->expendable;
+}
+
+static void on_dequeue(struct gale_link *l,struct gale_packet *msg,
+                       struct gale_time queued,void *d)
+{
+	struct connect *conn = (struct connect *) d;
+	const double wait = seconds(gale_time_diff(gale_time_now(),queued));
+	unqueued(conn,msg);
+	gale_metric_observe(conn->queue_wait,wait);
+	gale_metric_observe(queue_wait,wait);
+
+	/* Sending the last one queued means the consumer has caught up. */
+	if (link_queue_num(l) <= 1) {
+		conn->delay = 0;
+		set_slow(conn,0);
+	} else {
+		conn->delay += (wait - conn->delay) / 8;
+		check_slow(conn);
+	}
+}
+
+static double packet_size(struct gale_packet *msg) {
+	return msg->routing.l * gale_wch_size() + msg->content.l;
+}
+
+static double queue_num_probe(void *d) {
+	return link_queue_num(((struct connect *) d)->link);
+}
+
+static double queue_mem_probe(void *d) {
+	return link_queue_mem(((struct connect *) d)->link);
+}
+
+static struct gale_metric *metric(struct gale_text name,
+	struct gale_text labels,int type) 
+{
+	return gale_make_metric(
+		gale_text_concat(2,G_("galed_connect_"),name),labels,type);
+}
+
+static void add_metrics(struct connect *conn) {
+	struct gale_text labels;
+	conn->id = ++connect_count;
+	labels = gale_text_concat(3,
+		G_("conn=\""),gale_text_from_number(conn->id,10,0),
+		G_("\""));
+	if (0 != conn->peer.l)
+		labels = gale_text_concat(4,labels,G_(",peer=\""),
+			conn->peer,G_("\""));
+
+	if (NULL == connections)
+		connections = gale_make_metric(
+			G_("galed_connections"),null_text,metric_gauge);
+	if (NULL == queue_wait)
+		queue_wait = gale_make_histogram(
+			G_("galed_queue_wait_seconds"),null_text,0.0001,20);
+	gale_metric_add(connections,1);
+	conn->labels = labels;
+
+	conn->msg_in = metric(G_("messages_in"),labels,metric_counter);
+	conn->msg_out = metric(G_("messages_out"),labels,metric_counter);
+	conn->bytes_in = metric(G_("bytes_in"),labels,metric_counter);
+	conn->bytes_out = metric(G_("bytes_out"),labels,metric_counter);
+	conn->drops = metric(G_("drops"),labels,metric_counter);
+	conn->limited = metric(G_("limited"),labels,metric_counter);
+	conn->queue_num = metric(G_("queue_messages"),labels,metric_gauge);
+	conn->queue_mem = metric(G_("queue_bytes"),labels,metric_gauge);
+	gale_metric_probe(conn->queue_num,queue_num_probe,conn);
+	gale_metric_probe(conn->queue_mem,queue_mem_probe,conn);
+	conn->queue_wait = gale_make_histogram(
+		G_("galed_connect_queue_wait_seconds"),labels,0.0001,20);
+	conn->slow = NULL;
+	conn->delay = 0;
+}
+
+static void remove_metrics(struct connect *conn) {
+	gale_metric_add(connections,-1);
+	gale_metric_remove(conn->msg_in);
+	gale_metric_remove(conn->msg_out);
+	gale_metric_remove(conn->bytes_in);
+	gale_metric_remove(conn->bytes_out);
+	gale_metric_remove(conn->drops);
+	gale_metric_remove(conn->limited);
+	gale_metric_remove(conn->queue_num);
+	gale_metric_remove(conn->queue_mem);
+	gale_metric_remove(conn->queue_wait);
+	gale_metric_remove(conn->slow);
+	conn->slow = NULL;
+}
+
 static struct gale_packet *null_filter(struct gale_packet *msg,void *d) {
 	return msg;
 }
 
+/* The address of the other end, or null_text if it has none. */
+static struct gale_text peer_name(int fd) {
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	char buf[64];
+	const char *name = NULL;
+
+	if (getpeername(fd,(struct sockaddr *) &addr,&len)) return null_text;
+	if (AF_UNIX == addr.ss_family)
+		name = "local";
+	else if (AF_INET == addr.ss_family)
+		name = inet_ntop(AF_INET,
+			&((struct sockaddr_in *) &addr)->sin_addr,
+			buf,sizeof(buf));
+#ifdef AF_INET6
+	else if (AF_INET6 == addr.ss_family) {
+		const struct in6_addr *in6 =
+			&((struct sockaddr_in6 *) &addr)->sin6_addr;
+		if (IN6_IS_ADDR_V4MAPPED(in6))
+			name = inet_ntop(AF_INET,&in6->s6_addr[12],
+				buf,sizeof(buf));
+		else
+			name = inet_ntop(AF_INET6,in6,buf,sizeof(buf));
+	}
+#endif
+
+	return gale_text_from(NULL,name,-1);
+}
+
 static struct gale_text connect_report(void *d) {
 	struct connect *conn = (struct connect *) d;
-	struct sockaddr_in peer;
-	int len = sizeof(peer),fd = link_get_fd(conn->link);
-	if (getpeername(fd,(struct sockaddr *) &peer,&len) 
-	||  AF_INET != peer.sin_family) 
-		return null_text;
+	const struct gale_text peer = peer_name(link_get_fd(conn->link));
+	if (0 == peer.l) return null_text;
 
 	return gale_text_concat(7,
 		G_("["),
 		gale_text_from_number((unsigned int) conn->link,16,8),
 		G_("] connect: peer="),
-		gale_text_from(NULL,inet_ntoa(peer.sin_addr),-1),
+		peer,
 		G_(", push ["),
 		conn->subscr,
 		G_("]\n"));
@@ -51,20 +229,72 @@ static void *on_will(struct gale_link *l,struct gale_packet *will,void *d) {
 	return OOP_CONTINUE;
 }
 
+static void *on_message(struct gale_link *,struct gale_packet *,void *);
+static oop_call_time on_resume;
+
+/* Pass a message on if it's within the rate limits; if not, drop it, or
+   hold it and stop reading until it can go, as the policy says. */
+static void admit(struct connect *conn,struct gale_packet *msg,int is_new) {
+	const struct policy *policy = get_policy(conn->class);
+	const double delay = limit_check(conn->limit,policy,packet_size(msg));
+	struct timeval tv;
+
+	if (delay <= 0) {
+		subscr_transmit(conn->source,msg,conn);
+		return;
+	}
+
+	if (is_new) gale_metric_add(conn->limited,1);
+	if (limit_shed == policy->limit) {
+		gale_dprintf(4,"[%p] over rate limit; message dropped\n",conn);
+		return;
+	}
+
+	gale_dprintf(4,"[%p] over rate limit; waiting %g seconds\n",
+		conn,delay);
+	conn->held = msg;
+	link_on_message(conn->link,NULL,NULL);
+	gettimeofday(&conn->resume,NULL);
+	tv.tv_sec = (long) delay;
+	tv.tv_usec = (long) ((delay - tv.tv_sec) * 1000000.0);
+	timeradd(&conn->resume,&tv,&conn->resume);
+	conn->source->on_time(conn->source,conn->resume,on_resume,conn);
+}
+
+static void *on_resume(oop_source *source,struct timeval when,void *d) {
+	struct connect *conn = (struct connect *) d;
+	struct gale_packet * const msg = conn->held;
+	conn->held = NULL;
+	link_on_message(conn->link,on_message,conn);
+	admit(conn,msg,0);
+	return OOP_CONTINUE;
+}
+
 static void *on_message(struct gale_link *l,struct gale_packet *msg,void *d) {
 	struct connect *conn = (struct connect *) d;
 	assert(l == conn->link);
+	gale_metric_add(conn->msg_in,1);
+	gale_metric_add(conn->bytes_in,packet_size(msg));
 	msg = conn->func(msg,conn->data);
-	if (NULL != msg) subscr_transmit(conn->source,msg,conn);
+	if (NULL != msg) admit(conn,msg,1);
 	return OOP_CONTINUE;
 }
 
 static void *on_subscribe(struct gale_link *l,struct gale_text sub,void *d) {
 	struct connect *conn = (struct connect *) d;
 	assert(l == conn->link);
-	remove_subscr(conn->source,conn->subscr,conn);
+	conn->is_peer = federation_is_peer(sub)
+	             || (class_link == conn->class && federation_is_mesh());
+	change_subscr(conn->source,conn->subscr,sub,conn);
+	if (!conn->is_peer) presence_replay(conn,conn->subscr,sub);
 	conn->subscr = sub;
-	add_subscr(conn->source,conn->subscr,conn);
+	return OOP_CONTINUE;
+}
+
+static void *on_since(struct gale_link *l,struct gale_time when,void *d) {
+	struct connect *conn = (struct connect *) d;
+	assert(l == conn->link);
+	spool_replay(conn,conn->subscr,when);
 	return OOP_CONTINUE;
 }
 
@@ -72,12 +302,10 @@ static void *on_error(struct gale_link *l,int err,void *d) {
 	struct connect *conn = (struct connect *) d;
 	assert(l == conn->link);
 	if (0 != err && ECONNRESET != err && EPIPE != err) {
-		if (AF_INET != conn->peer.sin_family)
+		if (0 == conn->peer.l)
 			gale_alert(GALE_WARNING,G_("I/O error"),err);
 		else
-			gale_alert(GALE_WARNING,
-				gale_text_from(NULL,
-					inet_ntoa(conn->peer.sin_addr),-1),err);
+			gale_alert(GALE_WARNING,conn->peer,err);
 	}
 	close_connect(conn);
 	return OOP_CONTINUE;
@@ -86,70 +314,292 @@ static void *on_error(struct gale_link *l,int err,void *d) {
 struct connect *new_connect(
 	oop_source *source,
 	struct gale_link *link,
-	struct gale_text subscr)
+	struct gale_text subscr,
+	int class)
 {
-	int fd = link_get_fd(link);
 	struct connect *conn;
-	int len = sizeof(conn->peer);
 	gale_create(conn);
 	conn->source = source;
 	conn->link = link;
 	conn->subscr = subscr;
 	conn->will = NULL;
 	conn->func = null_filter;
+	conn->class = class;
+	conn->is_peer = federation_is_peer(subscr)
+	             || (class_link == class && federation_is_mesh());
+	conn->expendable = 0;
 	conn->expire = OOP_TIME_NOW;
+	conn->held = NULL;
 	add_subscr(conn->source,conn->subscr,conn);
 
-	if (getpeername(fd,(struct sockaddr *) &conn->peer,&len) 
-	|| AF_INET != conn->peer.sin_family)
-		memset(&conn->peer,0,sizeof(conn->peer));
+	conn->peer = peer_name(link_get_fd(link));
+	/* Local clients don't have distinct addresses to limit by. */
+	conn->limit = new_limit(class,gale_text_compare(conn->peer,G_("local"))
+		? conn->peer : null_text);
 
+	conn->handoff_fd = -1;
+	conn->prev = NULL;
+	conn->next = connects;
+	if (NULL != connects) connects->prev = conn;
+	connects = conn;
+
+	add_metrics(conn);
 	gale_report_add(gale_global->report,connect_report,conn);
 	link_on_will(conn->link,on_will,conn);
 	link_on_message(conn->link,on_message,conn);
 	link_on_subscribe(conn->link,on_subscribe,conn);
+	link_on_since(conn->link,on_since,conn);
 	link_on_error(conn->link,on_error,conn);
+	link_on_dequeue(conn->link,on_dequeue,conn);
 	return conn;
 }
 
+int connect_is_peer(struct connect *conn) {
+	return conn->is_peer;
+}
+
+/* A number for the connection, unique within this process. */
+int connect_id(struct connect *conn) {
+	return conn->id;
+}
+
 void connect_filter(struct connect *conn,filter *func,void *data) {
 	conn->func = func;
 	conn->data = data;
 }
 
+static int is_over(struct gale_link *link,const struct policy *policy) {
+	return (policy->queue_num > 0 && link_queue_num(link) > policy->queue_num)
+	    || (policy->queue_mem > 0 && link_queue_mem(link) > policy->queue_mem);
+}
+
 static void *on_expire(oop_source *source,struct timeval when,void *v) {
 	struct connect *conn = (struct connect *) v;
+	const struct policy *policy = get_policy(conn->class);
 	struct gale_time now = gale_time_now();
-	struct gale_time cut = gale_time_diff(now,gale_time_seconds(QUEUE_AGE));
-	while ((QUEUE_NUM > 0 && link_queue_num(conn->link) > QUEUE_NUM)
-	   ||  (QUEUE_MEM > 0 && link_queue_mem(conn->link) > QUEUE_MEM))
-		link_queue_drop(conn->link);
-	while (QUEUE_AGE > 0 && link_queue_num(conn->link) > 0
-	   &&  gale_time_compare(link_queue_time(conn->link),cut) < 0)
-		link_queue_drop(conn->link);
+	struct gale_time cut = gale_time_diff(now,
+		gale_time_seconds(policy->queue_age));
+
+	if (conn->expendable > 0 && is_over(conn->link,policy)) {
+		const int dropped = link_queue_shed(conn->link,
+			is_expendable,NULL,
+			policy->queue_num,policy->queue_mem);
+		gale_metric_add(conn->drops,dropped);
+		conn->expendable -= dropped;
+		/* If it's still over, the whole queue was searched (this also
+		   catches a change of policy since the messages were queued). */
+		if (conn->expendable < 0 || is_over(conn->link,policy))
+			conn->expendable = 0;
+	}
+
+	if (is_over(conn->link,policy) && drop_consumer == policy->strategy) {
+		/* The reader can't keep up; make it reconnect and start over. */
+		gale_dprintf(2,"[%p] disconnecting slow consumer\n",conn->link);
+		gale_metric_add(conn->drops,link_queue_num(conn->link));
+		while (link_queue_num(conn->link) > 0)
+			link_queue_drop(conn->link);
+		conn->expendable = 0;
+		if (link_get_fd(conn->link) >= 0)
+			shutdown(link_get_fd(conn->link),SHUT_RDWR);
+	}
+
+	while (is_over(conn->link,policy)) {
+		if (drop_newest == policy->strategy)
+			unqueued(conn,link_queue_drop_newest(conn->link));
+		else
+			unqueued(conn,link_queue_drop(conn->link));
+		gale_metric_add(conn->drops,1);
+	}
+
+	while (policy->queue_age > 0 && link_queue_num(conn->link) > 0
+	   &&  gale_time_compare(link_queue_time(conn->link),cut) < 0) {
+		unqueued(conn,link_queue_drop(conn->link));
+		gale_metric_add(conn->drops,1);
+	}
 	source->cancel_time(source,conn->expire,on_expire,conn);
-	if (QUEUE_AGE > 0 && link_queue_num(conn->link) > 0) {
+	if (policy->queue_age > 0 && link_queue_num(conn->link) > 0) {
 		struct gale_time expire = link_queue_time(conn->link);
-		expire = gale_time_add(expire,gale_time_seconds(QUEUE_AGE));
+		expire = gale_time_add(expire,
+			gale_time_seconds(policy->queue_age));
 		gale_time_to(&conn->expire,expire);
 		source->on_time(source,conn->expire,on_expire,conn);
 	}
 
+	check_slow(conn);
 	return OOP_CONTINUE;
 }
 
-void send_connect(struct connect *conn,struct gale_packet *msg) {
+static int put(struct connect *conn,struct gale_packet *msg,int is_latest) {
+	int replaced = 0;
 	msg = conn->func(msg,conn->data);
-	if (NULL == msg) return;
-	link_put(conn->link,msg);
+	if (NULL == msg) return 0;
+	gale_metric_add(conn->msg_out,1);
+	gale_metric_add(conn->bytes_out,packet_size(msg));
+	if (is_expendable(msg,NULL)) ++conn->expendable;
+	if (is_latest) {
+		/* What it replaces has the same categories. */
+		int i;
+		replaced = link_put_latest(conn->link,msg);
+		for (i = 0; i < replaced; ++i) unqueued(conn,msg);
+	} else
+		link_put(conn->link,msg);
 	on_expire(conn->source,OOP_TIME_NOW,conn);
+	return replaced;
 }
 
-void close_connect(struct connect *conn) {
+void send_connect(struct connect *conn,struct gale_packet *msg) {
+	put(conn,msg,0);
+}
+
+/* Like send_connect(), but the message supersedes any queued one with the
+   same categories; returns how many were replaced. */
+int replace_connect(struct connect *conn,struct gale_packet *msg) {
+	return put(conn,msg,1);
+}
+
+/* Remove a connection from everything (but leave its link alone). */
+static void forget_connect(struct connect *conn) {
+	if (NULL == conn->prev) connects = conn->next;
+	else conn->prev->next = conn->next;
+	if (NULL != conn->next) conn->next->prev = conn->prev;
+	conn->prev = conn->next = NULL;
+
 	gale_report_remove(gale_global->report,connect_report,conn);
+	link_on_dequeue(conn->link,NULL,NULL);
+	remove_metrics(conn);
 	remove_subscr(conn->source,conn->subscr,conn);
 	conn->subscr = G_("-");
-	delete_link(conn->link);
 	conn->source->cancel_time(conn->source,conn->expire,on_expire,conn);
+	if (NULL != conn->held)
+		conn->source->cancel_time(conn->source,conn->resume,on_resume,conn);
+	conn->held = NULL;
+	close_limit(conn->limit);
+}
+
+void close_connect(struct connect *conn) {
+	forget_connect(conn);
+	delete_link(conn->link);
 	if (NULL != conn->will) subscr_transmit(conn->source,conn->will,conn);
 }
+
+static size_t packed_size(struct gale_packet *msg) {
+	return gale_text_size(msg->routing)
+	     + gale_u32_size() + gale_copy_size(msg->content.l);
+}
+
+static void pack_packet(struct gale_data *buf,struct gale_packet *msg) {
+	gale_pack_text(buf,msg->routing);
+	gale_pack_u32(buf,msg->content.l);
+	gale_pack_copy(buf,msg->content.p,msg->content.l);
+}
+
+static int unpack_packet(struct gale_data *buf,struct gale_packet **msg) {
+	u32 len;
+	gale_create(*msg);
+	if (!gale_unpack_text(buf,&(*msg)->routing)
+	||  !gale_unpack_u32(buf,&len) || len > buf->l) return 0;
+	(*msg)->content.l = len;
+	(*msg)->content.p = gale_malloc_atomic(len);
+	return gale_unpack_copy(buf,(*msg)->content.p,len);
+}
+
+/* Handing over happens in two steps.  First, each client connection is
+   detached once it's between messages (but stays subscribed, so its
+   queue collects whatever the others are still sending); then they all
+   go at once. */
+
+/* Detach whichever client connections are ready; return how many aren't. */
+int detach_connects(void) {
+	struct connect *conn;
+	int left = 0;
+	for (conn = connects; NULL != conn; conn = conn->next)
+		if (class_client == conn->class && conn->handoff_fd < 0) {
+			if (NULL == conn->held) conn->handoff_fd =
+				link_detach(conn->link,&conn->handoff_version);
+			if (conn->handoff_fd < 0) ++left;
+		}
+	return left;
+}
+
+/* Describe a detached connection for import_connect(): protocol version,
+   subscription, will (if any) and unsent messages. */
+static struct gale_data export_one(struct connect *conn) {
+	struct gale_packet **queue;
+	struct gale_data state;
+	int num,i;
+	size_t size;
+
+	num = link_queue_num(conn->link);
+	queue = gale_malloc(num * sizeof(*queue) + 1);
+	size = 4 * gale_u32_size() + gale_text_size(conn->subscr);
+	if (NULL != conn->will) size += packed_size(conn->will);
+	for (i = 0; i < num; ++i) {
+		queue[i] = link_queue_get(conn->link);
+		size += packed_size(queue[i]);
+	}
+
+	state.p = gale_malloc_atomic(size);
+	state.l = 0;
+	gale_pack_u32(&state,conn->handoff_version);
+	gale_pack_text(&state,conn->subscr);
+	gale_pack_u32(&state,NULL != conn->will);
+	if (NULL != conn->will) pack_packet(&state,conn->will);
+	gale_pack_u32(&state,num);
+	for (i = 0; i < num; ++i) pack_packet(&state,queue[i]);
+	gale_free(queue);
+
+	gale_dprintf(2,"[%p] handing over, %d messages queued\n",conn,num);
+	return state;
+}
+
+/* Pass every detached connection to a function, with its descriptor and
+   state, and forget it. */
+void export_connects(void (*send)(int fd,struct gale_data state,void *),
+                     void *user)
+{
+	struct connect *conn = connects;
+	while (NULL != conn) {
+		struct connect * const next = conn->next;
+		if (conn->handoff_fd >= 0) {
+			const struct gale_data state = export_one(conn);
+			const int fd = conn->handoff_fd;
+			conn->handoff_fd = -1;
+			forget_connect(conn);
+			delete_link(conn->link);
+			send(fd,state,user);
+		}
+		conn = next;
+	}
+}
+
+/* Carry on with a client connection from another process. */
+struct connect *import_connect(oop_source *source,int fd,struct gale_data state) {
+	struct gale_packet *will = NULL,*msg;
+	struct gale_text subscr;
+	struct gale_link *link;
+	struct connect *conn;
+	u32 version,has_will,num;
+
+	if (!gale_unpack_u32(&state,&version)
+	||  !gale_unpack_text(&state,&subscr)
+	||  !gale_unpack_u32(&state,&has_will)
+	||  (has_will && !unpack_packet(&state,&will))
+	||  !gale_unpack_u32(&state,&num)) {
+		gale_alert(GALE_WARNING,G_("bad connection state"),0);
+		close(fd);
+		return NULL;
+	}
+
+	link = new_link(source);
+	link_adopt(link,fd,version);
+	conn = new_connect(source,link,subscr,class_client);
+	conn->will = will;
+	while (num-- > 0 && unpack_packet(&state,&msg)) {
+		if (is_expendable(msg,NULL)) ++conn->expendable;
+		link_put(link,msg);
+	}
+
+	/* Apply this server's limits to the queue we inherited. */
+	on_expire(source,OOP_TIME_NOW,conn);
+	return conn;
+}
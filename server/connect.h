@@ -7,9 +7,16 @@
 
 typedef struct gale_packet *filter(struct gale_packet *,void *);
 
-struct connect *new_connect(oop_source *,struct gale_link *,struct gale_text);
+struct connect *new_connect(oop_source *,struct gale_link *,struct gale_text,int class);
 void connect_filter(struct connect *,filter *,void *);
 void send_connect(struct connect *,struct gale_packet *);
+int replace_connect(struct connect *,struct gale_packet *);
 void close_connect(struct connect *);
+int connect_is_peer(struct connect *);
+int connect_id(struct connect *);
+
+int detach_connects(void);
+void export_connects(void (*)(int fd,struct gale_data state,void *),void *);
+struct connect *import_connect(oop_source *,int fd,struct gale_data state);
 
 #endif
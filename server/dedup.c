@@ -0,0 +1,109 @@
+#include "dedup.h"
+#include "server.h"
+#include "policy.h"
+
+#include "gale/all.h"
+
+#include <string.h>
+
+/* Messages are identified by (a hash of) their content, since routing is
+   rewritten along the way.  Recent ids live in two generations of open
+   hash table: new ids go in the current one, lookups check both, and
+   every half window (or when the current one fills) the older is cleared
+   and becomes current.  So an id is remembered for between half and all
+   of the window, and nothing ever has to be deleted. */
+
+struct id { u32 a,b; };
+
+struct generation {
+	struct id *slot;
+	int num;
+	struct gale_time start;
+};
+
+static struct generation gen[2];
+static int current = 0;
+static int hits = 0,checks = 0;
+static struct gale_metric *duplicates = NULL;
+
+#define SLOTS (2 * DEDUP_SIZE) /* a power of two, at most half full */
+
+static struct gale_text dedup_report(void *d) {
+	return gale_text_concat(9,
+		G_("dedup: window="),
+		gale_text_from_number(dedup_window(),10,0),
+		G_("s, recent="),
+		gale_text_from_number(gen[0].num + gen[1].num,10,0),
+		G_(", checked="),
+		gale_text_from_number(checks,10,0),
+		G_(", duplicates="),
+		gale_text_from_number(hits,10,0),
+		G_("\n"));
+}
+
+static struct id message_id(struct gale_packet *msg) {
+	const struct gale_data hash = gale_crypto_hash(msg->content);
+	struct id id;
+	memcpy(&id,hash.p,sizeof(id));
+	if (0 == id.a && 0 == id.b) id.b = 1; /* zero marks an empty slot */
+	return id;
+}
+
+/* Find an id's slot in a generation (empty if it isn't there). */
+static struct id *probe(struct generation *g,struct id id) {
+	u32 i = id.a & (SLOTS - 1);
+	while ((0 != g->slot[i].a || 0 != g->slot[i].b)
+	&&     (g->slot[i].a != id.a || g->slot[i].b != id.b))
+		i = (i + 1) & (SLOTS - 1);
+	return &g->slot[i];
+}
+
+static void rotate(struct gale_time now) {
+	current = !current;
+	memset(gen[current].slot,0,SLOTS * sizeof(struct id));
+	gen[current].num = 0;
+	gen[current].start = now;
+}
+
+/* True if a message was seen within the last dedup_window() seconds
+   (and remember it if not). */
+int is_duplicate(struct gale_packet *msg) {
+	const int window = dedup_window();
+	struct gale_time now;
+	struct id id,*slot;
+
+	if (window <= 0) return 0;
+	if (NULL == duplicates) {
+		int i;
+		for (i = 0; i < 2; ++i) {
+			gen[i].slot = gale_malloc_atomic(SLOTS * sizeof(struct id));
+			memset(gen[i].slot,0,SLOTS * sizeof(struct id));
+			gen[i].num = 0;
+			gen[i].start = gale_time_now();
+		}
+		duplicates = gale_make_metric(
+			G_("galed_duplicates"),null_text,metric_counter);
+		gale_report_add(gale_global->report,dedup_report,NULL);
+	}
+
+	now = gale_time_now();
+	if (gen[current].num >= DEDUP_SIZE || 0 <= gale_time_compare(
+		gale_time_diff(now,gen[current].start),
+		gale_time_seconds((window + 1) / 2)))
+		rotate(now);
+
+	++checks;
+	id = message_id(msg);
+	slot = probe(&gen[!current],id);
+	if (0 == slot->a && 0 == slot->b) slot = probe(&gen[current],id);
+	if (0 != slot->a || 0 != slot->b) {
+		gale_dprintf(4,"*** duplicate message dropped\n");
+		gale_metric_add(duplicates,1);
+		++hits;
+		return 1;
+	}
+
+	*slot = id;
+	++gen[current].num;
+	return 0;
+}
@@ -0,0 +1,8 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "gale/core.h"
+
+int is_duplicate(struct gale_packet *);
+
+#endif
@@ -2,6 +2,7 @@
 #include "attach.h"
 #include "subscr.h"
 #include "server.h"
+#include "policy.h"
 
 #include "gale/misc.h"
 #include "gale/globals.h"
@@ -9,6 +10,17 @@
 #include "oop.h"
 
 #include <assert.h>
+#include <sys/time.h>
+
+/* A link to each host that local clients subscribe to or send to
+   directly is held open while it's in use, and for a while after.  The
+   while grows with the host's recent traffic (counted in messages, and
+   halving every directed_timeout seconds), so hosts we talk to often
+   stay linked through quiet spells; and the links to the directed_keep
+   busiest hosts are held open however quiet they get.  A host's traffic
+   is remembered after its link closes, until it has decayed away. */
+
+#define FORGET 0.01 /* traffic below which a closed host is forgotten */
 
 struct directed {
 	struct gale_text host;
@@ -16,9 +28,13 @@ struct directed {
 	int is_old,is_empty;
 	struct attach *attach;
 	struct timeval timeout;
+	double traffic;
+	struct gale_time when; /* traffic was last brought up to date */
 };
 
+static oop_source *source = NULL;
 static struct gale_map *dirs = NULL;
+static struct gale_metric *dir_count = NULL,*dir_cold,*dir_warm;
 
 static struct directed *get_dir(struct gale_text host) {
 	struct directed *dir;
@@ -33,19 +49,104 @@ static struct directed *get_dir(struct gale_text host) {
 		dir->is_old = 0;
 		dir->is_empty = 0;
 		dir->attach = NULL;
+		dir->traffic = 0;
+		dir->when = gale_time_now();
 		gale_map_add(dirs,gale_text_as_data(host),dir);
+		if (NULL == dir_count) {
+			dir_count = gale_make_metric(
+				G_("galed_directed_links"),null_text,
+				metric_gauge);
+			dir_cold = gale_make_metric(
+				G_("galed_directed_cold_starts"),null_text,
+				metric_counter);
+			dir_warm = gale_make_metric(
+				G_("galed_directed_warm_sends"),null_text,
+				metric_counter);
+		}
 	}
 	return dir;
 }
 
+/* Decay a host's traffic to the present. */
+static double traffic(struct directed *dir,struct gale_time now) {
+	struct timeval tv;
+	double elapsed;
+	const int half = directed_timeout();
+	int steps = 0;
+
+	gale_time_to(&tv,gale_time_diff(now,dir->when));
+	elapsed = tv.tv_sec + tv.tv_usec / 1000000.0;
+	dir->when = now;
+	if (elapsed <= 0 || half <= 0) return dir->traffic;
+
+	while (elapsed >= half && dir->traffic > 0) {
+		dir->traffic = (++steps < 64) ? dir->traffic / 2 : 0;
+		elapsed -= half;
+	}
+
+	/* Close enough to 2^-x for the rest of a half-life. */
+	dir->traffic *= 1 - elapsed / half / 2;
+	return dir->traffic;
+}
+
+/* Seconds to hold a link open after it was last used. */
+static int hold(struct directed *dir) {
+	const double busy = traffic(dir,gale_time_now());
+	if (busy >= DIRECTED_HOLD - 1) return directed_timeout() * DIRECTED_HOLD;
+	return directed_timeout() * (1 + busy);
+}
+
+/* True if a host is one of the busiest, whose links are held open. */
+static int is_kept(struct directed *dir) {
+	const struct gale_time now = gale_time_now();
+	const double busy = traffic(dir,now);
+	struct gale_data key = null_data;
+	int busier = 0;
+	void *data;
+
+	if (busy <= 0) return 0;
+	while (gale_map_walk(dirs,&key,&key,&data))
+		if (traffic((struct directed *) data,now) > busy) ++busier;
+	return busier < directed_keep();
+}
+
+/* Forget closed hosts whose traffic has died away. */
+static void forget(void) {
+	const struct gale_time now = gale_time_now();
+	struct gale_data key = null_data;
+	void *data;
+
+	while (gale_map_walk(dirs,&key,&key,&data)) {
+		struct directed *dir = (struct directed *) data;
+		if (NULL == dir->attach && 0 == dir->ref && !dir->is_busy
+		&&  traffic(dir,now) < FORGET)
+			gale_map_add(dirs,key,NULL);
+	}
+}
+
+static void *on_timeout(oop_source *,struct timeval,void *);
+
+static void wait_timeout(oop_source *src,struct directed *dir) {
+	gettimeofday(&dir->timeout,NULL);
+	dir->timeout.tv_sec += hold(dir);
+	src->on_time(src,dir->timeout,on_timeout,dir);
+}
+
 static void check_done(struct directed *dir) {
 	if (!dir->is_busy && dir->is_old && dir->is_empty) {
+		if (is_kept(dir)) {
+			dir->is_old = 0;
+			wait_timeout(source,dir);
+			return;
+		}
+
 		dir->is_busy = 1;
 		close_attach(dir->attach);
 		dir->attach = NULL;
 		assert(0 == dir->ref);
-		gale_map_add(dirs,gale_text_as_data(dir->host),NULL);
+		gale_metric_add(dir_count,-1);
 		dir->is_busy = 0;
+		forget();
 	}
 }
 
@@ -101,20 +202,21 @@ static struct gale_packet *cat_filter(struct gale_packet *msg,void *d) {
 static void activate(oop_source *src,struct directed *dir) {
 	if (dir->is_busy) return;
 	dir->is_busy = 1;
+	source = src;
 
 	if (NULL == dir->attach) {
 		struct gale_text cat = gale_text_concat(3,
 			G_("@"),dir->host,G_("/"));
-		dir->attach = new_attach(src,dir->host,cat_filter,dir,cat,cat);
+		dir->attach = new_attach(src,dir->host,cat_filter,dir,cat,cat,
+			class_directed);
+		gale_metric_add(dir_count,1);
 	}
 
 	src->cancel_time(src,dir->timeout,on_timeout,dir);
 	on_empty_attach(dir->attach,NULL,NULL);
 
 	if (dir->ref <= 1) {
-		gettimeofday(&dir->timeout,NULL);
-		dir->timeout.tv_sec += DIRECTED_TIMEOUT;
-		src->on_time(src,dir->timeout,on_timeout,dir);
+		wait_timeout(src,dir);
 		on_empty_attach(dir->attach,on_empty,dir);
 	}
 
@@ -157,5 +259,28 @@ void unsub_directed(oop_source *src,struct gale_text host) {
 
 void send_directed(oop_source *src,struct gale_text host) {
 	struct directed * const dir = get_dir(host);
+	gale_metric_add((NULL == dir->attach) ? dir_cold : dir_warm,1);
+	dir->traffic = traffic(dir,gale_time_now()) + 1;
 	activate(src,dir);
 }
+
+/* Link to a host ahead of any traffic, as if it had just been used. */
+void warm_directed(oop_source *src,struct gale_text host) {
+	struct directed * const dir = get_dir(host);
+	activate(src,dir);
+}
+
+/* The hosts local clients subscribe to, separated by colons. */
+struct gale_text directed_hosts(void) {
+	struct gale_data key = null_data;
+	struct gale_text result = null_text;
+	void *data;
+
+	while (NULL != dirs && gale_map_walk(dirs,&key,&key,&data)) {
+		const struct directed *dir = (const struct directed *) data;
+		if (dir->ref > 0) result = gale_text_concat(3,
+			result,(0 == result.l) ? null_text : G_(":"),dir->host);
+	}
+
+	return result;
+}
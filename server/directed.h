@@ -9,5 +9,7 @@ int is_directed(struct gale_text cat,int *flag,
 void sub_directed(oop_source *,struct gale_text host);
 void unsub_directed(oop_source *,struct gale_text host);
 void send_directed(oop_source *,struct gale_text host);
+void warm_directed(oop_source *,struct gale_text host);
+struct gale_text directed_hosts(void);
 
 #endif
@@ -0,0 +1,168 @@
+#include "federate.h"
+#include "attach.h"
+#include "subscr.h"
+#include "server.h"
+#include "directed.h"
+#include "policy.h"
+
+#include "gale/all.h"
+
+#include <sys/time.h>
+
+/* Links to peer servers (GALE_LINKS).  By default each link asks the peer
+   for GALE_LINKS_INCOMING and pushes GALE_LINKS_OUTGOING (both "+"), as a
+   single link always did.
+
+   In a full mesh (GALE_LINKS_MESH set, and every server linked to every
+   other), unless GALE_LINKS_INCOMING says otherwise, each peer is asked
+   only for what local clients want, and nothing is pushed unless
+   GALE_LINKS_OUTGOING says so, since the peer asks us in turn; every
+   request is marked so the peer knows it came from a server.  Nothing
+   received from one peer is passed on to another, so every message
+   crosses each link once and cannot loop; messages which reach us twice
+   anyway (pushed by a peer and pulled from it) are dropped as duplicates
+   (see dedup.c).  Without a full mesh, this would cut servers off from
+   one another (a leaf linked to a hub which doesn't link back, or spokes
+   relayed through a hub). */
+
+#define PEER_MARK G_("-_gale/peer")
+
+struct peer {
+	struct attach *attach;
+	struct peer *next;
+};
+
+static struct peer *peers = NULL;
+static int is_static = 0,is_pending = 0,is_mesh = 0;
+static struct gale_text interest,expected;
+
+static struct gale_packet *link_filter(struct gale_packet *msg,void *x) {
+	struct gale_packet *rewrite;
+	struct gale_text cat = null_text;
+	int do_transmit = 0;
+
+	gale_create(rewrite);
+	rewrite->routing = null_text;
+	rewrite->content = msg->content;
+	while (gale_text_token(msg->routing,':',&cat)) {
+		struct gale_text base;
+		int orig_flag;
+		int flag = !is_directed(cat,&orig_flag,&base,NULL) && orig_flag;
+		base = category_escape(base,flag);
+		do_transmit |= flag;
+		rewrite->routing =
+			gale_text_concat(3,rewrite->routing,G_(":"),base);
+	}
+
+	if (!do_transmit) {
+		gale_dprintf(5,"*** no positive categories; message dropped\n");
+		return NULL;
+	}
+
+	/* strip leading colon */
+	if (rewrite->routing.l > 0)
+		rewrite->routing = gale_text_right(rewrite->routing,-1);
+
+	gale_dprintf(5,"*** rewrote categories to \"%s\"\n",
+		gale_text_to(gale_global->enc_console,rewrite->routing));
+	return rewrite;
+}
+
+static struct gale_text pull(void) {
+	if (0 == interest.l) return PEER_MARK;
+	return gale_text_concat(3,interest,G_(":"),PEER_MARK);
+}
+
+/* What local clients want, and what we expect them to want again soon. */
+static struct gale_text wanted(void) {
+	const struct gale_text now = subscr_interest();
+	if (0 == expected.l) return now;
+	if (0 == now.l) return expected;
+	return gale_text_concat(3,now,G_(":"),expected);
+}
+
+static void *on_update(oop_source *source,struct timeval when,void *x) {
+	struct gale_text now = wanted();
+	struct peer *peer;
+
+	is_pending = 0;
+	if (!gale_text_compare(now,interest)) return OOP_CONTINUE;
+
+	interest = now;
+	gale_dprintf(2,"--- asking peers for \"%s\"\n",
+		gale_text_to(gale_global->enc_console,interest));
+	for (peer = peers; NULL != peer; peer = peer->next)
+		attach_subscribe(peer->attach,pull());
+	return OOP_CONTINUE;
+}
+
+/* Local subscriptions have changed; tell the peers (in a little while,
+   since subscriptions tend to change in bursts). */
+void federation_changed(oop_source *source) {
+	struct timeval when;
+	if (NULL == peers || is_static || is_pending) return;
+	is_pending = 1;
+	gettimeofday(&when,NULL);
+	when.tv_sec += FEDERATION_DELAY;
+	source->on_time(source,when,on_update,NULL);
+}
+
+static void *on_expect(oop_source *source,struct timeval when,void *x) {
+	expected = null_text;
+	federation_changed(source);
+	return OOP_CONTINUE;
+}
+
+/* Keep asking peers for what clients wanted before a restart, until they
+   have had time to reconnect and ask for it themselves. */
+void federation_expect(oop_source *source,struct gale_text what) {
+	struct timeval when;
+	if (NULL == peers || is_static || 0 == what.l) return;
+	expected = what;
+	gettimeofday(&when,NULL);
+	when.tv_sec += directed_timeout();
+	source->on_time(source,when,on_expect,NULL);
+	on_update(source,OOP_TIME_NOW,NULL);
+}
+
+/* True if links to peers are part of a full mesh. */
+int federation_is_mesh(void) {
+	return is_mesh;
+}
+
+/* True if a subscription is a peer server's request. */
+int federation_is_peer(struct gale_text subscr) {
+	struct gale_text cat = null_text;
+	while (gale_text_token(subscr,':',&cat))
+		if (!gale_text_compare(cat,PEER_MARK)) return 1;
+	return 0;
+}
+
+/* Connect to every server in GALE_LINKS. */
+void init_federation(oop_source *source) {
+	struct gale_text str,link = null_text,in,out;
+
+	str = gale_var(G_("GALE_LINKS")); if (!str.l) return;
+	in = gale_var(G_("GALE_LINKS_INCOMING"));
+	out = gale_var(G_("GALE_LINKS_OUTGOING"));
+	is_mesh = (0 != gale_var(G_("GALE_LINKS_MESH")).l);
+	is_static = !is_mesh || 0 != in.l;
+	if (!out.l) out = is_static ? G_("+") : G_("-");
+	if (!in.l) in = G_("+");
+
+	if (is_static && is_mesh)
+		in = gale_text_concat(3,in,G_(":"),PEER_MARK);
+	else if (!is_static) {
+		interest = subscr_interest();
+		in = pull();
+	}
+
+	while (gale_text_token(str,';',&link)) if (0 != link.l) {
+		struct peer *peer;
+		gale_create(peer);
+		peer->attach = new_attach(source,link,link_filter,NULL,
+		                          in,out,class_link);
+		peer->next = peers;
+		peers = peer;
+	}
+}
@@ -0,0 +1,14 @@
+#ifndef FEDERATE_H
+#define FEDERATE_H
+
+#include "gale/core.h"
+
+#include "oop.h"
+
+void init_federation(oop_source *);
+void federation_changed(oop_source *);
+void federation_expect(oop_source *,struct gale_text interest);
+int federation_is_mesh(void);
+int federation_is_peer(struct gale_text subscr);
+
+#endif
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE 1 /* for accept4() */
+
 #include <time.h>
 #include <errno.h>
 #include <stdio.h>
@@ -9,7 +11,10 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/utsname.h>
 #include <limits.h> /* NetBSD (at least) requires this order. */
@@ -21,6 +26,12 @@
 #include "subscr.h"
 #include "server.h"
 #include "directed.h"
+#include "metrics.h"
+#include "policy.h"
+#include "federate.h"
+#include "spool.h"
+#include "handoff.h"
+#include "snapshot.h"
 
 #include "oop.h"
 
@@ -36,121 +47,207 @@ static void *on_error_queue(struct gale_message *msg,void *x) {
 	return OOP_CONTINUE;
 }
 
-static void *on_incoming(oop_source *source,int fd,oop_event ev,void *user) {
-	struct sockaddr_in sin;
-	struct gale_link *link;
-
-	socklen_t len = sizeof(sin);
+static void tune_socket(int fd) {
 	int one = 1;
-	int newfd = accept(fd,(struct sockaddr *) &sin,&len);
-	if (newfd < 0) {
-		if (errno != ECONNRESET)
-			gale_alert(GALE_WARNING,G_("accept"),errno);
-		return OOP_CONTINUE;
-	}
-	gale_dprintf(2,"[%d] new connection from %s\n",
-	             newfd,inet_ntoa(sin.sin_addr));
-	fcntl(newfd,F_SETFL,O_NONBLOCK);
-	setsockopt(newfd,SOL_SOCKET,SO_KEEPALIVE,
+	setsockopt(fd,SOL_SOCKET,SO_KEEPALIVE,
 	           (SETSOCKOPT_ARG_4_T) &one,sizeof(one));
-
-	link = new_link(source);
-	link_set_fd(link,newfd);
-	new_connect(source,link,G_("-"));
-
-	return OOP_CONTINUE;
+	setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,
+	           (SETSOCKOPT_ARG_4_T) &one,sizeof(one));
+#if defined(TCP_KEEPIDLE) && defined(TCP_KEEPINTVL) && defined(TCP_KEEPCNT)
+	{
+		int idle = KEEPALIVE_IDLE;
+		int interval = KEEPALIVE_INTERVAL;
+		int count = KEEPALIVE_COUNT;
+		setsockopt(fd,IPPROTO_TCP,TCP_KEEPIDLE,
+		           (SETSOCKOPT_ARG_4_T) &idle,sizeof(idle));
+		setsockopt(fd,IPPROTO_TCP,TCP_KEEPINTVL,
+		           (SETSOCKOPT_ARG_4_T) &interval,sizeof(interval));
+		setsockopt(fd,IPPROTO_TCP,TCP_KEEPCNT,
+		           (SETSOCKOPT_ARG_4_T) &count,sizeof(count));
+	}
+#endif
 }
 
-static struct gale_packet *link_filter(struct gale_packet *msg,void *x) {
-	struct gale_packet *rewrite;
-	struct gale_text cat = null_text;
-	int do_transmit = 0;
-
-	gale_create(rewrite);
-	rewrite->routing = null_text;
-	rewrite->content = msg->content;
-	while (gale_text_token(msg->routing,':',&cat)) {
-		struct gale_text base;
-		int orig_flag;
-		int flag = !is_directed(cat,&orig_flag,&base,NULL) && orig_flag;
-		base = category_escape(base,flag);
-		do_transmit |= flag;
-		rewrite->routing = 
-			gale_text_concat(3,rewrite->routing,G_(":"),base);
+static int accept_one(int fd) {
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+#ifdef HAVE_ACCEPT4
+	return accept4(fd,(struct sockaddr *) &addr,&len,
+	               SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+	int newfd = accept(fd,(struct sockaddr *) &addr,&len);
+	if (newfd >= 0) {
+		fcntl(newfd,F_SETFL,O_NONBLOCK);
+		fcntl(newfd,F_SETFD,1);
 	}
+	return newfd;
+#endif
+}
 
-	if (!do_transmit) {
-		gale_dprintf(5,"*** no positive categories; message dropped\n");
-		return NULL;
+/* Accept everything that's waiting (up to a limit, to be fair to
+   existing connections), since clients tend to arrive in bursts. */
+static void accept_all(oop_source *source,int fd,int is_tcp) {
+	int count;
+	for (count = 0; count < ACCEPT_BATCH; ++count) {
+		struct gale_link *link;
+		int newfd = accept_one(fd);
+		if (newfd < 0) {
+			if (EINTR == errno || ECONNABORTED == errno) continue;
+			if (EAGAIN != errno && EWOULDBLOCK != errno
+			&&  ECONNRESET != errno)
+				gale_alert(GALE_WARNING,G_("accept"),errno);
+			break;
+		}
+
+		gale_dprintf(2,"[%d] new %s connection\n",
+		             newfd,is_tcp ? "tcp" : "local");
+		if (is_tcp) tune_socket(newfd);
+
+		link = new_link(source);
+		link_set_fd(link,newfd);
+		new_connect(source,link,G_("-"),class_client);
 	}
-
-	/* strip leading colon */
-	if (rewrite->routing.l > 0)
-		rewrite->routing = gale_text_right(rewrite->routing,-1);
-
-	gale_dprintf(5,"*** rewrote categories to \"%s\"\n",
-		gale_text_to(gale_global->enc_console,rewrite->routing));
-	return rewrite;
 }
 
-static void add_links(oop_source *source) {
-	struct gale_text str,link = null_text,in,out;
-
-	str = gale_var(G_("GALE_LINKS")); if (!str.l) return;
-	gale_text_token(str,';',&link);
-
-	in = gale_var(G_("GALE_LINKS_INCOMING"));
-	out = gale_var(G_("GALE_LINKS_OUTGOING"));
-
-	if (!in.l) in = G_("+");
-	if (!out.l) out = G_("+");
+static void *on_incoming(oop_source *source,int fd,oop_event ev,void *user) {
+	accept_all(source,fd,1);
+	return OOP_CONTINUE;
+}
 
-	(void) new_attach(source,link,link_filter,NULL,in,out);
+static void *on_local(oop_source *source,int fd,oop_event ev,void *user) {
+	accept_all(source,fd,0);
+	return OOP_CONTINUE;
+}
 
-	if (gale_text_token(str,';',&link))
-		gale_alert(GALE_WARNING,G_("extra GALE_LINKS ignored"),0);
+static struct gale_text metrics_path(void) {
+	struct gale_text path = gale_var(G_("GALE_METRICS_SOCKET"));
+	if (0 != path.l) return path;
+	return dir_file(gale_global->dot_gale,gale_text_concat(2,
+		G_("galed-metrics."),
+		gale_text_from_number(server_port,10,0)));
 }
 
 static void usage(void) {
 	fprintf(stderr,
 	"%s\n"
-	"usage: galed [-h] [-p port]\n"
+	"usage: galed [-hr] [-p port]\n"
 	"flags: -h       Display this message\n"
 	"       -p       Set the port to listen on (default %d)\n"
+	"       -r       Take over from a running galed without dropping clients\n"
 	,GALE_BANNER,server_port);
 	exit(1);
 }
 
-static void make_listener(oop_source *source,int port) {
-	struct sockaddr_in sin;
-	int one = 1,sock = socket(AF_INET,SOCK_STREAM,IPPROTO_TCP);
-	if (sock < 0) {
-		gale_alert(GALE_ERROR,G_("socket"),errno);
-		return;
-	}
+static int listen_backlog(void) {
+	const int backlog = gale_text_to_number(gale_var(G_("GALE_BACKLOG")));
+	return (backlog > 0) ? backlog : LISTEN_BACKLOG;
+}
+
+static int bind_socket(int family,int port) {
+	int one = 1,sock = socket(family,SOCK_STREAM,IPPROTO_TCP);
+	if (sock < 0) return -1;
+
 	fcntl(sock,F_SETFD,1);
-	sin.sin_family = AF_INET;
-	sin.sin_addr.s_addr = INADDR_ANY;
-	sin.sin_port = htons(port);
+	fcntl(sock,F_SETFL,O_NONBLOCK);
 	if (setsockopt(sock,SOL_SOCKET,SO_REUSEADDR,
 	               (SETSOCKOPT_ARG_4_T) &one,sizeof(one)))
 		gale_alert(GALE_ERROR,G_("setsockopt"),errno);
-	if (bind(sock,(struct sockaddr *)&sin,sizeof(sin))) {
+
+#if defined(AF_INET6) && defined(IPV6_V6ONLY)
+	if (AF_INET6 == family) {
+		struct sockaddr_in6 sin6;
+		int zero = 0;
+		/* Accept IPv4 connections too, as mapped addresses. */
+		setsockopt(sock,IPPROTO_IPV6,IPV6_V6ONLY,
+		           (SETSOCKOPT_ARG_4_T) &zero,sizeof(zero));
+		memset(&sin6,0,sizeof(sin6));
+		sin6.sin6_family = AF_INET6;
+		sin6.sin6_addr = in6addr_any;
+		sin6.sin6_port = htons(port);
+		if (!bind(sock,(struct sockaddr *) &sin6,sizeof(sin6)))
+			return sock;
+	} else
+#endif
+	{
+		struct sockaddr_in sin;
+		memset(&sin,0,sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_addr.s_addr = INADDR_ANY;
+		sin.sin_port = htons(port);
+		if (!bind(sock,(struct sockaddr *) &sin,sizeof(sin)))
+			return sock;
+	}
+
+	close(sock);
+	return -1;
+}
+
+static int make_listener(oop_source *source,int port) {
+	int sock = -1;
+#if defined(AF_INET6) && defined(IPV6_V6ONLY)
+	sock = bind_socket(AF_INET6,port);
+	if (sock < 0) gale_dprintf(1,"no IPv6 listener, using IPv4\n");
+#endif
+	if (sock < 0) sock = bind_socket(AF_INET,port);
+	if (sock < 0) {
 		gale_alert(GALE_ERROR,G_("bind"),errno);
-		close(sock);
-		return;
+		return -1;
 	}
-	if (listen(sock,20)) {
+	if (listen(sock,listen_backlog())) {
 		gale_alert(GALE_ERROR,G_("listen"),errno);
 		close(sock);
-		return;
+		return -1;
 	}
 
 	source->on_fd(source,sock,OOP_READ,on_incoming,NULL);
+	return sock;
+}
+
+static void remove_local(void *name) {
+	/* After a handoff, the socket belongs to our successor. */
+	if (!handoff_done()) unlink((const char *) name);
+}
+
+/* Same-host clients connect here instead of over loopback TCP. */
+static int make_local_listener(oop_source *source,int port) {
+	const struct gale_text path = gale_local_socket(port);
+	const char *name = gale_text_to(gale_global->enc_filesys,path);
+	struct sockaddr_un sun;
+	int sock;
+
+	if (strlen(name) >= sizeof(sun.sun_path)) {
+		gale_alert(GALE_WARNING,gale_text_concat(3,
+			G_("local socket name \""),path,G_("\" too long")),0);
+		return -1;
+	}
+
+	sock = socket(AF_UNIX,SOCK_STREAM,0);
+	if (sock < 0) {
+		gale_alert(GALE_WARNING,G_("socket"),errno);
+		return -1;
+	}
+
+	fcntl(sock,F_SETFD,1);
+	fcntl(sock,F_SETFL,O_NONBLOCK);
+	memset(&sun,0,sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path,name);
+	unlink(name);
+	if (bind(sock,(struct sockaddr *) &sun,sizeof(sun))
+	||  chmod(name,0777)
+	||  listen(sock,listen_backlog())) {
+		gale_alert(GALE_WARNING,path,errno);
+		close(sock);
+		return -1;
+	}
+
+	gale_cleanup(remove_local,(void *) name);
+	source->on_fd(source,sock,OOP_READ,on_local,NULL);
+	return sock;
 }
 
 int main(int argc,char *argv[]) {
-	int opt;
+	int opt,do_takeover = 0,is_takeover = 0,tcp = -1,local = -1;
 	oop_source_sys *sys;
 	oop_source *source;
 	struct gale_error_queue *error;
@@ -162,25 +259,47 @@ int main(int argc,char *argv[]) {
 	srand48(time(NULL) ^ getpid());
 
 	server_port = gale_port;
-	while ((opt = getopt(argc,argv,"hdDp:")) != EOF) switch (opt) {
+	while ((opt = getopt(argc,argv,"hdDp:r")) != EOF) switch (opt) {
 	case 'd': ++gale_global->debug_level; break;
 	case 'D': gale_global->debug_level += 5; break;
 	case 'p': server_port = atoi(optarg); break;
+	case 'r': do_takeover = 1; break;
 	case 'h':
 	case '?': usage();
 	}
 
-	add_links(source);
+	init_policy(source);
 
 	if (optind != argc) usage();
 
 	gale_dprintf(0,"starting gale server\n");
 	openlog(argv[0],LOG_PID,LOG_LOCAL5);
 
-	gale_dprintf(1,"now listening, entering main loop\n");
 	gale_daemon(source);
-	gale_kill(gale_text_from_number(server_port,10,0),1);
-	make_listener(source,server_port);
+	if (do_takeover) is_takeover = take_handoff(source,&tcp,&local);
+	gale_kill(gale_text_from_number(server_port,10,0),!is_takeover);
+
+	/* The spool is shared with the old server until it's gone. */
+	init_spool();
+	init_federation(source);
+
+	if (tcp < 0)
+		tcp = make_listener(source,server_port);
+	else
+		source->on_fd(source,tcp,OOP_READ,on_incoming,NULL);
+	if (local < 0)
+		local = make_local_listener(source,server_port);
+	else {
+		const struct gale_text path = gale_local_socket(server_port);
+		gale_cleanup(remove_local,(void *)
+			gale_text_to(gale_global->enc_filesys,path));
+		source->on_fd(source,local,OOP_READ,on_local,NULL);
+	}
+
+	gale_dprintf(1,"now listening, entering main loop\n");
+	init_handoff(source,tcp,local);
+	init_snapshot(source);
+	make_metrics_listener(source,metrics_path());
 	gale_detach(source);
 
 	error = gale_make_queue(source);
@@ -0,0 +1,331 @@
+#include "handoff.h"
+#include "connect.h"
+#include "server.h"
+
+#include "gale/all.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+/* Hot restart.  A running galed listens on a local socket for its
+   successor ("galed -r"), and when one connects, stops accepting and
+   passes it the listening sockets, then each client connection as soon
+   as the connection is between messages (along with its subscription,
+   will and unsent messages), and exits.  Clients notice nothing but a
+   pause.  Connections to other servers are dropped and made again by the
+   new server; clients which can't be handed over within HANDOFF_WAIT
+   seconds (such as those using shared memory) are disconnected, and
+   reconnect as usual.  A successor which hears nothing for HANDOFF_LIMIT
+   seconds gives up, and starts afresh.
+
+   The handoff is a stream of records, each a type and a length followed
+   by that much data, with a descriptor attached to the first byte of
+   those which carry one. */
+
+enum { rec_listen, rec_local, rec_connect, rec_done };
+
+static int listeners[2];        /* TCP and local, or -1 */
+static int successor = -1;
+static int is_done = 0;
+static struct timeval deadline;
+static const char *bound = NULL; /* our handoff socket, until it's used */
+
+static struct gale_text handoff_path(void) {
+	struct gale_text path = gale_var(G_("GALE_HANDOFF_SOCKET"));
+	if (0 != path.l) return path;
+	return dir_file(gale_global->dot_gale,gale_text_concat(2,
+		G_("galed-handoff."),
+		gale_text_from_number(server_port,10,0)));
+}
+
+static int handoff_address(struct sockaddr_un *sun) {
+	const struct gale_text path = handoff_path();
+	const char *name = gale_text_to(gale_global->enc_filesys,path);
+	if (strlen(name) >= sizeof(sun->sun_path)) {
+		gale_alert(GALE_WARNING,gale_text_concat(3,
+			G_("handoff socket name \""),path,G_("\" too long")),0);
+		return 0;
+	}
+
+	memset(sun,0,sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	strcpy(sun->sun_path,name);
+	return 1;
+}
+
+static int send_record(u32 type,int fd,struct gale_data data) {
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct gale_data buf;
+	struct msghdr msg;
+	struct iovec vec;
+	size_t sent = 0;
+
+	buf.p = gale_malloc_atomic(2 * gale_u32_size() + data.l);
+	buf.l = 0;
+	gale_pack_u32(&buf,type);
+	gale_pack_u32(&buf,data.l);
+	gale_pack_copy(&buf,data.p,data.l);
+
+	memset(&msg,0,sizeof(msg));
+	msg.msg_iov = &vec;
+	msg.msg_iovlen = 1;
+	if (fd >= 0) {
+		struct cmsghdr *cmsg;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg),&fd,sizeof(int));
+	}
+
+	while (sent < buf.l) {
+		ssize_t w;
+		vec.iov_base = buf.p + sent;
+		vec.iov_len = buf.l - sent;
+		w = sendmsg(successor,&msg,0);
+		if (w < 0 && EINTR == errno) continue;
+		if (w <= 0) return 0;
+		sent += w;
+		msg.msg_control = NULL;
+		msg.msg_controllen = 0;
+	}
+
+	gale_free(buf.p);
+	return 1;
+}
+
+static void send_connection(int fd,struct gale_data state,void *user) {
+	if (!send_record(rec_connect,fd,state))
+		gale_alert(GALE_ERROR,G_("handoff"),errno);
+	close(fd);
+}
+
+static void *on_drain(oop_source *source,struct timeval now,void *user) {
+	const int left = detach_connects();
+	struct timeval next;
+
+	gettimeofday(&next,NULL);
+	if (left > 0 && timercmp(&next,&deadline,<)) {
+		next.tv_usec += HANDOFF_POLL * 1000;
+		if (next.tv_usec >= 1000000) {
+			++next.tv_sec;
+			next.tv_usec -= 1000000;
+		}
+		source->on_time(source,next,on_drain,NULL);
+		return OOP_CONTINUE;
+	}
+
+	export_connects(send_connection,NULL);
+	if (!send_record(rec_done,-1,null_data))
+		gale_alert(GALE_ERROR,G_("handoff"),errno);
+	gale_alert(GALE_NOTICE,gale_text_concat(3,
+		G_("handed over to new server, "),
+		gale_text_from_number(left,10,0),
+		G_(" connections dropped")),0);
+	is_done = 1;
+	exit(0);
+}
+
+static void *on_successor(oop_source *source,int fd,oop_event ev,void *x) {
+	const int newfd = accept(fd,NULL,NULL);
+	if (newfd < 0) return OOP_CONTINUE;
+
+	gale_dprintf(1,"handing over to new server\n");
+	source->cancel_fd(source,fd,OOP_READ);
+	close(fd);
+	if (NULL != bound) unlink(bound);
+	bound = NULL;
+	successor = newfd;
+	fcntl(successor,F_SETFL,0);
+
+	/* Stop accepting; new clients queue up for the successor. */
+	if (listeners[0] >= 0) source->cancel_fd(source,listeners[0],OOP_READ);
+	if (listeners[1] >= 0) source->cancel_fd(source,listeners[1],OOP_READ);
+	if ((listeners[0] >= 0 && !send_record(rec_listen,listeners[0],null_data))
+	||  (listeners[1] >= 0 && !send_record(rec_local,listeners[1],null_data)))
+		gale_alert(GALE_ERROR,G_("handoff"),errno);
+
+	gettimeofday(&deadline,NULL);
+	deadline.tv_sec += HANDOFF_WAIT;
+	source->on_time(source,OOP_TIME_NOW,on_drain,NULL);
+	return OOP_CONTINUE;
+}
+
+static void remove_handoff(void *name) {
+	/* Once a successor has it, the name is (or will be) theirs. */
+	if (NULL != bound) unlink(bound);
+}
+
+/* Wait for a successor, to hand it these listening sockets (or -1) and
+   all our clients. */
+void init_handoff(oop_source *source,int tcp,int local) {
+	struct sockaddr_un sun;
+	int sock;
+
+	listeners[0] = tcp;
+	listeners[1] = local;
+	if (!handoff_address(&sun)) return;
+
+	sock = socket(AF_UNIX,SOCK_STREAM,0);
+	if (sock < 0) {
+		gale_alert(GALE_WARNING,G_("socket"),errno);
+		return;
+	}
+
+	fcntl(sock,F_SETFD,1);
+	fcntl(sock,F_SETFL,O_NONBLOCK);
+	unlink(sun.sun_path);
+	if (bind(sock,(struct sockaddr *) &sun,sizeof(sun)) || listen(sock,1)) {
+		gale_alert(GALE_WARNING,handoff_path(),errno);
+		close(sock);
+		return;
+	}
+
+	bound = gale_text_to(gale_global->enc_filesys,handoff_path());
+	gale_cleanup(remove_handoff,NULL);
+	source->on_fd(source,sock,OOP_READ,on_successor,NULL);
+}
+
+/* True once we've handed everything to a successor. */
+int handoff_done(void) {
+	return is_done;
+}
+
+static int read_all(int sock,byte *p,size_t len,int *fd,
+                    const struct timeval *until)
+{
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+
+	while (len > 0) {
+		struct msghdr msg;
+		struct cmsghdr *cmsg;
+		struct iovec vec;
+		struct pollfd pfd;
+		struct timeval now;
+		ssize_t r;
+
+		gettimeofday(&now,NULL);
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		r = timercmp(&now,until,<) ? poll(&pfd,1,
+			(until->tv_sec - now.tv_sec) * 1000
+			+ (until->tv_usec - now.tv_usec) / 1000) : 0;
+		if (r < 0 && EINTR == errno) continue;
+		if (0 == r) errno = ETIMEDOUT;
+		if (r <= 0) return 0;
+
+		memset(&msg,0,sizeof(msg));
+		vec.iov_base = p;
+		vec.iov_len = len;
+		msg.msg_iov = &vec;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		r = recvmsg(sock,&msg,0);
+		if (r < 0 && EINTR == errno) continue;
+		if (r <= 0) return 0;
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); NULL != cmsg;
+		     cmsg = CMSG_NXTHDR(&msg,cmsg))
+			if (SOL_SOCKET == cmsg->cmsg_level
+			&&  SCM_RIGHTS == cmsg->cmsg_type) {
+				int received;
+				memcpy(&received,CMSG_DATA(cmsg),sizeof(int));
+				if (NULL != fd && *fd < 0)
+					*fd = received;
+				else
+					close(received);
+			}
+
+		p += r;
+		len -= r;
+	}
+
+	return 1;
+}
+
+/* Take over from a running server, if there is one: fill in the
+   listening sockets it had (or -1) and adopt its clients.  Returns zero
+   if there was no server to take over from. */
+int take_handoff(oop_source *source,int *tcp,int *local) {
+	struct sockaddr_un sun;
+	struct timeval until;
+	int sock,count = 0;
+
+	*tcp = *local = -1;
+	if (!handoff_address(&sun)) return 0;
+	sock = socket(AF_UNIX,SOCK_STREAM,0);
+	if (sock < 0) return 0;
+	if (connect(sock,(struct sockaddr *) &sun,sizeof(sun))) {
+		gale_dprintf(1,"no server to take over from\n");
+		close(sock);
+		return 0;
+	}
+
+	gettimeofday(&until,NULL);
+	until.tv_sec += HANDOFF_LIMIT;
+	for (;;) {
+		byte header[2 * sizeof(u32)];
+		struct gale_data data;
+		u32 type,len;
+		int fd = -1;
+
+		data.p = header;
+		data.l = sizeof(header);
+		if (!read_all(sock,header,sizeof(header),&fd,&until)
+		||  !gale_unpack_u32(&data,&type)
+		||  !gale_unpack_u32(&data,&len)) break;
+		data.p = gale_malloc_atomic(len + 1);
+		data.l = len;
+		if (!read_all(sock,data.p,len,NULL,&until)) break;
+		if (fd >= 0) fcntl(fd,F_SETFD,1);
+
+		switch (type) {
+		case rec_listen: *tcp = fd; break;
+		case rec_local: *local = fd; break;
+		case rec_connect:
+			if (fd >= 0 && NULL != import_connect(source,fd,data))
+				++count;
+			break;
+		case rec_done:
+			close(sock);
+			gale_alert(GALE_NOTICE,gale_text_concat(3,
+				G_("took over "),
+				gale_text_from_number(count,10,0),
+				G_(" connections from old server")),0);
+			return 1;
+		default:
+			if (fd >= 0) close(fd);
+		}
+	}
+
+	if (ETIMEDOUT == errno) {
+		/* The old server is stuck; it will be killed, and we start
+		   afresh (keeping any clients it managed to pass on). */
+		gale_alert(GALE_WARNING,G_("handoff timed out"),0);
+		close(sock);
+		if (*tcp >= 0) close(*tcp);
+		if (*local >= 0) close(*local);
+		*tcp = *local = -1;
+		return 0;
+	}
+
+	/* The old server died part way; carry on with what we have. */
+	gale_alert(GALE_WARNING,G_("handoff interrupted"),errno);
+	close(sock);
+	return *tcp >= 0 || count > 0;
+}
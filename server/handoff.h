@@ -0,0 +1,10 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "oop.h"
+
+void init_handoff(oop_source *,int tcp,int local);
+int take_handoff(oop_source *,int *tcp,int *local);
+int handoff_done(void);
+
+#endif
@@ -0,0 +1,129 @@
+#include "limit.h"
+
+#include "gale/all.h"
+
+#include <sys/time.h>
+
+/* Incoming rate limits, as token buckets: each bucket fills at the
+   policy's rate, up to the burst size, and every message takes one
+   message token and as many byte tokens as it is long.  A connection has
+   its own bucket, and shares another with the other connections of its
+   class from the same address. */
+
+struct bucket {
+	double num,mem; /* tokens (mem may go below zero for a big message) */
+	struct gale_time when;
+	int is_new,refs;
+};
+
+struct limit {
+	struct bucket own,*source;
+	struct gale_data key;
+};
+
+static struct gale_map *sources = NULL;
+
+static void init_bucket(struct bucket *bucket) {
+	bucket->num = bucket->mem = 0;
+	bucket->when = gale_time_now();
+	bucket->is_new = 1; /* full, once we know the policy */
+	bucket->refs = 0;
+}
+
+/* A new set of limits for a connection from an address (null_text if
+   it has none worth sharing). */
+struct limit *new_limit(int class,struct gale_text source) {
+	struct limit *limit;
+	gale_create(limit);
+	init_bucket(&limit->own);
+	limit->source = NULL;
+	if (0 == source.l) return limit;
+
+	if (NULL == sources) sources = gale_make_map(0);
+	limit->key = gale_text_as_data(gale_text_concat(3,
+		gale_text_from_number(class,10,0),G_(" "),source));
+	limit->source = gale_map_find(sources,limit->key);
+	if (NULL == limit->source) {
+		gale_create(limit->source);
+		init_bucket(limit->source);
+		gale_map_add(sources,limit->key,limit->source);
+	}
+
+	++limit->source->refs;
+	return limit;
+}
+
+void close_limit(struct limit *limit) {
+	if (NULL != limit->source && 0 == --limit->source->refs)
+		gale_map_add(sources,limit->key,NULL);
+	limit->source = NULL;
+}
+
+static double seconds(struct gale_time t) {
+	struct timeval tv;
+	gale_time_to(&tv,t);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* Add the tokens earned since the bucket was last used. */
+static void fill(struct bucket *bucket,struct gale_time now,
+	double rate_num,double rate_mem,double burst_num,double burst_mem)
+{
+	const double elapsed = seconds(gale_time_diff(now,bucket->when));
+	const int is_reset = bucket->is_new || elapsed < 0;
+	bucket->when = now;
+	bucket->is_new = 0;
+	bucket->num += rate_num * elapsed;
+	bucket->mem += rate_mem * elapsed;
+	if (is_reset || 0 == rate_num || bucket->num > burst_num)
+		bucket->num = burst_num;
+	if (is_reset || 0 == rate_mem || bucket->mem > burst_mem)
+		bucket->mem = burst_mem;
+}
+
+/* Seconds until a bucket has enough tokens for a message (0 if it does). */
+static double wait(struct bucket *bucket,struct gale_time now,
+	int rate_num,size_t rate_mem,int burst_num,size_t burst_mem,size_t size)
+{
+	double need,worst = 0;
+	if (burst_num < rate_num) burst_num = rate_num;
+	if (burst_mem < rate_mem) burst_mem = rate_mem;
+	fill(bucket,now,rate_num,rate_mem,burst_num,burst_mem);
+
+	if (rate_num > 0 && (need = 1 - bucket->num) > 0)
+		worst = need / rate_num;
+
+	/* A message bigger than a burst waits for a full bucket. */
+	if (size > burst_mem) size = burst_mem;
+	if (rate_mem > 0 && (need = size - bucket->mem) > 0
+	&&  need / rate_mem > worst)
+		worst = need / rate_mem;
+	return worst;
+}
+
+/* Check a message of some size against the limits.  If it's within them,
+   take its tokens and return 0; otherwise, return the seconds until it
+   would be. */
+double limit_check(struct limit *limit,const struct policy *policy,size_t size) {
+	const struct gale_time now = gale_time_now();
+	double delay = wait(&limit->own,now,
+		policy->rate_num,policy->rate_mem,
+		policy->burst_num,policy->burst_mem,size);
+
+	if (NULL != limit->source) {
+		const double source_delay = wait(limit->source,now,
+			policy->source_rate_num,policy->source_rate_mem,
+			policy->burst_num,policy->burst_mem,size);
+		if (source_delay > delay) delay = source_delay;
+	}
+
+	if (delay > 0) return delay;
+	limit->own.num -= 1;
+	limit->own.mem -= size;
+	if (NULL != limit->source) {
+		limit->source->num -= 1;
+		limit->source->mem -= size;
+	}
+
+	return 0;
+}
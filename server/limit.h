@@ -0,0 +1,12 @@
+#ifndef LIMIT_H
+#define LIMIT_H
+
+#include "policy.h"
+
+#include "gale/core.h"
+
+struct limit *new_limit(int class,struct gale_text source);
+void close_limit(struct limit *);
+double limit_check(struct limit *,const struct policy *,size_t size);
+
+#endif
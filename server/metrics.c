@@ -0,0 +1,113 @@
+#include "metrics.h"
+#include "server.h"
+
+#include "gale/all.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define TICK_INTERVAL 1 /* seconds between event loop latency samples */
+
+struct export {
+	int fd;
+	struct gale_data data;
+};
+
+static struct gale_metric *loop_lag = NULL;
+static struct timeval tick;
+
+static void *on_writable(oop_source *source,int fd,oop_event ev,void *x) {
+	struct export *exp = (struct export *) x;
+	const int r = write(fd,exp->data.p,exp->data.l);
+	if (r > 0) {
+		exp->data.p += r;
+		exp->data.l -= r;
+	}
+
+	if (0 == exp->data.l || (r < 0 && EINTR != errno && EAGAIN != errno)) {
+		source->cancel_fd(source,fd,OOP_WRITE);
+		close(fd);
+	}
+
+	return OOP_CONTINUE;
+}
+
+static void *on_scrape(oop_source *source,int fd,oop_event ev,void *x) {
+	struct export *exp;
+	const char *text;
+	int newfd = accept(fd,NULL,NULL);
+	if (newfd < 0) {
+		if (EINTR != errno && EAGAIN != errno)
+			gale_alert(GALE_WARNING,G_("accept"),errno);
+		return OOP_CONTINUE;
+	}
+
+	fcntl(newfd,F_SETFD,1);
+	fcntl(newfd,F_SETFL,O_NONBLOCK);
+	text = gale_text_to(gale_global->enc_ascii,gale_metric_run());
+
+	gale_create(exp);
+	exp->fd = newfd;
+	exp->data.p = (byte *) text;
+	exp->data.l = strlen(text);
+	source->on_fd(source,newfd,OOP_WRITE,on_writable,exp);
+	return OOP_CONTINUE;
+}
+
+/* Sample how late a timer fires, as a measure of event loop latency. */
+static void *on_tick(oop_source *source,struct timeval now,void *x) {
+	struct timeval actual;
+	gettimeofday(&actual,NULL);
+	gale_metric_observe(loop_lag,
+		(actual.tv_sec - tick.tv_sec) 
+		+ (actual.tv_usec - tick.tv_usec) / 1000000.0);
+
+	tick = actual;
+	tick.tv_sec += TICK_INTERVAL;
+	source->on_time(source,tick,on_tick,NULL);
+	return OOP_CONTINUE;
+}
+
+void make_metrics_listener(oop_source *source,struct gale_text path) {
+	struct sockaddr_un sun;
+	const char *name = gale_text_to(gale_global->enc_filesys,path);
+	int sock;
+
+	loop_lag = gale_make_histogram(
+		G_("galed_loop_lag_seconds"),null_text,0.001,14);
+	gettimeofday(&tick,NULL);
+	tick.tv_sec += TICK_INTERVAL;
+	source->on_time(source,tick,on_tick,NULL);
+
+	if (strlen(name) >= sizeof(sun.sun_path)) {
+		gale_alert(GALE_WARNING,gale_text_concat(3,
+			G_("metrics socket name \""),path,G_("\" too long")),0);
+		return;
+	}
+
+	sock = socket(AF_UNIX,SOCK_STREAM,0);
+	if (sock < 0) {
+		gale_alert(GALE_WARNING,G_("socket"),errno);
+		return;
+	}
+
+	fcntl(sock,F_SETFD,1);
+	fcntl(sock,F_SETFL,O_NONBLOCK);
+	memset(&sun,0,sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path,name);
+	unlink(name);
+	if (bind(sock,(struct sockaddr *) &sun,sizeof(sun)) || listen(sock,5)) {
+		gale_alert(GALE_WARNING,path,errno);
+		close(sock);
+		return;
+	}
+
+	source->on_fd(source,sock,OOP_READ,on_scrape,NULL);
+}
@@ -0,0 +1,10 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "gale/misc.h"
+
+#include "oop.h"
+
+void make_metrics_listener(oop_source *,struct gale_text path);
+
+#endif
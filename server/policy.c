@@ -0,0 +1,326 @@
+#include "policy.h"
+#include "server.h"
+
+#include "gale/globals.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+
+/* Queue limits are read from a file (by default ~/.gale/galed-policy)
+   at startup and again whenever the server receives SIGHUP.  Each line
+   is "setting value"; settings may be prefixed with a connection class
+   ("client.", "link." or "directed.") to apply to that class only:
+
+	queue_mem 1048576
+	link.queue_mem 4194304
+	client.strategy disconnect
+	client.rate_num 100
+	client.rate_mem 65536
+	client.source_rate_num 1000
+	client.burst_num 500
+	client.limit slow
+	directed_timeout 600
+	directed_keep 0
+	dedup_window 60
+	spool_age 3600
+	shed /user/_gale/notice/
+	presence /user/_gale/notice/
+
+   Messages whose categories all begin with a "shed" prefix are dropped
+   before any others when a queue is over its limits.  A message with one
+   category, beginning with a "presence" prefix, describes its sender's
+   current state, and only the latest one is kept (see presence.c).  A
+   prefix beginning with '/' matches the category path in any domain.
+
+   Messages seen within dedup_window seconds are dropped as copies (0
+   turns this off), and messages are kept in the spool (if any) for
+   spool_age seconds (0 keeps them until there's no room).  Idle links to
+   other servers for directed categories are closed after
+   directed_timeout seconds (longer for busy servers), except for those to
+   the directed_keep busiest (see directed.c).
+
+   Messages coming in are limited to rate_num messages and rate_mem bytes
+   per second from each connection, and source_rate_num and source_rate_mem
+   from all the connections of a class from one address, with bursts of
+   up to burst_num messages and burst_mem bytes (by default, one second's
+   worth).  Zero (the default) means no limit.  Messages over the limits
+   are dropped ("limit shed") or held, while we stop reading from the
+   connection until they're within the limits ("limit slow"). */
+
+static const char * const class_name[class_count] = {
+	"client", "link", "directed" };
+static const char * const strategy_name[] = {
+	"oldest", "newest", "disconnect" };
+static const char * const limit_name[] = { "shed", "slow" };
+
+static struct policy policies[class_count];
+static int timeout = DIRECTED_TIMEOUT,window = DEDUP_WINDOW,age = SPOOL_AGE;
+static int keep = DIRECTED_KEEP;
+static struct gale_text shed,presence;
+
+static int is_space(wch ch) {
+	return ' ' == ch || '\t' == ch || '\r' == ch || '\n' == ch;
+}
+
+static struct gale_text next_word(struct gale_text *line) {
+	struct gale_text word;
+	int i = 0;
+	while (i < line->l && is_space(line->p[i])) ++i;
+	line->p += i;
+	line->l -= i;
+
+	i = 0;
+	while (i < line->l && !is_space(line->p[i])) ++i;
+	word = gale_text_left(*line,i);
+	line->p += i;
+	line->l -= i;
+	return word;
+}
+
+static int is_word(struct gale_text text,const char *word) {
+	return !gale_text_compare(text,gale_text_from(NULL,word,-1));
+}
+
+static size_t to_size(struct gale_text value) {
+	const int i = gale_text_to_number(value);
+	return (i > 0) ? i : 0;
+}
+
+static int set(struct policy *policy,
+	struct gale_text name,struct gale_text value)
+{
+	int i;
+	if (is_word(name,"queue_num"))
+		policy->queue_num = gale_text_to_number(value);
+	else if (is_word(name,"queue_mem"))
+		policy->queue_mem = to_size(value);
+	else if (is_word(name,"queue_age"))
+		policy->queue_age = gale_text_to_number(value);
+	else if (is_word(name,"strategy")) {
+		for (i = 0; i <= drop_consumer; ++i)
+			if (is_word(value,strategy_name[i])) break;
+		if (i > drop_consumer) return 0;
+		policy->strategy = i;
+	} else if (is_word(name,"rate_num"))
+		policy->rate_num = to_size(value);
+	else if (is_word(name,"rate_mem"))
+		policy->rate_mem = to_size(value);
+	else if (is_word(name,"source_rate_num"))
+		policy->source_rate_num = to_size(value);
+	else if (is_word(name,"source_rate_mem"))
+		policy->source_rate_mem = to_size(value);
+	else if (is_word(name,"burst_num"))
+		policy->burst_num = to_size(value);
+	else if (is_word(name,"burst_mem"))
+		policy->burst_mem = to_size(value);
+	else if (is_word(name,"limit")) {
+		for (i = 0; i <= limit_slow; ++i)
+			if (is_word(value,limit_name[i])) break;
+		if (i > limit_slow) return 0;
+		policy->limit = i;
+	} else
+		return 0;
+	return 1;
+}
+
+static int parse(struct policy *next,
+	int *next_timeout,int *next_keep,int *next_window,int *next_age,
+	struct gale_text *next_shed,int *has_shed,
+	struct gale_text *next_presence,int *has_presence,struct gale_text line)
+{
+	const struct gale_text name = next_word(&line);
+	const struct gale_text value = next_word(&line);
+	struct gale_text setting = null_text;
+	int i;
+
+	if (is_word(name,"directed_timeout")) {
+		*next_timeout = gale_text_to_number(value);
+		return 1;
+	}
+
+	if (is_word(name,"directed_keep")) {
+		*next_keep = gale_text_to_number(value);
+		return 1;
+	}
+
+	if (is_word(name,"dedup_window")) {
+		*next_window = gale_text_to_number(value);
+		return 1;
+	}
+
+	if (is_word(name,"spool_age")) {
+		*next_age = gale_text_to_number(value);
+		return 1;
+	}
+
+	if (is_word(name,"shed")) {
+		if (!*has_shed) *next_shed = null_text;
+		*has_shed = 1;
+		if (0 == value.l) return 1;
+		*next_shed = (0 == next_shed->l) ? value
+			: gale_text_concat(3,*next_shed,G_(":"),value);
+		return 1;
+	}
+
+	if (is_word(name,"presence")) {
+		if (!*has_presence) *next_presence = null_text;
+		*has_presence = 1;
+		if (0 == value.l) return 1;
+		*next_presence = (0 == next_presence->l) ? value
+			: gale_text_concat(3,*next_presence,G_(":"),value);
+		return 1;
+	}
+
+	for (i = 0; i < class_count; ++i) {
+		const struct gale_text prefix = gale_text_concat(2,
+			gale_text_from(NULL,class_name[i],-1),G_("."));
+		if (name.l > prefix.l
+		&& !gale_text_compare(gale_text_left(name,prefix.l),prefix)) {
+			setting = gale_text_right(name,-prefix.l);
+			break;
+		}
+	}
+
+	if (i < class_count) return set(&next[i],setting,value);
+	for (i = 0; i < class_count; ++i)
+		if (!set(&next[i],name,value)) return 0;
+	return 1;
+}
+
+static struct gale_text policy_file(void) {
+	struct gale_text file = gale_var(G_("GALE_POLICY"));
+	if (0 != file.l) return file;
+	return dir_file(gale_global->dot_gale,G_("galed-policy"));
+}
+
+static void load_policy(void) {
+	const struct gale_text file = policy_file();
+	struct policy next[class_count];
+	struct gale_text next_shed = G_("/user/_gale/notice/");
+	struct gale_text next_presence = G_("/user/_gale/notice/");
+	int next_timeout = DIRECTED_TIMEOUT,next_window = DEDUP_WINDOW;
+	int next_keep = DIRECTED_KEEP;
+	int next_age = SPOOL_AGE;
+	int has_shed = 0,has_presence = 0,i;
+	FILE *fp;
+
+	for (i = 0; i < class_count; ++i) {
+		next[i].queue_num = QUEUE_NUM;
+		next[i].queue_mem = QUEUE_MEM;
+		next[i].queue_age = QUEUE_AGE;
+		next[i].strategy = drop_oldest;
+		next[i].rate_num = next[i].source_rate_num = 0;
+		next[i].rate_mem = next[i].source_rate_mem = 0;
+		next[i].burst_num = 0;
+		next[i].burst_mem = 0;
+		next[i].limit = limit_shed;
+	}
+
+	fp = fopen(gale_text_to(gale_global->enc_filesys,file),"r");
+	if (NULL == fp) {
+		if (ENOENT != errno) gale_alert(GALE_WARNING,file,errno);
+	} else {
+		struct gale_text line = gale_read_line(fp);
+		int num = 1;
+		while (0 != line.l) {
+			struct gale_text rest = line;
+			const struct gale_text first = next_word(&rest);
+			if (0 != first.l && '#' != first.p[0]
+			&&  !parse(next,&next_timeout,&next_keep,
+			            &next_window,&next_age,
+			            &next_shed,&has_shed,
+			            &next_presence,&has_presence,line))
+				gale_alert(GALE_WARNING,gale_text_concat(5,
+					file,G_(":"),
+					gale_text_from_number(num,10,0),
+					G_(": ignoring bad setting "),
+					first),0);
+			line = gale_read_line(fp);
+			++num;
+		}
+		fclose(fp);
+	}
+
+	for (i = 0; i < class_count; ++i) policies[i] = next[i];
+	timeout = next_timeout;
+	keep = next_keep;
+	window = next_window;
+	age = next_age;
+	shed = next_shed;
+	presence = next_presence;
+}
+
+static void *on_hangup(oop_source *source,int sig,void *user) {
+	gale_alert(GALE_NOTICE,G_("SIGHUP received, reloading queue policy"),0);
+	load_policy();
+	return OOP_CONTINUE;
+}
+
+/* Read the policy file, and again whenever we get SIGHUP. */
+void init_policy(oop_source *source) {
+	load_policy();
+	gale_on_hangup(source,on_hangup,NULL);
+}
+
+/* Current queue limits for a class of connection. */
+const struct policy *get_policy(int class) {
+	assert(class >= 0 && class < class_count);
+	return &policies[class];
+}
+
+/* Seconds to hold an idle directed link open. */
+int directed_timeout(void) {
+	return timeout;
+}
+
+/* Number of the busiest directed hosts to hold links to however idle. */
+int directed_keep(void) {
+	return keep;
+}
+
+/* Seconds to remember messages, to drop copies of them. */
+int dedup_window(void) {
+	return window;
+}
+
+/* Seconds to keep messages in the spool (0 for no limit). */
+int spool_age(void) {
+	return age;
+}
+
+/* True if a category begins with one of a list of prefixes. */
+static int has_prefix(struct gale_text list,struct gale_text cat) {
+	struct gale_text prefix = null_text,path = cat;
+	if (path.l > 0 && '@' == path.p[0]) {
+		int i = 0;
+		while (i < path.l && '/' != path.p[i]) ++i;
+		path = gale_text_right(path,-i);
+	}
+
+	while (gale_text_token(list,':',&prefix)) {
+		const struct gale_text text =
+			(prefix.l > 0 && '/' == prefix.p[0]) ? path : cat;
+		if (prefix.l > 0 && text.l >= prefix.l
+		&& !gale_text_compare(gale_text_left(text,prefix.l),prefix))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* True if every category of a message matches a "shed" prefix. */
+int is_expendable(struct gale_packet *msg,void *user) {
+	struct gale_text cat = null_text;
+	int count = 0;
+	while (gale_text_token(msg->routing,':',&cat)) {
+		if (!has_prefix(shed,cat)) return 0;
+		++count;
+	}
+	return count > 0;
+}
+
+/* True if a category matches a "presence" prefix. */
+int is_presence(struct gale_text cat) {
+	return has_prefix(presence,cat);
+}
@@ -0,0 +1,44 @@
+#ifndef POLICY_H
+#define POLICY_H
+
+#include "gale/core.h"
+#include "gale/misc.h"
+
+#include "oop.h"
+
+#include <stddef.h>
+
+/* Kinds of connection, which may have different queue limits. */
+enum { class_client, class_link, class_directed, class_count };
+
+/* What to do when a queue is still too big after shedding. */
+enum { drop_oldest, drop_newest, drop_consumer };
+
+/* What to do with incoming messages over the rate limits. */
+enum { limit_shed, limit_slow };
+
+struct policy {
+	int queue_num;        /* maximum messages in an outgoing queue */
+	size_t queue_mem;     /* maximum memory in an outgoing queue */
+	int queue_age;        /* maximum age of an outgoing queue */
+	int strategy;         /* drop_oldest, drop_newest or drop_consumer */
+
+	int rate_num;         /* messages per second in from a connection */
+	size_t rate_mem;      /* bytes per second in from a connection */
+	int source_rate_num;  /* ... from all connections from one address */
+	size_t source_rate_mem;
+	int burst_num;        /* messages allowed at once (or rate_num) */
+	size_t burst_mem;     /* bytes allowed at once (or rate_mem) */
+	int limit;            /* limit_shed or limit_slow */
+};
+
+void init_policy(oop_source *);
+const struct policy *get_policy(int class);
+int directed_timeout(void);
+int directed_keep(void);
+int dedup_window(void);
+int spool_age(void);
+int is_expendable(struct gale_packet *,void *);
+int is_presence(struct gale_text cat);
+
+#endif
@@ -0,0 +1,169 @@
+#include "presence.h"
+#include "subscr.h"
+#include "server.h"
+#include "directed.h"
+#include "policy.h"
+
+#include "gale/all.h"
+
+#include <string.h>
+
+/* Presence notices (by default, what gsub sends to each user's
+   _gale/notice/ category) describe their sender's current state, so only
+   the latest one matters.  We can't read the notices themselves, but the
+   category names the sender, so it serves as the key: the last notice in
+   each is cached and sent to any connection which newly subscribes to it,
+   and a notice still queued for a connection when the next one arrives
+   is replaced rather than sent as well.
+
+   The cache is ordered by category, so the entries a subscription covers
+   are the ones between its prefix and the end of that prefix. */
+
+struct entry {
+	struct gale_packet *msg;
+	struct gale_time when;
+	int stamp;
+};
+
+static struct gale_map *cache = NULL;
+static int num = 0,stamp = 0;
+static int sent = 0,replaced = 0;
+static struct gale_time last_sweep;
+static struct gale_metric *cached,*replayed,*superseded;
+
+static struct gale_text presence_report(void *d) {
+	return gale_text_concat(7,
+		G_("presence: cached="),
+		gale_text_from_number(num,10,0),
+		G_(", replayed="),
+		gale_text_from_number(sent,10,0),
+		G_(", replaced="),
+		gale_text_from_number(replaced,10,0),
+		G_("\n"));
+}
+
+static void init(void) {
+	cache = gale_make_map(0);
+	last_sweep = gale_time_zero();
+	cached = gale_make_metric(
+		G_("galed_presence_cached"),null_text,metric_gauge);
+	replayed = gale_make_metric(
+		G_("galed_presence_replayed"),null_text,metric_counter);
+	superseded = gale_make_metric(
+		G_("galed_presence_replaced"),null_text,metric_counter);
+	gale_report_add(gale_global->report,presence_report,NULL);
+}
+
+static struct gale_time cutoff(struct gale_time now) {
+	return gale_time_diff(now,gale_time_seconds(PRESENCE_AGE));
+}
+
+static void forget(struct gale_data key) {
+	gale_map_add(cache,key,NULL);
+	gale_metric_add(cached,-1);
+	--num;
+}
+
+/* Make room by dropping stale entries (but not too often). */
+static void sweep(struct gale_time now) {
+	const struct gale_time cut = cutoff(now);
+	struct gale_data key = null_data;
+	void *data;
+
+	if (0 > gale_time_compare(now,gale_time_add(
+		last_sweep,gale_time_seconds(60)))) return;
+	last_sweep = now;
+	while (gale_map_walk(cache,&key,&key,&data))
+		if (0 > gale_time_compare(((struct entry *) data)->when,cut))
+			forget(key);
+}
+
+/* If a message is a presence notice, remember it as the latest for its
+   category and return nonzero. */
+int presence_add(struct gale_packet *msg) {
+	struct gale_text cat = null_text,base;
+	struct gale_data key;
+	struct entry *entry;
+	int flag,count = 0;
+
+	while (gale_text_token(msg->routing,':',&cat)) ++count;
+	if (1 != count) return 0;
+	is_directed(msg->routing,&flag,&base,NULL);
+	if (!flag || 0 == base.l || !is_presence(base)) return 0;
+
+	if (NULL == cache) init();
+	key = gale_text_as_data(base);
+	entry = gale_map_find(cache,key);
+	if (NULL == entry) {
+		const struct gale_time now = gale_time_now();
+		if (num >= PRESENCE_SIZE) sweep(now);
+		if (num >= PRESENCE_SIZE) return 1;
+		gale_create(entry);
+		entry->stamp = stamp;
+		gale_map_add(cache,key,entry);
+		gale_metric_add(cached,1);
+		++num;
+	}
+
+	entry->msg = msg;
+	entry->when = gale_time_now();
+	return 1;
+}
+
+/* Send a presence notice to a connection, replacing any it hasn't sent. */
+void presence_send(struct connect *conn,struct gale_packet *msg) {
+	const int count = replace_connect(conn,msg);
+	gale_metric_add(superseded,count);
+	replaced += count;
+}
+
+static int is_prefix(struct gale_data prefix,struct gale_data key) {
+	return key.l >= prefix.l && !memcmp(key.p,prefix.p,prefix.l);
+}
+
+/* Send a connection the cached notices its new subscription covers and
+   its old one didn't. */
+void presence_replay(struct connect *conn,
+                     struct gale_text old,struct gale_text subscr)
+{
+	const struct gale_time cut = cutoff(gale_time_now());
+	struct gale_text sub = null_text;
+	int count = 0;
+
+	if (NULL == cache) return;
+	++stamp;
+	while (gale_text_token(subscr,':',&sub)) {
+		struct gale_data prefix,key;
+		struct gale_text base;
+		struct entry *entry;
+		int flag;
+
+		/* Root subscriptions don't cover directed categories. */
+		is_directed(sub,&flag,&base,NULL);
+		if (!flag || 0 == base.l) continue;
+
+		prefix = key = gale_text_as_data(base);
+		entry = gale_map_find(cache,key);
+		do {
+			struct gale_packet *out;
+			if (NULL == entry || stamp == entry->stamp) continue;
+			entry->stamp = stamp;
+			if (0 > gale_time_compare(entry->when,cut)) {
+				forget(key);
+				continue;
+			}
+
+			out = subscr_filter(subscr,entry->msg);
+			if (NULL == out || NULL != subscr_filter(old,entry->msg))
+				continue;
+			send_connect(conn,out);
+			++count;
+		} while (gale_map_walk(cache,&key,&key,(void **) &entry)
+		     &&  is_prefix(prefix,key));
+	}
+
+	if (count > 0)
+		gale_dprintf(2,"[%p] replayed %d presence notices\n",conn,count);
+	gale_metric_add(replayed,count);
+	sent += count;
+}
@@ -0,0 +1,12 @@
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include "connect.h"
+
+#include "gale/core.h"
+
+int presence_add(struct gale_packet *);
+void presence_send(struct connect *,struct gale_packet *);
+void presence_replay(struct connect *,struct gale_text old,struct gale_text subscr);
+
+#endif
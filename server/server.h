@@ -1,12 +1,43 @@
 #ifndef CONSTANTS_H
 #define CONSTANTS_H
 
+/* Defaults; see policy.c for runtime overrides. */
 #define DIRECTED_TIMEOUT 600 /* seconds to hold a directed link alive */
+#define DIRECTED_HOLD 8      /* ... times this much for a busy host */
+#define DIRECTED_KEEP 0      /* busiest hosts whose links are always held */
+
+#define FEDERATION_DELAY 1  /* seconds to wait before asking peers */
+
+#define DEDUP_WINDOW 60     /* seconds to remember messages, to drop copies */
+#define DEDUP_SIZE 32768    /* most messages remembered per half window */
+
+#define SPOOL_SIZE 16777216 /* bytes of spool (GALE_SPOOL_SIZE overrides) */
+#define SPOOL_AGE 3600      /* seconds to keep spooled messages */
+#define SPOOL_MARGIN 2      /* seconds of replay to repeat, to be sure */
+
+#define PRESENCE_SIZE 65536 /* most senders whose presence is cached */
+#define PRESENCE_AGE 86400  /* seconds to keep a cached presence notice */
 
 #define QUEUE_NUM -1        /* maximum messages in an outgoing queue */
 #define QUEUE_MEM 1048576   /* maximum memory in an outgoing queue */
 #define QUEUE_AGE 600       /* maximum age of an outgoing queue */
 
+#define SLOW_DELAY 5        /* queueing delay that marks a slow consumer */
+
+#define SNAPSHOT_INTERVAL 60 /* seconds between snapshots of server state */
+#define SNAPSHOT_AGE 86400   /* seconds after which a snapshot is ignored */
+
+#define HANDOFF_WAIT 5      /* seconds to wait for clients to hand over */
+#define HANDOFF_POLL 10     /* milliseconds between checks while waiting */
+#define HANDOFF_LIMIT (2 * HANDOFF_WAIT) /* seconds before giving up */
+
+#define LISTEN_BACKLOG 1024 /* pending connections (GALE_BACKLOG overrides) */
+#define ACCEPT_BATCH 256    /* connections to accept per wakeup */
+
+#define KEEPALIVE_IDLE 300    /* seconds idle before keepalive probes */
+#define KEEPALIVE_INTERVAL 60 /* seconds between keepalive probes */
+#define KEEPALIVE_COUNT 5     /* unanswered probes before disconnecting */
+
 extern int server_port;
 extern struct report *server_report;
 
@@ -0,0 +1,110 @@
+#include "snapshot.h"
+#include "subscr.h"
+#include "directed.h"
+#include "federate.h"
+#include "server.h"
+#include "policy.h"
+
+#include "gale/all.h"
+
+#include <string.h>
+#include <sys/time.h>
+
+/* Every so often, the server notes what its clients subscribe to (as the
+   categories it asks peers for) and which hosts they subscribe to
+   directed categories on, in GALE_SNAPSHOT (by default, a file in
+   ~/.gale).  When it starts again it reads the snapshot and, rather than
+   wait for clients to reconnect and subscribe one by one, links to those
+   hosts and asks its peers for those categories straight away, holding
+   them as long as an unused directed link would be held.
+
+   The file is: magic, time written, interest, hosts (each as text). */
+
+#define SNAPSHOT_MAGIC 0x67536e31
+
+static struct gale_text file;
+static struct gale_data last;
+
+static struct gale_data current(void) {
+	const struct gale_text interest = subscr_interest();
+	const struct gale_text hosts = directed_hosts();
+	struct gale_data data;
+
+	data.p = gale_malloc_atomic(gale_u32_size() + gale_time_size()
+		+ gale_text_size(interest) + gale_text_size(hosts));
+	data.l = 0;
+	gale_pack_u32(&data,SNAPSHOT_MAGIC);
+	gale_pack_time(&data,gale_time_now());
+	gale_pack_text(&data,interest);
+	gale_pack_text(&data,hosts);
+	return data;
+}
+
+/* Compare snapshots, ignoring the time they were taken. */
+static int same(struct gale_data a,struct gale_data b) {
+	const size_t skip = gale_u32_size() + gale_time_size();
+	return a.l == b.l && a.l >= skip
+	    && !memcmp(a.p + skip,b.p + skip,a.l - skip);
+}
+
+static void save(void) {
+	const struct gale_data data = current();
+	if (NULL != last.p && same(data,last)) return;
+	if (!gale_write_file(file,data,1,NULL)) return;
+	gale_dprintf(2,"wrote snapshot (%d bytes)\n",(int) data.l);
+	last = data;
+}
+
+static void *on_save(oop_source *source,struct timeval when,void *x) {
+	save();
+	gettimeofday(&when,NULL);
+	when.tv_sec += SNAPSHOT_INTERVAL;
+	source->on_time(source,when,on_save,NULL);
+	return OOP_CONTINUE;
+}
+
+/* Pre-warm from the last snapshot; return nonzero if there was one. */
+static int load(oop_source *source) {
+	struct gale_data data = gale_read_file(file,0,1,NULL);
+	struct gale_text interest,hosts,host = null_text;
+	struct gale_time when;
+	u32 magic;
+	int count = 0;
+
+	if (!gale_unpack_u32(&data,&magic) || SNAPSHOT_MAGIC != magic
+	||  !gale_unpack_time(&data,&when)
+	||  !gale_unpack_text(&data,&interest)
+	||  !gale_unpack_text(&data,&hosts)) return 0;
+
+	if (0 < gale_time_compare(gale_time_diff(gale_time_now(),when),
+	                          gale_time_seconds(SNAPSHOT_AGE))) {
+		gale_dprintf(1,"ignoring stale snapshot\n");
+		return 0;
+	}
+
+	while (gale_text_token(hosts,':',&host)) if (0 != host.l) {
+		warm_directed(source,host);
+		++count;
+	}
+
+	federation_expect(source,interest);
+	gale_dprintf(1,"snapshot: linking to %d hosts, asking for \"%s\"\n",
+		count,gale_text_to(gale_global->enc_console,interest));
+	return 1;
+}
+
+/* Read the snapshot, if any, and keep it up to date. */
+void init_snapshot(oop_source *source) {
+	struct timeval when;
+
+	file = gale_var(G_("GALE_SNAPSHOT"));
+	if (0 == file.l) file = dir_file(gale_global->dot_gale,
+		gale_text_concat(2,G_("galed-snapshot."),
+			gale_text_from_number(server_port,10,0)));
+
+	/* Don't overwrite the snapshot before clients have had a chance
+	   to come back. */
+	gettimeofday(&when,NULL);
+	when.tv_sec += load(source) ? directed_timeout() : SNAPSHOT_INTERVAL;
+	source->on_time(source,when,on_save,NULL);
+}
@@ -0,0 +1,8 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "oop.h"
+
+void init_snapshot(oop_source *);
+
+#endif
@@ -0,0 +1,285 @@
+#include "spool.h"
+#include "subscr.h"
+#include "server.h"
+#include "policy.h"
+
+#include "gale/all.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+/* If GALE_SPOOL names a file, recent messages are kept there so that a
+   client which reconnects can have what it missed replayed (link_since).
+   The file is a fixed-size ring of records, appended to in turn and
+   mapped into memory; the oldest records are overwritten as it fills,
+   or forgotten when they're older than spool_age seconds.  An index in
+   memory, in time order, finds where a replay starts; the categories of
+   each record are then matched against the client's subscription.  The
+   client's idea of when it last heard from us lags by however long the
+   message spent queued and in transit, so the replay starts SPOOL_MARGIN
+   seconds earlier than asked, and the client drops what it already has.
+   As with live delivery, nobody is sent their own messages (which the
+   index remembers for connections of this process only).
+
+   Each record is: length (including this header, padded to four bytes;
+   zero means the rest of the file is unused and the next record is at
+   the start), time (seconds and microseconds), routing and content
+   lengths, then the routing and content themselves. */
+
+#define SPOOL_MAGIC 0x67537031
+#define SPOOL_HEADER 4096
+#define SPOOL_MIN 65536
+
+enum { r_length, r_sec, r_usec, r_routing, r_content, r_header };
+#define FIELD(pos,f) ((pos) + (f) * sizeof(u32))
+#define RECORD FIELD(0,r_header)
+
+struct spool_header {
+	u32 magic,size;
+	u32 start,end; /* oldest record, and where the next one goes */
+	u32 count;     /* since start == end when it's full or empty */
+};
+
+struct entry {
+	struct gale_time when;
+	u32 pos;
+	int from; /* connect_id() of the sender, or 0 */
+};
+
+static struct spool_header *header = NULL;
+static byte *data;
+static u32 size;
+
+static struct entry *entries;
+static int first,count,alloc;
+
+static struct gale_metric *spooled = NULL,*replayed = NULL;
+
+static struct entry *entry(int i) {
+	return &entries[(first + i) % alloc];
+}
+
+static void push(struct gale_time when,u32 pos,int from) {
+	if (count == alloc) {
+		struct entry *old = entries;
+		const int old_alloc = alloc;
+		int i;
+		alloc = alloc ? alloc * 2 : 1024;
+		entries = gale_malloc_atomic(alloc * sizeof(*entries));
+		for (i = 0; i < count; ++i)
+			entries[i] = old[(first + i) % old_alloc];
+		first = 0;
+	}
+
+	entry(count)->when = when;
+	entry(count)->pos = pos;
+	entry(count)->from = from;
+	header->count = ++count;
+}
+
+static void pop(void) {
+	first = (first + 1) % alloc;
+	header->count = --count;
+	header->start = count ? entry(0)->pos : header->end;
+}
+
+static u32 get_u32(u32 pos) {
+	u32 value;
+	memcpy(&value,data + pos,sizeof(value));
+	return value;
+}
+
+static void put_u32(u32 pos,u32 value) {
+	memcpy(data + pos,&value,sizeof(value));
+}
+
+static u32 padded(u32 len) {
+	return (len + 3) & ~3;
+}
+
+/* Check a record, and return its length (or 0 if it's not valid). */
+static u32 check(u32 pos,struct gale_time *when) {
+	struct timeval tv;
+	u32 len,routing,content;
+	if (pos > size - RECORD) return 0;
+	len = get_u32(FIELD(pos,r_length));
+	routing = get_u32(FIELD(pos,r_routing));
+	content = get_u32(FIELD(pos,r_content));
+	if (len < RECORD || len > size - pos || len != padded(len)
+	||  routing > len - RECORD || content > len - RECORD - routing
+	||  0 != routing % gale_wch_size())
+		return 0;
+	tv.tv_sec = get_u32(FIELD(pos,r_sec));
+	tv.tv_usec = get_u32(FIELD(pos,r_usec));
+	gale_time_from(when,&tv);
+	return len;
+}
+
+/* Rebuild the index of a spool left by a previous run. */
+static int recover(void) {
+	const u32 num = header->count;
+	u32 pos = header->start;
+	while (count < num) {
+		struct gale_time when;
+		u32 len;
+		if (0 != pos && 0 == get_u32(FIELD(pos,r_length))) {
+			pos = 0;
+			continue;
+		}
+		if (0 == (len = check(pos,&when))) return 0;
+		push(when,pos,0);
+		pos += len;
+		if (pos == size) pos = 0;
+	}
+	return pos == header->end;
+}
+
+/* Open (or create) the spool, if one is configured. */
+void init_spool(void) {
+	const struct gale_text file = gale_var(G_("GALE_SPOOL"));
+	const int want = gale_text_to_number(gale_var(G_("GALE_SPOOL_SIZE")));
+	struct spool_header *map;
+	int fd;
+
+	if (0 == file.l) return;
+	size = (want >= SPOOL_MIN) ? (want & ~3) : SPOOL_SIZE;
+
+	fd = open(gale_text_to(gale_global->enc_filesys,file),O_RDWR|O_CREAT,0600);
+	if (fd < 0 || ftruncate(fd,SPOOL_HEADER + size)) {
+		gale_alert(GALE_WARNING,file,errno);
+		if (fd >= 0) close(fd);
+		return;
+	}
+
+	map = mmap(NULL,SPOOL_HEADER + size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+	close(fd);
+	if (MAP_FAILED == map) {
+		gale_alert(GALE_WARNING,file,errno);
+		return;
+	}
+
+	header = map;
+	data = (byte *) map + SPOOL_HEADER;
+	entries = NULL;
+	first = count = alloc = 0;
+	if (SPOOL_MAGIC != header->magic || size != header->size
+	||  header->start >= size || header->end >= size || !recover()) {
+		header->magic = SPOOL_MAGIC;
+		header->size = size;
+		header->start = header->end = header->count = 0;
+		first = count = 0;
+	}
+
+	spooled = gale_make_metric(
+		G_("galed_spooled_messages"),null_text,metric_gauge);
+	replayed = gale_make_metric(
+		G_("galed_replayed_messages"),null_text,metric_counter);
+	gale_metric_add(spooled,count);
+	gale_dprintf(1,"spool holds %d messages\n",count);
+}
+
+/* Forget records in [from,to) of the file (which must be the oldest). */
+static void clear(u32 from,u32 to) {
+	while (count > 0 && entry(0)->pos >= from && entry(0)->pos < to) {
+		pop();
+		gale_metric_add(spooled,-1);
+	}
+}
+
+/* Append a message (and the connection it came from, if any) to the
+   spool. */
+void spool_add(struct gale_packet *msg,struct connect *from) {
+	const struct gale_time now = gale_time_now();
+	const int age = spool_age();
+	const u32 routing = gale_text_len_size(msg->routing);
+	const u32 len = padded(RECORD + routing + msg->content.l);
+	struct gale_data buf;
+	struct timeval tv;
+
+	if (NULL == header) return;
+	if (age > 0) {
+		const struct gale_time cut =
+			gale_time_diff(now,gale_time_seconds(age));
+		while (count > 0 && gale_time_compare(entry(0)->when,cut) < 0) {
+			pop();
+			gale_metric_add(spooled,-1);
+		}
+	}
+
+	if (len > size / 4) return; /* would take too much of the spool */
+
+	if (len > size - header->end) {
+		/* Skip to the start, forgetting whatever was after us. */
+		clear(header->end,size);
+		put_u32(FIELD(header->end,r_length),0);
+		header->end = 0;
+	}
+
+	clear(header->end,header->end + len);
+	gale_time_to(&tv,now);
+	put_u32(FIELD(header->end,r_length),len);
+	put_u32(FIELD(header->end,r_sec),tv.tv_sec);
+	put_u32(FIELD(header->end,r_usec),tv.tv_usec);
+	put_u32(FIELD(header->end,r_routing),routing);
+	put_u32(FIELD(header->end,r_content),msg->content.l);
+	buf.p = data + header->end + RECORD;
+	buf.l = 0;
+	gale_pack_text_len(&buf,msg->routing);
+	gale_pack_copy(&buf,msg->content.p,msg->content.l);
+
+	push(now,header->end,(NULL != from) ? connect_id(from) : 0);
+	if (1 == count) header->start = header->end;
+	header->end += len;
+	if (header->end == size) header->end = 0;
+	gale_metric_add(spooled,1);
+}
+
+/* Send a connection everything in the spool since (about) a given time
+   which matches its subscription, except what it sent itself. */
+void spool_replay(struct connect *conn,struct gale_text subscr,
+                  struct gale_time since)
+{
+	const int self = connect_id(conn);
+	int lo = 0,hi = count,sent = 0;
+	if (NULL == header) return;
+
+	since = gale_time_diff(since,gale_time_seconds(SPOOL_MARGIN));
+
+	while (lo < hi) {
+		const int mid = (lo + hi) / 2;
+		if (gale_time_compare(entry(mid)->when,since) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < count; ++lo) {
+		const u32 pos = entry(lo)->pos;
+		const u32 routing = get_u32(FIELD(pos,r_routing));
+		struct gale_packet msg,*out;
+		struct gale_data buf;
+
+		if (self == entry(lo)->from) continue;
+		buf.p = data + pos + RECORD;
+		buf.l = routing;
+		if (!gale_unpack_text_len(&buf,routing / gale_wch_size(),
+		                          &msg.routing)) continue;
+		msg.content.p = data + pos + RECORD + routing;
+		msg.content.l = get_u32(FIELD(pos,r_content));
+		out = subscr_filter(subscr,&msg);
+		if (NULL == out) continue;
+
+		/* The record may be overwritten before the copy is sent. */
+		out->content.p = gale_malloc_atomic(msg.content.l);
+		memcpy(out->content.p,msg.content.p,msg.content.l);
+		send_connect(conn,out);
+		++sent;
+	}
+
+	gale_dprintf(2,"[%p] replayed %d messages\n",conn,sent);
+	gale_metric_add(replayed,sent);
+}
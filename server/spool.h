@@ -0,0 +1,12 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include "connect.h"
+
+#include "gale/core.h"
+
+void init_spool(void);
+void spool_add(struct gale_packet *,struct connect *from);
+void spool_replay(struct connect *,struct gale_text subscr,struct gale_time);
+
+#endif
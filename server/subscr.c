@@ -5,19 +5,36 @@
 #include "subscr.h"
 #include "connect.h"
 #include "directed.h"
+#include "federate.h"
+#include "dedup.h"
+#include "spool.h"
+#include "presence.h"
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 
-struct sub_connect {
-	int flag,priority,stamp;
-	struct sub_connect *next;
+/* Connections with identical subscriptions share a group, and only the
+   group is entered in the trie; so matching costs the same however many
+   connections there are, and each is only visited to send. */
+
+struct member {
 	struct connect *link;
+	int pos,is_peer;
+};
+
+struct group {
+	struct gale_text spec;
+	int flag,priority,stamp;
+	struct group *next;
+	struct member **member;
+	struct gale_map *index;
+	int num,size,clients; /* clients: members which aren't peer servers */
 };
 
 struct sub {
 	int flag,priority;
-	struct sub_connect *connect;
+	struct group *group;
 };
 
 struct node {
@@ -32,14 +49,16 @@ static int stamp = 0;
 static wch null = 0;
 static const struct gale_text empty = { &null,0 };
 static struct node root = { { &null,0 },NULL,NULL,0,0,NULL };
-static struct sub_connect *list = NULL;
+static struct group *list = NULL;
+static struct gale_map *groups = NULL;
+static struct gale_metric *fan_out = NULL,*group_count = NULL;
 
 static void add(struct node *ptr,struct gale_text spec,struct sub *sub) {
 	struct node *child,*node;
 	size_t i;
 
 	gale_dprintf(3,"[%p] subscribing to \"%s\"\n",
-		sub->connect->link,
+		sub->group,
 		gale_text_to(gale_global->enc_console,spec));
 
 	if (spec.l == 0) {
@@ -100,7 +119,26 @@ static void add(struct node *ptr,struct gale_text spec,struct sub *sub) {
 
 static int same_sub(const struct sub *a,const struct sub *b) {
 	return (a->priority == b->priority && a->flag == b->flag &&
-	        a->connect->link == b->connect->link);
+	        a->group == b->group);
+}
+
+/* Find an existing entry in the trie. */
+static struct sub *find_sub(struct gale_text spec,const struct sub *sub) {
+	struct node *ptr = &root;
+	int i;
+
+	while (spec.l != 0) {
+		ptr = ptr->child;
+		while (ptr && ptr->spec.p[0] != spec.p[0]) ptr = ptr->next;
+		assert(ptr && ptr->spec.l <= spec.l &&
+			!gale_text_compare(ptr->spec,
+				gale_text_left(spec,ptr->spec.l)));
+		spec = gale_text_right(spec,-ptr->spec.l);
+	}
+
+	for (i = 0; i < ptr->num && !same_sub(&ptr->array[i],sub); ++i) ;
+	assert(i != ptr->num);
+	return &ptr->array[i];
 }
 
 static void do_remove(struct node *ptr,struct gale_text spec,struct sub *sub) {
@@ -108,7 +146,7 @@ static void do_remove(struct node *ptr,struct gale_text spec,struct sub *sub) {
 	int i;
 
 	gale_dprintf(3,"[%p] unsubscribing from \"%s\"\n",
-		sub->connect->link,
+		sub->group,
 		gale_text_to(gale_global->enc_console,spec));
 
 	while (spec.l != 0) {
@@ -182,19 +220,14 @@ static void do_remove(struct node *ptr,struct gale_text spec,struct sub *sub) {
 	ptr->child = prev->child;
 }
 
-static void subscr(oop_source *src,struct gale_text spec,struct connect *link,
+static void subscr(oop_source *src,struct gale_text spec,struct group *group,
                    void (*func)(struct node *,struct gale_text,struct sub *),
                    void (*dir)(oop_source *,struct gale_text))
 {
 	struct gale_text cat = null_text;
 	struct sub sub;
 	sub.priority = 0;
-	gale_create(sub.connect);
-	sub.connect->stamp = stamp;
-	sub.connect->link = link;
-
-	/* easy escape */
-	if (!gale_text_compare(spec,G_("-"))) return;
+	sub.group = group;
 
 	gale_dprintf(3,"--- subscribing to all of \"%s\"\n",
 		gale_text_to(gale_global->enc_console,spec));
@@ -226,12 +259,238 @@ struct gale_text category_escape(struct gale_text cat,int flag) {
 	return gale_text_concat(2,G_("+"),cat);
 }
 
+static struct group *find_group(struct gale_text sub) {
+	if (NULL == groups) return NULL;
+	return (struct group *) gale_map_find(groups,gale_text_as_data(sub));
+}
+
+static struct member *find_member(struct group *group,struct connect *link) {
+	struct gale_data key;
+	key.p = (byte *) &link;
+	key.l = sizeof(link);
+	return (struct member *) gale_map_find(group->index,key);
+}
+
 void add_subscr(oop_source *src,struct gale_text sub,struct connect *link) {
-	subscr(src,sub,link,add,sub_directed);
+	struct group *group;
+	struct member *member;
+	struct gale_data key;
+
+	/* easy escape */
+	if (!gale_text_compare(sub,G_("-"))) return;
+
+	if (NULL == groups) {
+		groups = gale_make_map(0);
+		group_count = gale_make_metric(
+			G_("galed_subscription_groups"),null_text,metric_gauge);
+	}
+
+	group = find_group(sub);
+	if (NULL == group) {
+		gale_create(group);
+		group->spec = sub;
+		group->stamp = stamp;
+		group->member = NULL;
+		group->index = gale_make_map(0);
+		group->num = group->size = group->clients = 0;
+		gale_map_add(groups,gale_text_as_data(sub),group);
+		gale_metric_add(group_count,1);
+		subscr(src,sub,group,add,sub_directed);
+	}
+
+	if (group->num == group->size) {
+		struct member **old = group->member;
+		group->size = group->size ? group->size * 2 : 4;
+		group->member = gale_malloc(group->size * sizeof(*old));
+		memcpy(group->member,old,group->num * sizeof(*old));
+	}
+
+	gale_create(member);
+	member->link = link;
+	member->pos = group->num;
+	member->is_peer = connect_is_peer(link);
+	group->member[group->num++] = member;
+	key.p = (byte *) &member->link;
+	key.l = sizeof(member->link);
+	gale_map_add(group->index,key,member);
+	if (!member->is_peer && 1 == ++group->clients) federation_changed(src);
 }
 
 void remove_subscr(oop_source *src,struct gale_text sub,struct connect *link) {
-	subscr(src,sub,link,do_remove,unsub_directed);
+	struct group *group;
+	struct member *member;
+	struct gale_data key;
+
+	if (!gale_text_compare(sub,G_("-"))) return;
+	group = find_group(sub);
+	assert(NULL != group);
+	member = find_member(group,link);
+	assert(NULL != member);
+
+	group->member[member->pos] = group->member[--group->num];
+	group->member[member->pos]->pos = member->pos;
+	key.p = (byte *) &member->link;
+	key.l = sizeof(member->link);
+	gale_map_add(group->index,key,NULL);
+	if (!member->is_peer && 0 == --group->clients) federation_changed(src);
+
+	if (0 == group->num) {
+		subscr(src,sub,group,do_remove,unsub_directed);
+		gale_map_add(groups,gale_text_as_data(sub),NULL);
+		gale_metric_add(group_count,-1);
+	}
+}
+
+struct category {
+	struct gale_text text,base,host;
+	int flag,is_directed,match;
+};
+
+static struct category *parse(struct gale_text spec,int *num) {
+	struct gale_text cat = null_text;
+	struct category *list;
+	int i = 0;
+
+	*num = 0;
+	while (gale_text_token(spec,':',&cat)) ++*num;
+	gale_create_array(list,*num);
+	while (gale_text_token(spec,':',&cat)) {
+		list[i].text = cat;
+		list[i].is_directed = is_directed(cat,
+			&list[i].flag,&list[i].base,&list[i].host);
+		list[i].match = -1;
+		++i;
+	}
+
+	return list;
+}
+
+/* Change a group's subscription, touching only the categories which
+   differ.  Categories kept from the old list keep their trie entries
+   (renumbered if they moved) and their directed-host references. */
+static void retarget(oop_source *src,struct group *group,struct gale_text sub) {
+	struct category *old,*new;
+	struct sub entry;
+	int i,j,num_old,num_new;
+
+	gale_dprintf(3,"--- changing \"%s\" to \"%s\"\n",
+		gale_text_to(gale_global->enc_console,group->spec),
+		gale_text_to(gale_global->enc_console,sub));
+
+	old = parse(group->spec,&num_old);
+	new = parse(sub,&num_new);
+	for (j = 0; j < num_new; ++j)
+		for (i = 0; i < num_old; ++i)
+			if (old[i].match < 0
+			&& !gale_text_compare(old[i].text,new[j].text)) {
+				old[i].match = j;
+				new[j].match = i;
+				break;
+			}
+
+	/* Reference new hosts first, so shared ones never drop to zero. */
+	for (j = 0; j < num_new; ++j)
+		if (new[j].match < 0 && new[j].is_directed)
+			sub_directed(src,new[j].host);
+
+	entry.group = group;
+	for (i = 0; i < num_old; ++i) if (old[i].match < 0) {
+		entry.flag = old[i].flag;
+		entry.priority = i;
+		do_remove(&root,old[i].base,&entry);
+		if (old[i].is_directed) unsub_directed(src,old[i].host);
+	}
+
+	/* Renumber in two steps, so no two entries ever look the same. */
+	for (i = 0; i < num_old; ++i) if (old[i].match >= 0 && old[i].match != i) {
+		entry.flag = old[i].flag;
+		entry.priority = i;
+		find_sub(old[i].base,&entry)->priority = -1 - old[i].match;
+	}
+	for (i = 0; i < num_old; ++i) if (old[i].match >= 0 && old[i].match != i) {
+		entry.flag = old[i].flag;
+		entry.priority = -1 - old[i].match;
+		find_sub(old[i].base,&entry)->priority = old[i].match;
+	}
+
+	for (j = 0; j < num_new; ++j) if (new[j].match < 0) {
+		entry.flag = new[j].flag;
+		entry.priority = j;
+		add(&root,new[j].base,&entry);
+	}
+
+	gale_map_add(groups,gale_text_as_data(group->spec),NULL);
+	group->spec = sub;
+	gale_map_add(groups,gale_text_as_data(sub),group);
+}
+
+/* Move a connection from one subscription to another. */
+void change_subscr(oop_source *src,struct gale_text old,struct gale_text sub,
+                   struct connect *link)
+{
+	struct group * const group = find_group(old);
+	if (!gale_text_compare(old,sub)) return;
+
+	/* If nobody else shares either subscription, edit it in place. */
+	if (NULL != group && 1 == group->num
+	&&  gale_text_compare(sub,G_("-")) && NULL == find_group(sub)) {
+		struct member * const member = group->member[0];
+		const int was_client = group->clients;
+		retarget(src,group,sub);
+		member->is_peer = connect_is_peer(link);
+		group->clients = !member->is_peer;
+		if (was_client || group->clients) federation_changed(src);
+		return;
+	}
+
+	add_subscr(src,sub,link);
+	remove_subscr(src,old,link);
+}
+
+static int compare_text(const void *a,const void *b) {
+	return gale_text_compare(
+		*(const struct gale_text *) a,
+		*(const struct gale_text *) b);
+}
+
+/* The fewest undirected categories which cover every positive one that
+   local clients (not peer servers) subscribe to, for asking peers. */
+struct gale_text subscr_interest(void) {
+	struct gale_data key = null_data;
+	struct gale_text *list = NULL,kept = null_text,result = null_text;
+	int i,num = 0,size = 0;
+	void *data;
+
+	while (NULL != groups && gale_map_walk(groups,&key,&key,&data)) {
+		const struct group *group = (const struct group *) data;
+		struct gale_text cat = null_text,base;
+		if (0 == group->clients) continue;
+		while (gale_text_token(group->spec,':',&cat)) {
+			if (!category_flag(cat,&base)
+			||  (base.l > 0 && '@' == base.p[0])) continue;
+			if (num == size) {
+				struct gale_text *old = list;
+				size = size ? size * 2 : 16;
+				list = gale_malloc(size * sizeof(*old));
+				memcpy(list,old,num * sizeof(*old));
+			}
+			list[num++] = base;
+		}
+	}
+
+	/* Sorted, a category's prefixes come before it. */
+	qsort(list,num,sizeof(*list),compare_text);
+	for (i = 0; i < num; ++i) {
+		if (i > 0 && kept.l <= list[i].l
+		&&  !gale_text_compare(kept,gale_text_left(list[i],kept.l)))
+			continue;
+		kept = list[i];
+		result = gale_text_concat(3,result,G_(":"),
+			(0 == kept.l) ? G_("+") : category_escape(kept,1));
+	}
+
+	if (result.l > 0) result = gale_text_right(result,-1);
+	return result;
 }
 
 static void transmit(struct node *ptr,struct gale_text spec,
@@ -240,17 +499,17 @@ static void transmit(struct node *ptr,struct gale_text spec,
 	int i;
 	if (ptr != &root || spec.l < 1 || spec.p[0] != '@')
 	for (i = 0; i < ptr->num; ++i) {
-		if (ptr->array[i].connect->link == avoid) continue;
-		if (ptr->array[i].connect->stamp != stamp) {
-			ptr->array[i].connect->next = list;
-			list = ptr->array[i].connect;
-			ptr->array[i].connect->stamp = stamp;
-			ptr->array[i].connect->priority = -1;
+		struct group * const group = ptr->array[i].group;
+		if (group->stamp != stamp) {
+			group->next = list;
+			list = group;
+			group->stamp = stamp;
+			group->priority = -1;
 		}
-		if (ptr->array[i].connect->priority > ptr->array[i].priority)
+		if (group->priority > ptr->array[i].priority)
 			continue;
-		ptr->array[i].connect->priority = ptr->array[i].priority;
-		ptr->array[i].connect->flag = ptr->array[i].flag && flag;
+		group->priority = ptr->array[i].priority;
+		group->flag = ptr->array[i].flag && flag;
 	}
 
 	for (ptr = ptr->child; ptr; ptr = ptr->next)
@@ -264,12 +523,64 @@ static void transmit(struct node *ptr,struct gale_text spec,
 		}
 }
 
+/* Would a subscription receive a message?  If so, return the message as
+   subscr_transmit() would send it.  (For replaying old messages to one
+   connection; the trie is for everything else.) */
+struct gale_packet *subscr_filter(struct gale_text spec,struct gale_packet *msg) {
+	struct gale_text cat = null_text;
+	struct gale_packet *rewrite;
+	int best = -1,flag = 0;
+
+	while (gale_text_token(msg->routing,':',&cat)) {
+		struct gale_text base,sub = null_text;
+		int msg_flag,priority = 0;
+		is_directed(cat,&msg_flag,&base,NULL);
+		while (gale_text_token(spec,':',&sub)) {
+			struct gale_text prefix;
+			int sub_flag;
+			is_directed(sub,&sub_flag,&prefix,NULL);
+			if (priority >= best && prefix.l <= base.l
+			&&  (0 != prefix.l || 0 == base.l || '@' != base.p[0])
+			&&  !gale_text_compare(prefix,gale_text_left(base,prefix.l))) {
+				best = priority;
+				flag = sub_flag && msg_flag;
+			}
+			++priority;
+		}
+	}
+
+	if (!flag) return NULL;
+
+	cat = null_text;
+	gale_create(rewrite);
+	rewrite->routing = null_text;
+	rewrite->content = msg->content;
+	while (gale_text_token(msg->routing,':',&cat)) {
+		struct gale_text base;
+		is_directed(cat,NULL,&base,NULL);
+		rewrite->routing = gale_text_concat(3,
+			rewrite->routing,G_(":"),category_escape(base,1));
+	}
+
+	if (rewrite->routing.l > 0)
+		rewrite->routing = gale_text_right(rewrite->routing,-1);
+	return rewrite;
+}
+
 void subscr_transmit(
 	oop_source *src,
 	struct gale_packet *msg,struct connect *avoid) 
 {
 	struct gale_text cat = null_text;
 	struct gale_packet *rewrite;
+	const int from_peer = (NULL != avoid && connect_is_peer(avoid));
+	int i,count = 0,is_latest;
+
+	/* The same message may arrive by several paths, or be retried. */
+	if (is_duplicate(msg)) return;
+	spool_add(msg,avoid);
+	is_latest = presence_add(msg);
+
 	while (gale_text_token(msg->routing,':',&cat)) {
 		struct gale_text host;
 		if (is_directed(cat,NULL,NULL,&host)) 
@@ -300,9 +611,24 @@ void subscr_transmit(
 
 	while (list != NULL) {
 		if (list->flag) {
-			gale_dprintf(4,"[%p] sending message\n",list->link);
-			send_connect(list->link,rewrite);
+			for (i = 0; i < list->num; ++i) {
+				struct connect * const link = list->member[i]->link;
+				/* Peers get their own copy from its source. */
+				if (link == avoid
+				|| (from_peer && list->member[i]->is_peer)) continue;
+				gale_dprintf(4,"[%p] sending message\n",link);
+				if (is_latest)
+					presence_send(link,rewrite);
+				else
+					send_connect(link,rewrite);
+				++count;
+			}
 		}
 		list = list->next;
 	}
+
+	if (NULL == fan_out)
+		fan_out = gale_make_histogram(
+			G_("galed_fan_out"),null_text,1,16);
+	gale_metric_observe(fan_out,count);
 }
@@ -8,6 +8,10 @@ struct connect;
 
 void add_subscr(oop_source *,struct gale_text,struct connect *);
 void remove_subscr(oop_source *,struct gale_text,struct connect *);
+void change_subscr(oop_source *,struct gale_text old,struct gale_text,
+                   struct connect *);
+struct gale_text subscr_interest(void);
+struct gale_packet *subscr_filter(struct gale_text,struct gale_packet *);
 void subscr_transmit(oop_source *,struct gale_packet *,struct connect *avoid);
 
 int category_flag(struct gale_text cat,struct gale_text *base);